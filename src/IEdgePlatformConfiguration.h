@@ -31,11 +31,12 @@ typedef struct
     unsigned int lowBatterySleepWakeInterval;
     system_tick_t postChargeSettleTime;
     unsigned int lowBatteryStartTime;
-    unsigned int lowBatteryDebounceTime;
     unsigned int chargingAwakeEvalTime;
     unsigned int chargingSleepEvalTime;
     uint16_t chargeCurrentHigh;
     uint16_t chargeCurrentLow;
+    uint16_t chargeCurrentStep;
+    uint16_t chargeCurrentUsbHost;
     uint16_t inputCurrent;
     unsigned int failedOtaKeepAwake;
     system_tick_t watchdogExpireTime;
@@ -60,11 +61,12 @@ public:
         commonCfg.lowBatterySleepWakeInterval = 15 * 60; // seconds to sample for low battery condition
         commonCfg.postChargeSettleTime = 500; // milliseconds
         commonCfg.lowBatteryStartTime = 20; // seconds to debounce low battery condition
-        commonCfg.lowBatteryDebounceTime = 5; // seconds to debounce low battery condition
         commonCfg.chargingAwakeEvalTime = 10; // seconds to sample the PMIC charging state
         commonCfg.chargingSleepEvalTime = 1; // seconds to sample the PMIC charging state
         commonCfg.chargeCurrentHigh = 1536; // milliamps
         commonCfg.chargeCurrentLow = 512; // milliamps
+        commonCfg.chargeCurrentStep = 256; // milliamps to raise the charge current per evaluation
+        commonCfg.chargeCurrentUsbHost = 512; // milliamps limit when powered from a USB host port
         commonCfg.inputCurrent = 2048; // milliamps
         commonCfg.failedOtaKeepAwake = 60; // seconds to stay awake after failed OTA
         commonCfg.watchdogExpireTime = 60 * 1000; // milliseconds to expire the WDT
@@ -16,6 +16,10 @@
 
 #include "LocationPublish.h"
 #include "tracker_location.h"
+#include "tracker_config_txn.h"
+#include "tracker_crc.h"
+#include "tracker_export.h"
+#include "tracker_trace.h"
 #include "tracker.h"
 
 constexpr int HIGH_PRIORITY = 0;
@@ -31,21 +35,104 @@ void locationGenerationCallback(JSONWriter &writer,
 
 void LocationPublish::init() {
     static ConfigObject store_forward("store", {
-        ConfigBool("enable", &store_config.enable),
-        ConfigInt("quota", &store_config.quota),
-        ConfigStringEnum("policy", {
-                {"drop_old", (int32_t) DiskQueuePolicy::FifoDeleteOld},
-                {"drop_new", (int32_t) DiskQueuePolicy::FifoDeleteNew}
-            }, &store_config.policy)
-    });
+            ConfigBool("enable", &store_config.enable),
+            ConfigInt("quota", &store_config.quota),
+            ConfigStringEnum("policy", {
+                    {"drop_old", (int32_t) DiskQueuePolicy::FifoDeleteOld},
+                    {"drop_new", (int32_t) DiskQueuePolicy::FifoDeleteNew}
+                }, &store_config.policy)
+        },
+        [](bool write, const void* context){ return 0; },
+        [this](bool write, int status, const void* context) {
+            //post what changed and leave applying it to tick()
+            if(write && !status) {
+                store_changes.notify(store_config_applied.diff(store_config));
+                TrackerConfigTransaction::instance().touch();
+            }
+            return status;
+        }
+    );
 
     ConfigService::instance().registerModule(store_forward);
+    TrackerConfigTransaction::instance().join("store", &store_config, sizeof(store_config));
 
     if(store_config.enable) {
         start();
     }
+    //the stored settings are applied above
+    store_config_applied = store_config;
+    (void)store_changes.take();
+
+    TrackerConfigTransaction::instance().regValidator([this](){
+        return (store_config.enable && (store_config.quota <= 0)) ?
+            (int)SYSTEM_ERROR_INVALID_ARGUMENT : (int)SYSTEM_ERROR_NONE;
+    });
 
     Tracker::instance().location.regLocGenCallback(locationGenerationCallback);
+
+    regExport();
+}
+
+//check that the front message is still the one being exported, the queue policy
+//may have dropped it to make room for a new message or the queue may have been reset
+bool LocationPublish::isExportFront() {
+    if (store_msg_queue.isEmpty() || (store_msg_queue.peekFrontSize() != _exportSize)) {
+        return false;
+    }
+
+    auto front = new uint8_t[_exportSize];
+    if (!front) {
+        return false;
+    }
+    store_msg_queue.peekFront(front, _exportSize);
+    auto same = (tracker_crc32(front, _exportSize) == _exportCrc);
+    delete[] front;
+
+    return same;
+}
+
+//export the oldest stored message, it is only removed once the host consumes it
+int LocationPublish::regExport() {
+    TrackerExportSource source = {
+        .name = "queue",
+        .open = [this](size_t& size) -> int {
+            delete[] _exportRecord;
+            _exportRecord = nullptr;
+            CHECK_TRUE(!store_msg_queue.isEmpty(), SYSTEM_ERROR_NOT_FOUND);
+
+            auto length = store_msg_queue.peekFrontSize();
+            _exportRecord = new uint8_t[length];
+            CHECK_TRUE(_exportRecord, SYSTEM_ERROR_NO_MEMORY);
+            store_msg_queue.peekFront(_exportRecord, length);
+            _exportSize = length;
+            _exportCrc = tracker_crc32(_exportRecord, length);
+            size = length;
+            return SYSTEM_ERROR_NONE;
+        },
+        .read = [this](size_t offset, uint8_t* data, size_t length) -> int {
+            CHECK_TRUE(_exportRecord, SYSTEM_ERROR_INVALID_STATE);
+            length = std::min(length, _exportSize - std::min(offset, _exportSize));
+            memcpy(data, _exportRecord + offset, length);
+            return (int)length;
+        },
+        .consume = [this]() -> int {
+            CHECK_TRUE(_exportRecord && isExportFront(), SYSTEM_ERROR_INVALID_STATE);
+            store_msg_queue.popFront();
+            if (_stats.queued) {
+                _stats.queued--;
+                _stats.queuedBytes -= std::min(_stats.queuedBytes, (uint32_t)_exportSize);
+            }
+            TrackerTrace::instance().record(TrackerTraceEvent::QUEUE_POP, 1, (uint16_t)_stats.queued);
+            return SYSTEM_ERROR_NONE;
+        },
+        .close = [this]() {
+            delete[] _exportRecord;
+            _exportRecord = nullptr;
+            _exportSize = 0;
+        },
+    };
+
+    return TrackerExport::instance().regSource(source);
 }
 
 void LocationPublish::start() {
@@ -54,30 +141,45 @@ void LocationPublish::start() {
                         store_config.policy) != SYSTEM_ERROR_NONE) {
         Log.error("Failed to start location publish disk queue");
     }
+    //messages kept from before boot are not counted until the queue drains
+    if(store_msg_queue.isEmpty()) {
+        _stats.depthKnown = true;
+    }
 }
 
 void LocationPublish::tick() {
-    static StoreConfig current_config = store_config;
-
-    //check if settings changed, if still enabled re-run start,
-    //if disabled stop the disk queue
-    if(current_config != store_config) {
+    //apply settings changed since the last tick, if still enabled re-run start,
+    //if disabled stop the disk queue. settings are held while a configuration
+    //transaction is open
+    if(!TrackerConfigTransaction::instance().isOpen() && store_changes.take()) {
         if(store_config.enable) {
             start();
         }
         else {
             factoryReset();
         }
-        current_config = store_config;
+        store_config_applied = store_config;
     }
 
-    //check if DiskQueue has messages to retry
-    if(!store_msg_queue.isEmpty() && isStoreEnabled() && Particle.connected()) {
+    //messages dropped by the queue policy are not seen here so resync when it drains
+    if(store_msg_queue.isEmpty()) {
+        _stats.queued = 0;
+        _stats.queuedBytes = 0;
+        _stats.depthKnown = true;
+    }
+
+    //check if DiskQueue has messages to retry, unless the front message is being exported
+    if(!store_msg_queue.isEmpty() && isStoreEnabled() && Particle.connected() && !_exportRecord) {
         CloudServicePublishFlags cloud_flags =
             (TrackerLocation::instance().isProcessAckEnabled()) ?
                 CloudServicePublishFlags::FULL_ACK : CloudServicePublishFlags::NONE;
 
         auto size = store_msg_queue.peekFrontSize();
+        if (_stats.queued) {
+            _stats.queued--;
+            _stats.queuedBytes -= std::min(_stats.queuedBytes, (uint32_t)size);
+        }
+        _stats.retries++;
         if (size > particle::protocol::MAX_EVENT_DATA_LENGTH) {
             Log.warn("Disk queue file size exceeds maximum message length; truncating");
             size = particle::protocol::MAX_EVENT_DATA_LENGTH;
@@ -85,12 +187,14 @@ void LocationPublish::tick() {
         store_msg_queue.peekFront(store_msg_buffer, size);
         store_msg_queue.popFront(); //ok to pop, disk_queue_cb will throw it back
         //on if it fails again and there's space in the disk queue
+        TrackerTrace::instance().record(TrackerTraceEvent::QUEUE_POP, 0, (uint16_t)_stats.queued);
 
         store_msg_buffer[size] = '\0'; // file data are not null terminated, but CloudService::send expects it
 
         //Priority level set to normal. don't want these to be high priority
         regPendingLocPubCallback(); //use the pending callback for this since
         //the exchange between pending vs the current hasn't occured yet
+        TrackerTrace::instance().record(TrackerTraceEvent::PUBLISH_SEND, 1, (uint16_t)size);
         CloudService::instance().send((const char*)store_msg_buffer,
             WITH_ACK,
             cloud_flags,
@@ -112,10 +216,15 @@ void LocationPublish::regPendingLocPubCallback() {
 
 int LocationPublish::disk_queue_cb(CloudServiceStatus status,
                                    const String &req_event) {
-    if((SUCCESS != status) && store_config.enable) {
+    if((SUCCESS != status) && isStoreEnabled()) {
         if(!store_msg_queue.pushBack(req_event)) {
             Log.warn("Unable to write location message to DiskQueue, discarding");
         }
+        else {
+            _stats.queued++;
+            _stats.queuedBytes += req_event.length();
+            TrackerTrace::instance().record(TrackerTraceEvent::QUEUE_PUSH, 0, (uint16_t)_stats.queued);
+        }
     }
     return 0;
 }
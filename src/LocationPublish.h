@@ -18,21 +18,41 @@
 
 #include "DiskQueue.h"
 #include "cloud_service.h"
+#include "tracker_config_notify.h"
 
 extern const int DEFAULT_DISK_LIMIT; //in KB
 extern const size_t KILOBYTE_CONSTANT;
 
+enum class StoreConfigField {
+    ENABLE,
+    QUOTA,
+    POLICY,
+};
+
 struct StoreConfig {
     int quota{DEFAULT_DISK_LIMIT};
     DiskQueuePolicy policy {DiskQueuePolicy::FifoDeleteOld};
     bool enable{false};
 
-    bool operator!=(const StoreConfig& other) const {
-        if((quota != other.quota) || (policy != other.policy) ||
-            (enable != other.enable)) {return true;}
-        else {return false;}
+    uint32_t diff(const StoreConfig& other) const {
+        using Change = TrackerConfigChange<StoreConfigField>;
+        return Change::diff(StoreConfigField::ENABLE, enable, other.enable) |
+            Change::diff(StoreConfigField::QUOTA, quota, other.quota) |
+            Change::diff(StoreConfigField::POLICY, policy, other.policy);
     }
 };
+/**
+ * @brief Store and forward counters.  Queue depth is tracked from pushes and pops made here and is
+ * an estimate when the disk queue policy deletes messages to stay within quota.  Messages stored before
+ * boot are not counted so depth is unknown until the queue has drained once.
+ */
+struct LocationPublishStats {
+    uint32_t queued;                /**< Messages waiting in the disk queue */
+    uint32_t queuedBytes;           /**< Bytes waiting in the disk queue */
+    uint32_t retries;               /**< Messages resent from the disk queue since boot */
+    bool depthKnown;                /**< queued and queuedBytes cover every message in the disk queue */
+};
+
 class LocationPublish {
 public:
     static LocationPublish& instance() {
@@ -103,15 +123,25 @@ public:
                       const String &req_event);
 
     /**
-     * @brief Return the state of the store_config.enable variable
+     * @brief Return the applied state of the store_config.enable variable
      *
      * @details Is the store and forward feature enabled. This returns
-     * its state
+     * the last applied state, writes staged in an open configuration
+     * transaction are not seen until it commits
      *
      * @return TRUE if enabled, FALSE if not
      */
     bool isStoreEnabled() const {
-        return store_config.enable;
+        return store_config_applied.enable;
+    }
+
+    /**
+     * @brief Get the store and forward counters
+     *
+     * @param[out] stats Current counters
+     */
+    void getStats(LocationPublishStats& stats) const {
+        stats = _stats;
     }
 
     /**
@@ -123,6 +153,9 @@ public:
     void factoryReset() {
         store_msg_queue.unlinkFiles(); //unlink the files first
         store_msg_queue.stop(); //then clear the files from _fileList
+        _stats.queued = 0;
+        _stats.queuedBytes = 0;
+        _stats.depthKnown = true;
     }
 
     //remove copy and assignment operators
@@ -132,6 +165,16 @@ public:
 private:
     LocationPublish() : store_msg_queue () {}
 
+    int regExport();
+    bool isExportFront();
+
+
     DiskQueue store_msg_queue;
     StoreConfig store_config;
+    StoreConfig store_config_applied;
+    TrackerConfigNotifier<StoreConfigField> store_changes;
+    LocationPublishStats _stats {};
+    uint8_t* _exportRecord {nullptr};   // front message while it is being exported, resends wait meanwhile
+    size_t _exportSize {0};
+    uint32_t _exportCrc {0};            // checked against the front message before it is consumed
 };
@@ -17,6 +17,8 @@
 #include <atomic>
 #include "environment.h"
 #include "tracker_sleep.h"
+#include "tracker_binlog.h"
+#include "tracker_threshold.h"
 #include "sht3x-i2c.h"
 
 // Configuration based on external temperature and humidity sensor
@@ -77,13 +79,6 @@ static ConfigData _environmentConfig = {
 //      }
 //  }
 
-enum class EnvState {
-  UNKNOWN,        //< Initial state
-  NORMAL,         //< Value is not outside limit and isn't pending a pass through the hysteresis limit
-  OUTSIDE_LIMIT,  //< Value is outside of the given limit
-  INSIDE_LIMIT,   //< Value is inside of the give limit and is pending a pass through the hysteresis limit
-};
-
 Sht3xi2c sensor(Wire3);
 TemperatureHumidityValidator Validator;
 
@@ -124,196 +119,50 @@ int environment_init() {
   return SYSTEM_ERROR_NONE;
 }
 
-// All state and variables related to high threshold evaluation
-static EnvState highState = EnvState::NORMAL;
-static std::atomic<size_t> highEvents(0);
-static size_t highEventsLast = 0;
-static bool highLatch = false;
-static EnvState humhighState = EnvState::NORMAL;
-static std::atomic<size_t> humhighEvents(0);
-static size_t humhighEventsLast = 0;
-static bool humhighLatch = false;
+// Threshold evaluation state
+static TrackerThreshold highTemperature(TrackerThresholdSide::ABOVE);
+static TrackerThreshold lowTemperature(TrackerThresholdSide::BELOW);
+static TrackerThreshold highHumidity(TrackerThresholdSide::ABOVE);
+static TrackerThreshold lowHumidity(TrackerThresholdSide::BELOW);
 
 size_t environment_high_temperature_events() {
-  auto eventsCapture = highEvents.load();
-  auto eventsCount = eventsCapture - highEventsLast;
-  highEventsLast = eventsCapture;
-  return (_environmentConfig.highLatch) ? highLatch : eventsCount;
+  return highTemperature.events(_environmentConfig.highLatch);
 }
 
 size_t environment_high_humidity_events() {
-  auto eventsCapture = humhighEvents.load();
-  auto eventsCount = eventsCapture - humhighEventsLast;
-  humhighEventsLast = eventsCapture;
-  return (_environmentConfig.humhighLatch) ? humhighLatch : eventsCount;
+  return highHumidity.events(_environmentConfig.humhighLatch);
 }
 
-// All state and variables related to low threshold evaluation
-static EnvState lowState = EnvState::NORMAL;
-static std::atomic<size_t> lowEvents(0);
-static size_t lowEventsLast = 0;
-static bool lowLatch = false;
-static EnvState humlowState = EnvState::NORMAL;
-static std::atomic<size_t> humlowEvents(0);
-static size_t humlowEventsLast = 0;
-static bool humlowLatch = false;
-
 size_t environment_low_temperature_events() {
-  auto eventsCapture = lowEvents.load();
-  auto eventsCount = eventsCapture - lowEventsLast;
-  lowEventsLast = eventsCapture;
-  return (_environmentConfig.lowLatch) ? lowLatch : eventsCount;
+  return lowTemperature.events(_environmentConfig.lowLatch);
 }
 
 size_t environment_low_humidity_events() {
-  auto eventsCapture = humlowEvents.load();
-  auto eventsCount = eventsCapture - humlowEventsLast;
-  humlowEventsLast = eventsCapture;
-  return (_environmentConfig.humlowLatch) ? humlowLatch : eventsCount;
+  return lowHumidity.events(_environmentConfig.humlowLatch);
 }
 
 void evaluate_user_environment(Environment environment) {
   // *** TEMPERATURE ***
-  // Evaluate environment against high threshold
   if (_environmentConfig.highEnable) {
-    switch (highState) {
-      case EnvState::UNKNOWN:
-        highState = EnvState::NORMAL;
-        // Fall through
-      case EnvState::NORMAL: {
-        if (environment.Temperature >= _environmentConfig.highThreshold) {
-          highEvents++;
-          highLatch = true;
-          highState = EnvState::OUTSIDE_LIMIT;
-        }
-        break;
-      }
-
-      case EnvState::OUTSIDE_LIMIT: {
-        if (environment.Temperature < _environmentConfig.highThreshold) {
-          highState = EnvState::INSIDE_LIMIT;
-        }
-        break;
-      }
-
-      case EnvState::INSIDE_LIMIT: {
-        if (environment.Temperature <= _environmentConfig.highThreshold - _environmentConfig.hysteresis) {
-          highLatch = false;
-          highState = EnvState::NORMAL;
-        }
-        else if (environment.Temperature >= _environmentConfig.highThreshold) {
-          highState = EnvState::OUTSIDE_LIMIT;
-        }
-        break;
-      }
-    }
+    highTemperature.evaluate(environment.Temperature, _environmentConfig.highThreshold, _environmentConfig.hysteresis);
   }
-
-  // Evaluate environment against low threshold
   if (_environmentConfig.lowEnable) {
-    switch (lowState) {
-      case EnvState::UNKNOWN:
-        lowState = EnvState::NORMAL;
-        // Fall through
-      case EnvState::NORMAL: {
-        if (environment.Temperature <= _environmentConfig.lowThreshold) {
-          lowEvents++;
-          lowLatch = true;
-          lowState = EnvState::OUTSIDE_LIMIT;
-        }
-        break;
-      }
-
-      case EnvState::OUTSIDE_LIMIT: {
-        if (environment.Temperature > _environmentConfig.lowThreshold) {
-          lowState = EnvState::INSIDE_LIMIT;
-        }
-        break;
-      }
-
-      case EnvState::INSIDE_LIMIT: {
-        if (environment.Temperature >= _environmentConfig.lowThreshold + _environmentConfig.hysteresis) {
-          lowLatch = false;
-          lowState = EnvState::NORMAL;
-        }
-        else if (environment.Temperature <= _environmentConfig.lowThreshold) {
-          lowState = EnvState::OUTSIDE_LIMIT;
-        }
-        break;
-      }
-    }
+    lowTemperature.evaluate(environment.Temperature, _environmentConfig.lowThreshold, _environmentConfig.hysteresis);
   }
-// *** HUMIDITY ***
-    // Evaluate environment against high threshold
-  if (_environmentConfig.humhighEnable) {
-    switch (humhighState) {
-      case EnvState::UNKNOWN:
-        humhighState = EnvState::NORMAL;
-        // Fall through
-      case EnvState::NORMAL: {
-        if (environment.Humidity >= _environmentConfig.humhighThreshold) {
-          humhighEvents++;
-          humhighLatch = true;
-          humhighState = EnvState::OUTSIDE_LIMIT;
-        }
-        break;
-      }
-
-      case EnvState::OUTSIDE_LIMIT: {
-        if (environment.Humidity < _environmentConfig.humhighThreshold) {
-          humhighState = EnvState::INSIDE_LIMIT;
-        }
-        break;
-      }
 
-      case EnvState::INSIDE_LIMIT: {
-        if (environment.Humidity <= _environmentConfig.humhighThreshold - _environmentConfig.humhysteresis) {
-          humhighLatch = false;
-          humhighState = EnvState::NORMAL;
-        }
-        else if (environment.Humidity >= _environmentConfig.humhighThreshold) {
-          humhighState = EnvState::OUTSIDE_LIMIT;
-        }
-        break;
-      }
-    }
+  // *** HUMIDITY ***
+  if (_environmentConfig.humhighEnable) {
+    highHumidity.evaluate(environment.Humidity, _environmentConfig.humhighThreshold, _environmentConfig.humhysteresis);
   }
-
-  // Evaluate environment against low threshold
   if (_environmentConfig.humlowEnable) {
-    switch (humlowState) {
-      case EnvState::UNKNOWN:
-        humlowState = EnvState::NORMAL;
-        // Fall through
-      case EnvState::NORMAL: {
-        if (environment.Humidity <= _environmentConfig.humlowThreshold) {
-          humlowEvents++;
-          humlowLatch = true;
-          humlowState = EnvState::OUTSIDE_LIMIT;
-        }
-        break;
-      }
-
-      case EnvState::OUTSIDE_LIMIT: {
-        if (environment.Humidity > _environmentConfig.humlowThreshold) {
-          humlowState = EnvState::INSIDE_LIMIT;
-        }
-        break;
-      }
-
-      case EnvState::INSIDE_LIMIT: {
-        if (environment.Humidity >= _environmentConfig.humlowThreshold + _environmentConfig.humhysteresis) {
-          humlowLatch = false;
-          humlowState = EnvState::NORMAL;
-        }
-        else if (environment.Humidity <= _environmentConfig.humlowThreshold) {
-          humlowState = EnvState::OUTSIDE_LIMIT;
-        }
-        break;
-      }
-    }
+    lowHumidity.evaluate(environment.Humidity, _environmentConfig.humlowThreshold, _environmentConfig.humhysteresis);
   }
+}
+
+static unsigned int sample_interval_sec = EnvironmentSampleIntervalDefault;
 
+void environment_set_sample_interval(unsigned int seconds) {
+    sample_interval_sec = seconds;
 }
 
 Environment get_environment() {
@@ -321,17 +170,17 @@ Environment get_environment() {
     static uint32_t update_loop_sec = 0;
 
     //don't poll the sensor too often
-    if((System.uptime() - update_loop_sec) >= 2) {
+    if((System.uptime() - update_loop_sec) >= sample_interval_sec) {
         double temp, humid;
         int err = sensor.get_reading(&temp, &humid);
         if (err == 0)
         {
-            Log.info("temp=%.2lf hum=%.2lf", temp, humid);
+            TrackerBinLog::instance().log(TrackerBinLogId::ENV_SAMPLE, temp, humid);
             Validator.addSample(temp, humid);
             results = { temp, humid };
         }
         else {
-            Log.info("no sensor err=%d", err);
+            TrackerBinLog::instance().log(TrackerBinLogId::ENV_NO_SENSOR, err);
         }
         update_loop_sec = System.uptime();
     }
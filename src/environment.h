@@ -51,6 +51,9 @@ constexpr double ExternalHumidityLowDefault = 25.0; // percent
 // Default humidity hysteresis
 constexpr double ExternalHumidityHysteresisDefault = 5.0; // percent
 
+// Default time between sensor readings
+constexpr unsigned int EnvironmentSampleIntervalDefault = 2; // seconds
+
 /**
  * @brief Get the current temperature and current humidity
  *
@@ -86,6 +89,13 @@ size_t environment_high_humidity_events();
  */
 size_t environment_low_humidity_events();
 
+/**
+ * @brief Set the time between sensor readings.
+ *
+ * @param seconds Minimum number of seconds between readings.
+ */
+void environment_set_sample_interval(unsigned int seconds);
+
 /**
  * @brief Initialize the environment sampling feature.
  *
@@ -17,6 +17,8 @@
 #include "Particle.h"
 #include "tracker_config.h"
 #include "tracker.h"
+#include "tracker_power.h"
+#include "tracker_profile.h"
 #include "environment.h"
 
 
@@ -46,43 +48,9 @@ void loc_gen_cb(JSONWriter &writer, LocationPoint &point, const void *context)
     writer.name("env_t").value(Validator.getTemperatureC());
     writer.name("env_h").value(Validator.getHumidity());
  
-    int ps = System.powerSource();
-
-    writer.name("pwr").value(ps);
+    writer.name("pwr").value((int)TrackerPower::instance().getSource());
 }
 
-bool powerState()
-{
-    static bool oldPowerState = true; // assume we boot up with power connected -- we'll complain as soon as we know different
-    bool newPowerState = false;
-    power_source_t ps = (power_source_t)System.powerSource();
-
-    switch(ps) {
-        case POWER_SOURCE_VIN:
-        case POWER_SOURCE_USB_HOST:
-        case POWER_SOURCE_USB_ADAPTER:
-        case POWER_SOURCE_USB_OTG: {
-            newPowerState = true;
-            break;
-        }
-        
-        case POWER_SOURCE_UNKNOWN:
-        case POWER_SOURCE_BATTERY:
-        default: {
-            newPowerState = false;
-            break;
-        }
-
-    }
-
-    if (oldPowerState != newPowerState) {
-        Tracker::instance().location.triggerLocPub(Trigger::IMMEDIATE,(oldPowerState == true ? "pwr_l" : "pwr_r"));
-        oldPowerState = newPowerState;
-    }
- 
-    return oldPowerState;
-};
-
 void envState()
 {
     if (environment_high_temperature_events())
@@ -129,12 +97,16 @@ void setup()
     Tracker::instance().location.regLocGenCallback(loc_gen_cb);
     Particle.function("motionControl", remoteControlMotionDetection);
     environment_init();
+
+    // Follow the sensor rate of the active operating profile
+    TrackerProfile::instance().regChangeCallback([](TrackerProfileId id, const tracker_profile_settings_t& settings){
+        environment_set_sample_interval((settings.sensor_seconds) ? (unsigned int)settings.sensor_seconds : EnvironmentSampleIntervalDefault);
+    });
 }
 
 void loop()
 {
     environment_tick();
     envState();
-    powerState();
     Tracker::instance().loop();
 }
@@ -18,6 +18,7 @@
 #include "tracker_config.h"
 #include "motion_service.h"
 #include "tracker_imu.h"
+#include "tracker_perf.h"
 
 using namespace spark;
 using namespace particle;
@@ -119,6 +120,7 @@ int MotionService::start(size_t eventDepth) {
         Log.error("os_thread_create() failed");
         return ret;
     }
+    TrackerPerf::instance().regThread(thread_);
 
     return SYSTEM_ERROR_NONE;
 }
@@ -268,12 +270,16 @@ void MotionService::thread(void* context) {
                 if (IMU.isHighGDetect(status)) {
                     self->counters_.highGEvents++;
                     MotionEvent event = { .source = MotionSource::MOTION_HIGH_G };
-                    os_queue_put(self->motionEventQueue_, &event, 0, nullptr);
+                    if (os_queue_put(self->motionEventQueue_, &event, 0, nullptr)) {
+                        self->counters_.droppedEvents++;
+                    }
                 }
                 if (IMU.isMotionDetect(status)) {
                     self->counters_.motionEvents++;
                     MotionEvent event = { .source = MotionSource::MOTION_MOVEMENT };
-                    os_queue_put(self->motionEventQueue_, &event, 0, nullptr);
+                    if (os_queue_put(self->motionEventQueue_, &event, 0, nullptr)) {
+                        self->counters_.droppedEvents++;
+                    }
                 }
                 break;
             }
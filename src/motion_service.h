@@ -61,6 +61,7 @@ struct MotionCounters {
     size_t motionEvents;            /**< Count of motion events from inertial motion units */
     size_t highGEvents;             /**< Count of high G events from inertial motion units */
     size_t breakEvents;             /**< Count of graceful thread exits */
+    size_t droppedEvents;           /**< Count of motion events lost because the event queue was full */
 };
 
 /**
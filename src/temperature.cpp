@@ -15,11 +15,14 @@
  */
 
 #include <atomic>
+#include <cmath>
 #include "EdgePlatform.h"
 #include "Sts3x.h"
 #include "thermistor.h"
 #include "temperature.h"
 #include "tracker_sleep.h"
+#include "tracker_binlog.h"
+#include "tracker_threshold.h"
 
 
 // Configuration based on Panasonic ERTJ1VR104FM NTC thermistor
@@ -70,32 +73,79 @@ static ConfigData _temperatureConfig = {
 //      }
 //  }
 
-enum class TempState {
-  UNKNOWN,        //< Initial state
-  NORMAL,         //< Value is not outside limit and isn't pending a pass through the hysteresis limit
-  OUTSIDE_LIMIT,  //< Value is outside of the given limit
-  INSIDE_LIMIT,   //< Value is inside of the give limit and is pending a pass through the hysteresis limit
-};
-
 enum class TempChargeState {
   UNKNOWN,                //< Initial state
   NORMAL,                 //< Value is not outside limit and isn't pending a pass through the hysteresis limit
   OVER_TEMPERATURE,       //< Value is above the upper given limit
   UNDER_TEMPERATURE,      //< Value is below the lower given limit
   OVER_CHARGE_REDUCTION,  //< Value is above the intermediate given limit
+  UNDER_CHARGE_REDUCTION, //< Value is below the intermediate cold limit
+  SENSOR_FAULT,           //< No plausible reading is available
 };
 
 
 static Thermistor _thermistor;
 static Sts3x _sts(Wire, Sts3x::AddrA, PIN_INVALID);
+static bool _thermistorReady = false;
+static bool _stsReady = false;
 static TemperatureCallback _eventCallback = nullptr;
 static unsigned int chargeEvalTick = 0;
+static std::atomic<uint32_t> _stsErrors(0);
 
 void onWake(TrackerSleepContext context) {
   // Allow evaluation immediately after wake
   chargeEvalTick = 0;
 }
 
+static bool isPlausible(float temperature) {
+  return !std::isnan(temperature) &&
+    (temperature > ChargeTempPlausibleMin) &&
+    (temperature < ChargeTempPlausibleMax);
+}
+
+static float read_thermistor() {
+  if (!_thermistorReady) {
+    return NAN;
+  }
+  return _thermistor.getTemperature();
+}
+
+static float read_sts() {
+  float temp {};
+  if (!_stsReady) {
+    return NAN;
+  }
+  if (!_sts.singleMeasurement(temp)) {
+    _stsErrors++;
+    return NAN;
+  }
+  return temp;
+}
+
+// Combine the two readings.  When they disagree the one furthest from the middle of the normal
+// charging band is used since it is the more restrictive for charging.
+static float fuse_temperature(float thermistor, float sts) {
+  bool thermistorValid = isPlausible(thermistor);
+  bool stsValid = isPlausible(sts);
+
+  if (thermistorValid && stsValid) {
+    if (std::abs(thermistor - sts) <= ChargeTempDisagreeLimit) {
+      return (thermistor + sts) / 2.0f;
+    }
+    const float middle = (float)((ChargeTempReducedColdLimit + ChargeTempReducedALimit) / 2.0);
+    return (std::abs(thermistor - middle) >= std::abs(sts - middle)) ? thermistor : sts;
+  }
+  else if (thermistorValid) {
+    return thermistor;
+  }
+  else if (stsValid) {
+    return sts;
+  }
+
+  return NAN;
+}
+
+// Reports the primary sensor only, the fused temperature is for charge control
 float get_temperature() {
   if (EdgePlatform::instance().getSensirionType() != EdgePlatform::SensirionType::eSENSE_INVALID) {
     float temp {};
@@ -107,10 +157,14 @@ float get_temperature() {
 }
 
 int temperature_init(pin_t analogPin, TemperatureCallback eventCallback) {
+  // Both sensors are used for charge control when the STS3x is fitted
   if (EdgePlatform::instance().getSensirionType() != EdgePlatform::SensirionType::eSENSE_INVALID) {
     CHECK_TRUE(_sts.init(), SYSTEM_ERROR_INTERNAL);
+    _stsReady = true;
+    _thermistorReady = (SYSTEM_ERROR_NONE == _thermistor.begin(analogPin, _thermistorConfig));
   } else {
     CHECK(_thermistor.begin(analogPin, _thermistorConfig));
+    _thermistorReady = true;
   }
 
   static ConfigObject _serviceObject
@@ -131,106 +185,33 @@ int temperature_init(pin_t analogPin, TemperatureCallback eventCallback) {
 
   _eventCallback = eventCallback;
 
-  void onWake(TrackerSleepContext context);
+  TrackerSleep::instance().registerWake(onWake);
 
   return SYSTEM_ERROR_NONE;
 }
 
-// All state and variables related to high threshold evaluation
-static TempState highState = TempState::NORMAL;
-static std::atomic<size_t> highEvents(0);
-static size_t highEventsLast = 0;
-static bool highLatch = false;
+// Threshold evaluation state
+static TrackerThreshold highTemperature(TrackerThresholdSide::ABOVE);
+static TrackerThreshold lowTemperature(TrackerThresholdSide::BELOW);
 
-size_t temperature_high_events() {
-  auto eventsCapture = highEvents.load();
-  auto eventsCount = eventsCapture - highEventsLast;
-  highEventsLast = eventsCapture;
-  return (_temperatureConfig.highLatch) ? highLatch : eventsCount;
+uint32_t temperature_i2c_errors() {
+  return _stsErrors;
 }
 
-// All state and variables related to low threshold evaluation
-static TempState lowState = TempState::NORMAL;
-static std::atomic<size_t> lowEvents(0);
-static size_t lowEventsLast = 0;
-static bool lowLatch = false;
+size_t temperature_high_events() {
+  return highTemperature.events(_temperatureConfig.highLatch);
+}
 
 size_t temperature_low_events() {
-  auto eventsCapture = lowEvents.load();
-  auto eventsCount = eventsCapture - lowEventsLast;
-  lowEventsLast = eventsCapture;
-  return (_temperatureConfig.lowLatch) ? lowLatch : eventsCount;
+  return lowTemperature.events(_temperatureConfig.lowLatch);
 }
 
 void evaluate_user_temperature(float temperature) {
-  // Evaluate temperature against high threshold
   if (_temperatureConfig.highEnable) {
-    switch (highState) {
-      case TempState::UNKNOWN:
-        highState = TempState::NORMAL;
-        // Fall through
-      case TempState::NORMAL: {
-        if (temperature >= _temperatureConfig.highThreshold) {
-          highEvents++;
-          highLatch = true;
-          highState = TempState::OUTSIDE_LIMIT;
-        }
-        break;
-      }
-
-      case TempState::OUTSIDE_LIMIT: {
-        if (temperature < _temperatureConfig.highThreshold) {
-          highState = TempState::INSIDE_LIMIT;
-        }
-        break;
-      }
-
-      case TempState::INSIDE_LIMIT: {
-        if (temperature <= _temperatureConfig.highThreshold - _temperatureConfig.hysteresis) {
-          highLatch = false;
-          highState = TempState::NORMAL;
-        }
-        else if (temperature >= _temperatureConfig.highThreshold) {
-          highState = TempState::OUTSIDE_LIMIT;
-        }
-        break;
-      }
-    }
+    highTemperature.evaluate(temperature, _temperatureConfig.highThreshold, _temperatureConfig.hysteresis);
   }
-
-  // Evaluate temperature against low threshold
   if (_temperatureConfig.lowEnable) {
-    switch (lowState) {
-      case TempState::UNKNOWN:
-        lowState = TempState::NORMAL;
-        // Fall through
-      case TempState::NORMAL: {
-        if (temperature <= _temperatureConfig.lowThreshold) {
-          lowEvents++;
-          lowLatch = true;
-          lowState = TempState::OUTSIDE_LIMIT;
-        }
-        break;
-      }
-
-      case TempState::OUTSIDE_LIMIT: {
-        if (temperature > _temperatureConfig.lowThreshold) {
-          lowState = TempState::INSIDE_LIMIT;
-        }
-        break;
-      }
-
-      case TempState::INSIDE_LIMIT: {
-        if (temperature >= _temperatureConfig.lowThreshold + _temperatureConfig.hysteresis) {
-          lowLatch = false;
-          lowState = TempState::NORMAL;
-        }
-        else if (temperature <= _temperatureConfig.lowThreshold) {
-          lowState = TempState::OUTSIDE_LIMIT;
-        }
-        break;
-      }
-    }
+    lowTemperature.evaluate(temperature, _temperatureConfig.lowThreshold, _temperatureConfig.hysteresis);
   }
 }
 
@@ -242,7 +223,21 @@ int alertEventListener(TemperatureChargeEvent event) {
   return SYSTEM_ERROR_NOT_SUPPORTED;
 }
 
-TempChargeState toChargeState(TempChargeState state) {
+static const char* chargeStateName(TempChargeState state) {
+  switch (state) {
+    case TempChargeState::NORMAL: return "normal";
+    case TempChargeState::OVER_TEMPERATURE: return "over";
+    case TempChargeState::UNDER_TEMPERATURE: return "under";
+    case TempChargeState::OVER_CHARGE_REDUCTION: return "over reduced";
+    case TempChargeState::UNDER_CHARGE_REDUCTION: return "under reduced";
+    case TempChargeState::SENSOR_FAULT: return "sensor fault";
+    default: return "unknown";
+  }
+}
+
+TempChargeState toChargeState(TempChargeState from, TempChargeState state, float temperature) {
+  TrackerBinLog::instance().log(TrackerBinLogId::CHARGE_TEMPERATURE, temperature, chargeStateName(from), chargeStateName(state));
+
   switch (state) {
     case TempChargeState::UNKNOWN:
       break;
@@ -263,12 +258,83 @@ TempChargeState toChargeState(TempChargeState state) {
       alertEventListener(TemperatureChargeEvent::OVER_CHARGE_REDUCTION);
       break;
 
+    case TempChargeState::UNDER_CHARGE_REDUCTION:
+      alertEventListener(TemperatureChargeEvent::UNDER_CHARGE_REDUCTION);
+      break;
+
+    case TempChargeState::SENSOR_FAULT:
+      alertEventListener(TemperatureChargeEvent::SENSOR_FAULT);
+      break;
   }
 
   return state;
 }
 
-void evaluate_charge_temperature(float temperature) {
+// Temperature band without hysteresis
+static TempChargeState chargeBand(float temperature) {
+  if (temperature <= ChargeTempLowLimit) { // Inclusive
+    return TempChargeState::UNDER_TEMPERATURE;
+  }
+  else if (temperature >= ChargeTempHighLimit) { // Inclusive
+    return TempChargeState::OVER_TEMPERATURE;
+  }
+  else if (temperature >= ChargeTempReducedALimit) { // Inclusive
+    return TempChargeState::OVER_CHARGE_REDUCTION;
+  }
+  else if (temperature < ChargeTempReducedColdLimit) { // Exclusive
+    return TempChargeState::UNDER_CHARGE_REDUCTION;
+  }
+  return TempChargeState::NORMAL;
+}
+
+// Distance of a band from normal charging; moving further from normal happens at the limit itself
+// while moving back towards normal requires passing the limit by the hysteresis
+static int chargeBandRank(TempChargeState state) {
+  switch (state) {
+    case TempChargeState::UNDER_TEMPERATURE: return -2;
+    case TempChargeState::UNDER_CHARGE_REDUCTION: return -1;
+    case TempChargeState::OVER_CHARGE_REDUCTION: return 1;
+    case TempChargeState::OVER_TEMPERATURE: return 2;
+    default: return 0;
+  }
+}
+
+// A reading that jumps too far from the previous evaluation is held at the last accepted value until
+// the next evaluation confirms it, so a single sensor does not fault charging while it waits
+static float confirm_reading(const char* name, float reading, float& last, float& accepted) {
+  if (isPlausible(reading) && isPlausible(last) && (std::abs(reading - last) > ChargeTempMaxStep)) {
+    Log.warn("%s moved from %.1f to %.1f; waiting for confirmation", name, last, reading);
+  }
+  else {
+    accepted = reading;
+  }
+  last = reading;
+
+  return accepted;
+}
+
+// Take a reading from each sensor and reject those that are out of range or jump too far from the
+// previous evaluation.
+static float charge_temperature() {
+  static float lastThermistor = NAN;
+  static float acceptedThermistor = NAN;
+  static float lastSts = NAN;
+  static float acceptedSts = NAN;
+  static bool disagreeLogged = false;
+
+  float thermistorUsed = confirm_reading("Thermistor", read_thermistor(), lastThermistor, acceptedThermistor);
+  float stsUsed = confirm_reading("STS3x", read_sts(), lastSts, acceptedSts);
+
+  bool disagree = isPlausible(thermistorUsed) && isPlausible(stsUsed) && (std::abs(thermistorUsed - stsUsed) > ChargeTempDisagreeLimit);
+  if (disagree && !disagreeLogged) {
+    Log.warn("Thermistor %.1f and STS3x %.1f disagree; using the more restrictive", thermistorUsed, stsUsed);
+  }
+  disagreeLogged = disagree;
+
+  return fuse_temperature(thermistorUsed, stsUsed);
+}
+
+void evaluate_charge_temperature() {
   static TempChargeState chargeTempState = TempChargeState::UNKNOWN;
 
   unsigned int evalLoopInterval = TrackerSleep::instance().isSleepDisabled() ? ChargeTickAwakeEvalInterval : ChargeTickSleepEvalInterval;
@@ -278,14 +344,9 @@ void evaluate_charge_temperature(float temperature) {
 
   chargeEvalTick = System.uptime();
 
-  bool isTempHigh = (temperature >= ChargeTempHighLimit); // Inclusive
-  bool isTempBelowHighHyst = (temperature <= (ChargeTempHighLimit - ChargeTempHyst)); // Inclusive
-  bool isTempReducedA = (temperature >= ChargeTempReducedALimit); // Inclusive
-  bool isTempReducedAHyst = (temperature <= (ChargeTempReducedALimit - ChargeTempHyst)); // Inclusive
-  bool isTempLow = (temperature <= ChargeTempLowLimit); // Inclusive
-  bool isTempAboveLowHyst = (temperature >= (ChargeTempLowLimit + ChargeTempHyst)); // Inclusive
+  float temperature = charge_temperature();
 
-  // The states are defined as follows:
+  // The bands are defined as follows:
   //
   //    OVER_TEMPERATURE
   //  --------------------------------------------------------^ 54 degC  (ChargeTempHighLimit)
@@ -296,100 +357,46 @@ void evaluate_charge_temperature(float temperature) {
   //    NORMAL ^                    OVER_CHARGE_REDUCTION v     39 degC
   //  --------------------------------------------------------v 38 degC  (ChargeTempReducedALimit - ChargeTempHyst)
   //    NORMAL
+  //  --------------------------------------------------------^ 12 degC  (ChargeTempReducedColdLimit + ChargeTempHyst)
+  //    UNDER_CHARGE_REDUCTION ^    NORMAL v                    11 degC
+  //  --------------------------------------------------------v 10 degC  (ChargeTempReducedColdLimit)
+  //    UNDER_CHARGE_REDUCTION
   //  --------------------------------------------------------^ 2 degC   (ChargeTempLowLimit + ChargeTempHyst)
-  //    UNDER_TEMPERATURE ^         NORMAL v                    1 degC
+  //    UNDER_TEMPERATURE ^         UNDER_CHARGE_REDUCTION v    1 degC
   //  --------------------------------------------------------v 0 degC   (ChargeTempLowLimit)
   //    UNDER_TEMPERATURE
   //
+  // Without a plausible reading from either sensor charging is stopped until one returns.
 
-  switch (chargeTempState) {
-    //
-    // Initial state at boot
-    //
-    case TempChargeState::UNKNOWN: {
-      if (isTempLow) {
-        chargeTempState = toChargeState(TempChargeState::UNDER_TEMPERATURE);
-      }
-      else if (isTempHigh) {
-        chargeTempState = toChargeState(TempChargeState::OVER_TEMPERATURE);
-      }
-      else if (isTempReducedA) {
-        chargeTempState = toChargeState(TempChargeState::OVER_CHARGE_REDUCTION);
-      }
-      else {
-        chargeTempState = toChargeState(TempChargeState::NORMAL);
-      }
-
-      break;
-    }
-
-    //
-    // No limits were breached
-    //
-    case TempChargeState::NORMAL: {
-      if (isTempLow) {
-        chargeTempState = toChargeState(TempChargeState::UNDER_TEMPERATURE);
-      }
-      else if (isTempHigh) {
-        chargeTempState = toChargeState(TempChargeState::OVER_TEMPERATURE);
-      }
-      else if (isTempReducedA) {
-        chargeTempState = toChargeState(TempChargeState::OVER_CHARGE_REDUCTION);
+  TempChargeState next;
+  if (std::isnan(temperature)) {
+    next = TempChargeState::SENSOR_FAULT;
+  }
+  else if ((chargeTempState == TempChargeState::UNKNOWN) || (chargeTempState == TempChargeState::SENSOR_FAULT)) {
+    next = chargeBand(temperature);
+  }
+  else {
+    auto rank = chargeBandRank(chargeTempState);
+    next = chargeBand(temperature);
+    auto nextRank = chargeBandRank(next);
+
+    // Moving towards normal on the same side needs the hysteresis to be passed as well
+    if ((rank < 0) && (nextRank > rank) && (nextRank <= 0)) {
+      next = chargeBand(temperature - (float)ChargeTempHyst);
+      if (chargeBandRank(next) < rank) {
+        next = chargeTempState;
       }
-
-      break;
     }
-
-    //
-    // Under normal charging operation
-    //
-    case TempChargeState::UNDER_TEMPERATURE: {
-      if (isTempHigh) {
-        chargeTempState = toChargeState(TempChargeState::OVER_TEMPERATURE);
-      }
-      else if (isTempReducedA) {
-        chargeTempState = toChargeState(TempChargeState::OVER_CHARGE_REDUCTION);
+    else if ((rank > 0) && (nextRank < rank) && (nextRank >= 0)) {
+      next = chargeBand(temperature + (float)ChargeTempHyst);
+      if (chargeBandRank(next) > rank) {
+        next = chargeTempState;
       }
-      else if (isTempAboveLowHyst) {
-        chargeTempState = toChargeState(TempChargeState::NORMAL);
-      }
-
-      break;
     }
+  }
 
-    //
-    // Above normal charging operation
-    //
-    case TempChargeState::OVER_TEMPERATURE: {
-      if (isTempLow) {
-        chargeTempState = toChargeState(TempChargeState::UNDER_TEMPERATURE);
-      }
-      else if (isTempBelowHighHyst && isTempReducedA) {
-        chargeTempState = toChargeState(TempChargeState::OVER_CHARGE_REDUCTION);
-      }
-      else if (isTempReducedAHyst) {
-        chargeTempState = toChargeState(TempChargeState::NORMAL);
-      }
-
-      break;
-    }
-
-    //
-    // Above normal charging operation
-    //
-    case TempChargeState::OVER_CHARGE_REDUCTION: {
-      if (isTempHigh) {
-        chargeTempState = toChargeState(TempChargeState::OVER_TEMPERATURE);
-      }
-      else if (isTempLow) {
-        chargeTempState = toChargeState(TempChargeState::UNDER_TEMPERATURE);
-      }
-      else if (isTempReducedAHyst) {
-        chargeTempState = toChargeState(TempChargeState::NORMAL);
-      }
-
-      break;
-    }
+  if (next != chargeTempState) {
+    chargeTempState = toChargeState(chargeTempState, next, temperature);
   }
 }
 
@@ -397,7 +404,7 @@ int temperature_tick() {
   float temperature = get_temperature();
 
   evaluate_user_temperature(temperature);
-  evaluate_charge_temperature(temperature);
+  evaluate_charge_temperature();
 
   return SYSTEM_ERROR_NONE;
 }
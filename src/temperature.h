@@ -25,6 +25,8 @@ enum class TemperatureChargeEvent {
   OVER_TEMPERATURE,       //< Over temperature condition
   UNDER_TEMPERATURE,      //< Under temperature condition
   OVER_CHARGE_REDUCTION,  //< Over temperature for reduced charge condition
+  UNDER_CHARGE_REDUCTION, //< Under temperature for reduced charge condition
+  SENSOR_FAULT,           //< No plausible temperature reading
 };
 
 using TemperatureCallback = std::function<int(TemperatureChargeEvent)>;
@@ -48,9 +50,23 @@ constexpr double ChargeTempLowLimit = 0.0; // degrees celsius
 // High limit to reduce battery charging current (inclusive)
 constexpr double ChargeTempReducedALimit = 40.0; // degrees celsius
 
+// Low limit to reduce battery charging current (exclusive)
+constexpr double ChargeTempReducedColdLimit = 10.0; // degrees celsius
+
 // Hysteresis applied to high/low limits to re-enable battery charging
 constexpr double ChargeTempHyst = 2.0; // degrees celsius
 
+// Thermistor and STS3x readings further apart than this are treated as a disagreement
+constexpr float ChargeTempDisagreeLimit = 5.0; // degrees celsius
+
+// A reading that moves further than this from the previous charge evaluation is not trusted
+// until it is confirmed by the next evaluation
+constexpr float ChargeTempMaxStep = 10.0; // degrees celsius
+
+// Plausible range of readings for charge control
+constexpr float ChargeTempPlausibleMin = -40.0; // degrees celsius
+constexpr float ChargeTempPlausibleMax = 100.0; // degrees celsius
+
 // Rate, in seconds, to sample the temperature and evaluate battery charge enablement when awake
 constexpr unsigned int ChargeTickAwakeEvalInterval = 30; // seconds
 
@@ -60,10 +76,19 @@ constexpr unsigned int ChargeTickSleepEvalInterval = 1; // seconds
 /**
  * @brief Get the current temperature
  *
+ * @details When both the thermistor and STS3x give plausible readings they are combined.
+ *
  * @return float Current temperature in degrees celsius.
  */
 float get_temperature();
 
+/**
+ * @brief Get the number of failed STS3x readings since boot.
+ *
+ * @return uint32_t Number of I2C read failures.
+ */
+uint32_t temperature_i2c_errors();
+
 /**
  * @brief Get the number of temperature high threshold events since last call to this function.
  *
@@ -22,6 +22,19 @@
 #include "MonitorOneConfiguration.h"
 #include "LocationPublish.h"
 #include "tracker_fuelgauge.h"
+#include "tracker_diagnostics.h"
+#include "tracker_can.h"
+#include "tracker_j1939.h"
+#include "tracker_can_events.h"
+#include "tracker_power.h"
+#include "tracker_profile.h"
+#include "tracker_config_txn.h"
+#include "tracker_config_store.h"
+#include "tracker_export.h"
+#include "tracker_binlog.h"
+#include "tracker_trace.h"
+#include "tracker_perf.h"
+#include "tracker_snapshot.h"
 #include "TrackerOneConfiguration.h"
 #include "TrackerMConfiguration.h"
 #include "TrackerEvalConfiguration.h"
@@ -31,14 +44,26 @@ void ctrl_request_custom_handler(ctrl_request* req)
     auto result = SYSTEM_ERROR_NOT_SUPPORTED;
     if (Tracker::instance().isUsbCommandEnabled())
     {
-        String command(req->request_data, req->request_size);
-        if (CloudService::instance().dispatchCommand(command))
+        if (TrackerExport::isExportRequest(req->request_data, req->request_size))
         {
-            result = SYSTEM_ERROR_NONE;
+            // Export requests are completed later from the application loop
+            result = (system_error_t)TrackerExport::instance().queue(req);
+            if (result == SYSTEM_ERROR_NONE)
+            {
+                return;
+            }
         }
         else
         {
-            result = SYSTEM_ERROR_INVALID_ARGUMENT;
+            String command(req->request_data, req->request_size);
+            if (CloudService::instance().dispatchCommand(command))
+            {
+                result = SYSTEM_ERROR_NONE;
+            }
+            else
+            {
+                result = SYSTEM_ERROR_INVALID_ARGUMENT;
+            }
         }
     }
 
@@ -76,12 +101,12 @@ Tracker::Tracker() :
     _lastBatteryCharging(false),
     _delayedBatteryCheck(true),
     _delayedBatteryCheckTick(0),
-    _pendingChargeStatus{.uptime = 0, .state = TrackerChargeState::CHARGE_INIT},
     _chargeStatus(TrackerChargeState::CHARGE_INIT),
     _lowBatteryEvent(0),
     _evalChargingTick(0),
     _batterySafeToCharge(true),
-    _forceDisableCharging(false)
+    _forceDisableCharging(false),
+    _chargeCurrentTarget(0)
 {
     _cloudConfig =
     {
@@ -103,10 +128,205 @@ void Tracker::collectMemfaultHeartbeatMetrics() {
         memfault_metrics_heartbeat_set_signed(
             MEMFAULT_METRICS_KEY(Tracker_TempC), (int32_t)(_commonCfgData.memfaultTemperatureInvalid * _commonCfgData.memfaultTemperatureScaling));
     }
-    */
+
+    TrackerSleepStats sleepStats;
+    sleep.getStats(sleepStats);
+    memfault_metrics_heartbeat_set_unsigned(
+        MEMFAULT_METRICS_KEY(Tracker_AwakeMs), (uint32_t)(sleepStats.awakeMs - _memfaultLast.awakeMs));
+    memfault_metrics_heartbeat_set_unsigned(
+        MEMFAULT_METRICS_KEY(Tracker_ModemOnMs), (uint32_t)(sleepStats.modemOnMs - _memfaultLast.modemOnMs));
+    // Connection and fix times are only reported for heartbeats in which they happened
+    if (sleepStats.connects != _memfaultLast.connects) {
+        memfault_metrics_heartbeat_set_unsigned(MEMFAULT_METRICS_KEY(Tracker_ConnectMs), sleepStats.lastConnectMs);
+    }
+    _memfaultLast.awakeMs = sleepStats.awakeMs;
+    _memfaultLast.modemOnMs = sleepStats.modemOnMs;
+    _memfaultLast.connects = sleepStats.connects;
+
+    TrackerLocationStats locationStats;
+    location.getStats(locationStats);
+    memfault_metrics_heartbeat_set_unsigned(
+        MEMFAULT_METRICS_KEY(Tracker_GnssOnMs), (uint32_t)(locationStats.gnssOnMs - _memfaultLast.gnssOnMs));
+    if (locationStats.fixes != _memfaultLast.fixes) {
+        memfault_metrics_heartbeat_set_unsigned(MEMFAULT_METRICS_KEY(Tracker_TtffMs), locationStats.lastTtffMs);
+    }
+    memfault_metrics_heartbeat_set_unsigned(
+        MEMFAULT_METRICS_KEY(Tracker_PubOk), locationStats.publishSuccess - _memfaultLast.publishSuccess);
+    memfault_metrics_heartbeat_set_unsigned(
+        MEMFAULT_METRICS_KEY(Tracker_PubFail), locationStats.publishFailure - _memfaultLast.publishFailure);
+    memfault_metrics_heartbeat_set_unsigned(
+        MEMFAULT_METRICS_KEY(Tracker_PubTimeout), locationStats.publishTimeout - _memfaultLast.publishTimeout);
+    _memfaultLast.gnssOnMs = locationStats.gnssOnMs;
+    _memfaultLast.fixes = locationStats.fixes;
+    _memfaultLast.publishSuccess = locationStats.publishSuccess;
+    _memfaultLast.publishFailure = locationStats.publishFailure;
+    _memfaultLast.publishTimeout = locationStats.publishTimeout;
+
+    LocationPublishStats storeStats;
+    LocationPublish::instance().getStats(storeStats);
+    memfault_metrics_heartbeat_set_unsigned(
+        MEMFAULT_METRICS_KEY(Tracker_PubRetry), storeStats.retries - _memfaultLast.publishRetries);
+    if (storeStats.depthKnown) {
+        memfault_metrics_heartbeat_set_unsigned(MEMFAULT_METRICS_KEY(Tracker_QueueDepth), storeStats.queued);
+        memfault_metrics_heartbeat_set_unsigned(MEMFAULT_METRICS_KEY(Tracker_QueueBytes), storeStats.queuedBytes);
+    }
+    _memfaultLast.publishRetries = storeStats.retries;
+
+    memfault_metrics_heartbeat_set_unsigned(MEMFAULT_METRICS_KEY(Tracker_LoopMaxMs), _loopMaxMs);
+    _loopMaxMs = 0;
+
+    // Temperature sensor reads are the I2C traffic owned by the application and CAN controller
+    // errors stand in for SPI since the controller sits on that bus
+    auto i2cErrors = temperature_i2c_errors();
+    memfault_metrics_heartbeat_set_unsigned(MEMFAULT_METRICS_KEY(Tracker_I2cErr), i2cErrors - _memfaultLast.i2cErrors);
+    _memfaultLast.i2cErrors = i2cErrors;
+
+    TrackerCanStats canStats;
+    TrackerCan::instance().getStats(canStats);
+    auto spiErrors = canStats.errorStates + canStats.rxOverflows;
+    memfault_metrics_heartbeat_set_unsigned(MEMFAULT_METRICS_KEY(Tracker_SpiErr), spiErrors - _memfaultLast.spiErrors);
+    _memfaultLast.spiErrors = spiErrors;
+
+    MotionCounters motionStats;
+    motionService.getStatistics(motionStats);
+    memfault_metrics_heartbeat_set_unsigned(
+        MEMFAULT_METRICS_KEY(Tracker_MotionDrop), (uint32_t)motionStats.droppedEvents - _memfaultLast.motionDrops);
+    _memfaultLast.motionDrops = (uint32_t)motionStats.droppedEvents;
 }
 #endif // TRACKER_USE_MEMFAULT
 
+void Tracker::writeMetrics(JSONWriter& writer) {
+    writer.name("uptime").value((unsigned int)System.uptime());
+    writer.name("loop_max").value((unsigned int)_loopMaxMs);
+
+    TrackerSleepStats sleepStats;
+    sleep.getStats(sleepStats);
+    writer.name("sleep").beginObject();
+    writer.name("awake").value((unsigned long long)sleepStats.awakeMs);
+    writer.name("modem_on").value((unsigned long long)sleepStats.modemOnMs);
+    writer.name("connects").value((unsigned int)sleepStats.connects);
+    writer.name("connect").value((unsigned int)sleepStats.lastConnectMs);
+    writer.endObject();
+
+    TrackerLocationStats locationStats;
+    location.getStats(locationStats);
+    writer.name("loc").beginObject();
+    writer.name("ok").value((unsigned int)locationStats.publishSuccess);
+    writer.name("fail").value((unsigned int)locationStats.publishFailure);
+    writer.name("timeout").value((unsigned int)locationStats.publishTimeout);
+    writer.name("fixes").value((unsigned int)locationStats.fixes);
+    writer.name("ttff").value((unsigned int)locationStats.lastTtffMs);
+    writer.name("gnss_on").value((unsigned long long)locationStats.gnssOnMs);
+    writer.endObject();
+
+    LocationPublishStats storeStats;
+    LocationPublish::instance().getStats(storeStats);
+    writer.name("store").beginObject();
+    // Depth is left out until messages stored before boot have drained
+    if (storeStats.depthKnown) {
+        writer.name("queued").value((unsigned int)storeStats.queued);
+        writer.name("bytes").value((unsigned int)storeStats.queuedBytes);
+    }
+    writer.name("retries").value((unsigned int)storeStats.retries);
+    writer.endObject();
+
+    MotionCounters motionStats;
+    motionService.getStatistics(motionStats);
+    writer.name("motion").beginObject();
+    writer.name("events").value((unsigned int)motionStats.motionEvents);
+    writer.name("high_g").value((unsigned int)motionStats.highGEvents);
+    writer.name("dropped").value((unsigned int)motionStats.droppedEvents);
+    writer.endObject();
+
+    TrackerCanStats canStats;
+    TrackerCan::instance().getStats(canStats);
+    writer.name("can").beginObject();
+    writer.name("frames").value((unsigned int)canStats.frames);
+    writer.name("overruns").value((unsigned int)canStats.ringOverruns);
+    writer.name("overflows").value((unsigned int)canStats.rxOverflows);
+    writer.name("errors").value((unsigned int)canStats.errorStates);
+    writer.endObject();
+
+    auto fuelGaugeStats = TrackerFuelGauge::instance().getStats();
+    writer.name("fg").beginObject();
+    writer.name("verify").value((unsigned int)fuelGaugeStats.verifyCount);
+    writer.name("verify_fail").value((unsigned int)fuelGaugeStats.verifyFail);
+    writer.name("soc_jumps").value((unsigned int)fuelGaugeStats.socJumps);
+    writer.endObject();
+
+    TrackerConfigTxnStats txnStats;
+    TrackerConfigTransaction::instance().getStats(txnStats);
+    TrackerConfigStoreStats storeLogStats;
+    TrackerConfigStore::instance().getStats(storeLogStats);
+    writer.name("cfg").beginObject();
+    writer.name("commits").value((unsigned int)txnStats.commits);
+    writer.name("rollbacks").value((unsigned int)txnStats.rollbacks);
+    writer.name("records").value((unsigned int)storeLogStats.records);
+    writer.name("discarded").value((unsigned int)storeLogStats.discarded);
+    writer.name("compactions").value((unsigned int)storeLogStats.compactions);
+    writer.endObject();
+
+    writer.name("i2c_err").value((unsigned int)temperature_i2c_errors());
+
+    TrackerBinLogStats logStats;
+    TrackerBinLog::instance().getStats(logStats);
+    writer.name("blog").beginObject();
+    writer.name("records").value((unsigned int)logStats.records);
+    writer.name("dropped").value((unsigned int)logStats.dropped);
+    writer.name("recovered").value((unsigned int)logStats.recovered);
+    writer.name("cyc_max").value((unsigned int)logStats.cyclesMax);
+    writer.name("cyc_avg").value((unsigned int)logStats.cyclesAvg);
+    writer.endObject();
+
+    TrackerSnapshotStats snapshotStats;
+    TrackerSnapshot::instance().getStats(snapshotStats);
+    writer.name("snap").beginObject();
+    writer.name("commits").value((unsigned int)snapshotStats.commits);
+    writer.name("restored").value(snapshotStats.restored);
+    writer.endObject();
+}
+
+// The metrics are rendered once when an export is opened so that every page comes from the same snapshot
+int Tracker::regMetricsExport() {
+    TrackerExportSource source = {
+        .name = "metrics",
+        .open = [this](size_t& size) -> int {
+            delete[] _metricsExport;
+            _metricsExport = nullptr;
+
+            JSONBufferWriter sizer(nullptr, 0);
+            sizer.beginObject();
+            writeMetrics(sizer);
+            sizer.endObject();
+
+            auto length = sizer.dataSize() + 1;
+            _metricsExport = new char[length];
+            CHECK_TRUE(_metricsExport, SYSTEM_ERROR_NO_MEMORY);
+            JSONBufferWriter writer(_metricsExport, length);
+            writer.beginObject();
+            writeMetrics(writer);
+            writer.endObject();
+            _metricsExportSize = std::min(writer.dataSize(), length - 1);
+            size = _metricsExportSize;
+            return SYSTEM_ERROR_NONE;
+        },
+        .read = [this](size_t offset, uint8_t* data, size_t length) -> int {
+            CHECK_TRUE(_metricsExport, SYSTEM_ERROR_INVALID_STATE);
+            length = std::min(length, _metricsExportSize - std::min(offset, _metricsExportSize));
+            memcpy(data, _metricsExport + offset, length);
+            return (int)length;
+        },
+        .consume = nullptr,
+        .close = [this]() {
+            delete[] _metricsExport;
+            _metricsExport = nullptr;
+            _metricsExportSize = 0;
+        },
+    };
+
+    return TrackerExport::instance().regSource(source);
+}
+
 int Tracker::registerConfig()
 {
     static ConfigObject tracker_config("tracker", {
@@ -254,7 +474,8 @@ void Tracker::startShippingMode() {
 }
 
 int Tracker::prepareSleep() {
-    if (_deviceConfig.enableIoCanPowerSleep()) {
+    // The CAN controller needs power to wake the system on bus activity
+    if (_deviceConfig.enableIoCanPowerSleep() && !TrackerCan::instance().isWakeArmed()) {
         enableIoCanPower(false);
     }
     return SYSTEM_ERROR_NONE;
@@ -310,21 +531,14 @@ TrackerChargeState Tracker::batteryDecode(battery_state_t state) {
     return chargeStatus;
 }
 
-void Tracker::setPendingChargeStatus(unsigned int uptime, TrackerChargeState state) {
-    const std::lock_guard<Mutex> lock(_pendingLock);
-    _pendingChargeStatus.uptime = uptime;
-    _pendingChargeStatus.state = state;
-}
-
-TrackerChargeStatus Tracker::getPendingChargeStatus() {
-    const std::lock_guard<Mutex> lock(_pendingLock);
-    return _pendingChargeStatus;
-}
-
-void Tracker::batteryStateHandler(system_event_t event, int data) {
-    auto currentChargeStatus = Tracker::instance().batteryDecode(static_cast<battery_state_t>(data));
+// Charge states arrive already debounced by TrackerPower
+void Tracker::onPowerTransition(const TrackerPowerTransition& transition) {
+    if ((transition.type != TrackerPowerEvent::CHARGE) || _delayedBatteryCheck) {
+        return;
+    }
 
-    Tracker::instance().setPendingChargeStatus(System.uptime(), currentChargeStatus);
+    _chargeStatus = batteryDecode(static_cast<battery_state_t>(transition.to));
+    _evalTick = System.uptime();
 }
 
 
@@ -397,20 +611,11 @@ void Tracker::evaluateBatteryCharge() {
             pinMode(LOW_BAT_UC, INPUT_PULLUP);
 
             System.on(low_battery, lowBatteryHandler);
-            System.on(battery_state, batteryStateHandler);
-            if (_chargeStatus == TrackerChargeState::CHARGE_INIT) {
-                setPendingChargeStatus(System.uptime(), batteryDecode(static_cast<battery_state_t>(System.batteryState())));
-            }
-        }
-    }
 
-    // Debounce the charge status here by looking at data collected by the interrupt handler and making sure that the
-    // last state is present over a qualified amount of time.
-    auto status = getPendingChargeStatus();
-    if (status.uptime && ((System.uptime() - status.uptime) >= _commonCfgData.lowBatteryDebounceTime)) {
-        _chargeStatus = status.state;
-        setPendingChargeStatus(0, _chargeStatus);
-        _evalTick = System.uptime();
+            // Later changes are followed through onPowerTransition()
+            _chargeStatus = batteryDecode(TrackerPower::instance().getChargeState());
+            _evalTick = System.uptime();
+        }
     }
 
     // No further work necessary if we are still in the delayed battery check interval or not on a evaluation interval
@@ -554,6 +759,9 @@ int Tracker::init()
     // Disable OTA updates until after the system handler has been registered
     System.disableUpdates();
 
+    // Start formatting deferred log records early, including any left from before a reset
+    TrackerBinLog::instance().init();
+
 #ifdef TRACKER_USE_MEMFAULT
     if (nullptr == _memfault) {
         _memfault = new Memfault(TRACKER_PRODUCT_VERSION);
@@ -609,6 +817,11 @@ int Tracker::init()
 
     cloudService.init();
 
+    // Mark the boot in the state trace before other modules record transitions
+    TrackerTrace::instance().init();
+    TrackerPerf::instance().init();
+    TrackerSnapshot::instance().init();
+
     configService.init();
 
     // Setup device monitoring configuration here
@@ -676,6 +889,16 @@ int Tracker::init()
 
     LocationPublish::instance().init();
 
+    TrackerDiagnostics::instance().init();
+
+    TrackerPower::instance().init();
+    TrackerPower::instance().regTransitionCallback([this](const TrackerPowerTransition& transition){ onPowerTransition(transition); });
+    TrackerProfile::instance().init();
+
+    TrackerCan::instance().init();
+    TrackerJ1939::instance().init();
+    TrackerCanEvents::instance().init();
+
     // Associate handler to OTAs and pending resets to disable the watchdog
     System.on(reset_pending,
         [this](system_event_t event, int param){
@@ -693,6 +916,11 @@ int Tracker::init()
 
     _platformConfig->load_specific_platform_config();
 
+    // Stored configuration is loaded by now so later writes are grouped into transactions
+    TrackerConfigTransaction::instance().init();
+
+    regMetricsExport();
+
     return SYSTEM_ERROR_NONE;
 }
 
@@ -703,6 +931,8 @@ void Tracker::loop()
         return;
     }
 
+    auto loopStartMs = millis();
+    auto loopStartUs = micros();
     uint32_t cur_sec = System.uptime();
 
     // slow operations for once a second
@@ -716,6 +946,8 @@ void Tracker::loop()
     }
 
     TrackerFuelGauge::instance().loop();
+    TrackerPower::instance().loop();
+    TrackerProfile::instance().loop();
 
     // Evaluate low battery conditions
     switch (_model) {
@@ -740,6 +972,12 @@ void Tracker::loop()
         case TRACKER_MODEL_MONITORONE: {
             temperature_tick();
 
+            unsigned int chargingEvalTime = sleep.isSleepDisabled() ? _commonCfgData.chargingAwakeEvalTime : _commonCfgData.chargingSleepEvalTime;
+            if (System.uptime() - _evalChargingTick >= chargingEvalTime) {
+                _evalChargingTick = System.uptime();
+                stepChargeCurrent();
+            }
+
             if (temperature_high_events())
             {
                 location.triggerLocPub(Trigger::NORMAL,"temp_h");
@@ -756,13 +994,30 @@ void Tracker::loop()
 
     // fast operations for every loop
     cloudService.tick();
-    configService.tick();
+    // Configuration of a transaction is persisted with one flush once it completes
+    if (TrackerConfigTransaction::instance().loop()) {
+        configService.flush();
+    }
+    else if (!TrackerConfigTransaction::instance().isOpen()) {
+        configService.tick();
+    }
+    TrackerDiagnostics::instance().tick();
+    TrackerCan::instance().loop();
+    TrackerCanEvents::instance().loop();
+    TrackerExport::instance().loop();
  #ifdef TRACKER_USE_MEMFAULT
     if (_deviceMonitoring && (nullptr != _memfault)) {
         _memfault->process();
     }
 #endif // TRACKER_USE_MEMFAULT
     location.loop();
+    TrackerSnapshot::instance().loop();
+
+    auto loopMs = millis() - loopStartMs;
+    if (loopMs > _loopMaxMs) {
+        _loopMaxMs = loopMs;
+    }
+    TrackerPerf::instance().loop(micros() - loopStartUs);
 }
 
 int Tracker::stop() {
@@ -835,38 +1090,43 @@ int Tracker::chargeCallback(TemperatureChargeEvent event) {
 
     switch (event) {
         case TemperatureChargeEvent::NORMAL: {
-            setChargeCurrent(_commonCfgData.chargeCurrentHigh);
+            _chargeCurrentTarget = _commonCfgData.chargeCurrentHigh;
             shouldCharge = true;
             break;
         }
 
-        case TemperatureChargeEvent::OVER_CHARGE_REDUCTION: {
-            setChargeCurrent(_commonCfgData.chargeCurrentLow);
+        case TemperatureChargeEvent::OVER_CHARGE_REDUCTION:
+        // Fall through
+        case TemperatureChargeEvent::UNDER_CHARGE_REDUCTION: {
+            _chargeCurrentTarget = _commonCfgData.chargeCurrentLow;
             shouldCharge = true;
             break;
         }
 
-        case TemperatureChargeEvent::OVER_TEMPERATURE: {
-            setChargeCurrent(_commonCfgData.chargeCurrentLow);
-            shouldCharge = false;
-            break;
-        }
-
-        case TemperatureChargeEvent::UNDER_TEMPERATURE: {
-            setChargeCurrent(_commonCfgData.chargeCurrentLow);
+        case TemperatureChargeEvent::OVER_TEMPERATURE:
+        // Fall through
+        case TemperatureChargeEvent::UNDER_TEMPERATURE:
+        // Fall through
+        case TemperatureChargeEvent::SENSOR_FAULT: {
+            _chargeCurrentTarget = _commonCfgData.chargeCurrentLow;
             shouldCharge = false;
             break;
         }
     }
 
+    // Reductions take effect right away while increases are stepped up from the loop
+    stepChargeCurrent();
+
     // Check if anything needs to be changed for charging
     if (!shouldCharge && _batterySafeToCharge) {
         _batterySafeToCharge = false;
+        Log.info("Charging disabled by temperature");
         pmicDisableCharging();
     }
     else if (shouldCharge && !_batterySafeToCharge) {
         _batterySafeToCharge = true;
         if (!_forceDisableCharging) {
+            Log.info("Charging enabled by temperature");
             pmicEnableCharging();
         }
     }
@@ -874,6 +1134,31 @@ int Tracker::chargeCallback(TemperatureChargeEvent event) {
     return SYSTEM_ERROR_NONE;
 }
 
+// Move the charge current towards the temperature target, limited by what the power source can
+// supply.  Increases are made one step per evaluation so the input current ramps rather than jumps.
+void Tracker::stepChargeCurrent() {
+    if (_chargeCurrentTarget == 0) {
+        // No temperature evaluation yet
+        return;
+    }
+
+    auto target = _chargeCurrentTarget;
+    if ((TrackerPower::instance().getSource() == POWER_SOURCE_USB_HOST) && (target > _commonCfgData.chargeCurrentUsbHost)) {
+        target = _commonCfgData.chargeCurrentUsbHost;
+    }
+
+    auto current = (uint16_t)System.getPowerConfiguration().batteryChargeCurrent();
+    auto next = target;
+    if ((target > current) && (target - current > _commonCfgData.chargeCurrentStep)) {
+        next = current + _commonCfgData.chargeCurrentStep;
+    }
+
+    if (next != current) {
+        TrackerBinLog::instance().log(TrackerBinLogId::CHARGE_CURRENT, current, next, target);
+        setChargeCurrent(next);
+    }
+}
+
 void Tracker::loc_gen_cb(JSONWriter& writer, LocationPoint &loc, const void *context)
 {
 
@@ -31,6 +31,7 @@
 #include "tracker_location.h"
 #include "tracker_motion.h"
 #include "tracker_shipping.h"
+#include "tracker_power.h"
 #include "tracker_rgb.h"
 #include "gnss_led.h"
 #include "temperature.h"
@@ -79,11 +80,6 @@ enum class TrackerChargeState {
     CHARGE_CARE,
 };
 
-struct TrackerChargeStatus {
-    unsigned int uptime;
-    TrackerChargeState state;
-};
-
 /**
  * @brief TrackerConfiguration class to configure the tracker device in application
  *
@@ -388,6 +384,16 @@ class Tracker {
          */
         void enableIoCanPower(bool enable);
 
+        /**
+         * @brief Indicate if IO/CAN power is currently on
+         *
+         * @return true IO/CAN power is on
+         * @return false IO/CAN power is off
+         */
+        bool isIoCanPowerEnabled() const {
+            return _canPowerEnabled;
+        }
+
         /**
          * @brief Indicates whether device can accept commands through USB interface
          *
@@ -429,6 +435,13 @@ class Tracker {
          */
         void collectMemfaultHeartbeatMetrics();
 
+        /**
+         * @brief Write runtime counters of every module as JSON object members
+         *
+         * @param writer JSON writer positioned inside an object
+         */
+        void writeMetrics(JSONWriter& writer);
+
         // underlying services exposed to allow sharing with rest of the system
         CloudService &cloudService;
         ConfigService &configService;
@@ -444,6 +457,7 @@ class Tracker {
         Tracker();
 
         int chargeCallback(TemperatureChargeEvent event);
+        int regMetricsExport();
 
         static Tracker* _instance;
     #ifdef TRACKER_USE_MEMFAULT
@@ -464,14 +478,34 @@ class Tracker {
         bool _lastBatteryCharging;
         bool _delayedBatteryCheck;
         unsigned int _delayedBatteryCheckTick;
-        TrackerChargeStatus _pendingChargeStatus;
-        Mutex _pendingLock;
         TrackerChargeState _chargeStatus;
         unsigned int _lowBatteryEvent;
         unsigned int _evalChargingTick;
         bool _batterySafeToCharge;
         bool _forceDisableCharging;
+        uint16_t _chargeCurrentTarget;
         bool _deviceMonitoring {false};
+        system_tick_t _loopMaxMs {0};
+        char* _metricsExport {nullptr};  // metrics snapshot while it is being exported
+        size_t _metricsExportSize {0};
+
+    #ifdef TRACKER_USE_MEMFAULT
+        // Counter values at the last heartbeat so that each heartbeat reports its own interval
+        struct {
+            uint64_t awakeMs;
+            uint64_t modemOnMs;
+            uint64_t gnssOnMs;
+            uint32_t connects;
+            uint32_t fixes;
+            uint32_t publishSuccess;
+            uint32_t publishFailure;
+            uint32_t publishTimeout;
+            uint32_t publishRetries;
+            uint32_t i2cErrors;
+            uint32_t spiErrors;
+            uint32_t motionDrops;
+        } _memfaultLast {};
+    #endif // TRACKER_USE_MEMFAULT
 
         // Startup and initialization related
         static int getPowerManagementConfig(hal_power_config& conf);
@@ -494,15 +528,14 @@ class Tracker {
         int registerConfig();
         static void loc_gen_cb(JSONWriter& writer, LocationPoint &loc, const void *context);
         TrackerChargeState batteryDecode(battery_state_t state);
-        void setPendingChargeStatus(unsigned int uptime, TrackerChargeState state);
-        TrackerChargeStatus getPendingChargeStatus();
         static void lowBatteryHandler(system_event_t event, int data);
-        static void batteryStateHandler(system_event_t event, int data);
+        void onPowerTransition(const TrackerPowerTransition& transition);
         void initBatteryMonitor();
         bool getChargeEnabled();
         void evaluateBatteryCharge();
         int pmicEnableCharging();
         int pmicDisableCharging();
+        void stepChargeCurrent();
 
         /**
          * @brief Handle OTA events from System.on() interface
@@ -0,0 +1,283 @@
+/*
+ * Copyright (c) 2022 Particle Industries, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "tracker_binlog.h"
+#include "tracker_export.h"
+#include "tracker_perf.h"
+
+constexpr uint32_t TrackerBinLogMagic = 0x474c4254; // "TBLG"
+
+// Sequence number marking a record that is being written
+constexpr uint32_t TrackerBinLogBusy = 0xffffffff;
+
+struct TrackerBinLogFormat {
+    LogLevel level;
+    const char* format;
+};
+
+// Indexed by TrackerBinLogId
+static const TrackerBinLogFormat formats[] = {
+    {LOG_LEVEL_INFO,  "temp=%.2lf hum=%.2lf"},
+    {LOG_LEVEL_INFO,  "no sensor err=%d"},
+    {LOG_LEVEL_INFO,  "Charge temperature %.1f moves charge control from %s to %s"},
+    {LOG_LEVEL_INFO,  "Charge current %u mA to %u mA, target %u mA"},
+    {LOG_LEVEL_TRACE, "TrackerLocation: last=%lu, interval=%ld, wake=%u"},
+    {LOG_LEVEL_TRACE, "publishing from max interval"},
+    {LOG_LEVEL_TRACE, "publishing from max interval after waiting"},
+    {LOG_LEVEL_TRACE, "publishing from triggers"},
+    {LOG_LEVEL_TRACE, "publishing from triggers after waiting"},
+    {LOG_LEVEL_TRACE, "waiting for stable GNSS lock for triggers"},
+    {LOG_LEVEL_TRACE, "publishing from immediate"},
+};
+
+static_assert(sizeof(formats) / sizeof(formats[0]) == (size_t)TrackerBinLogId::COUNT, "binary log format missing");
+
+retained static TrackerBinLogRing binLogRing;
+
+TrackerBinLog *TrackerBinLog::_instance = nullptr;
+
+TrackerBinLog::TrackerBinLog() :
+    _ring(&binLogRing),
+    _bootHead(0),
+    _thread(nullptr),
+    _records(0),
+    _dropped(0),
+    _cyclesMax(0),
+    _cyclesAvg(0),
+    _recovered(0),
+    _export(nullptr) {
+
+    // Keep records from before the reset unless the ring was never initialized or is inconsistent
+    if ((_ring->magic != TrackerBinLogMagic) || (_ring->size != sizeof(TrackerBinLogRing)) ||
+        ((_ring->head - _ring->tail) > TrackerBinLogSlots)) {
+        memset(_ring, 0, sizeof(TrackerBinLogRing));
+        for (size_t i = 0; i < TrackerBinLogSlots; i++) {
+            _ring->records[i].seq = TrackerBinLogBusy;
+        }
+        _ring->magic = TrackerBinLogMagic;
+        _ring->size = sizeof(TrackerBinLogRing);
+    }
+    _bootHead = _ring->head;
+    _recovered = _ring->head - _ring->tail;
+}
+
+int TrackerBinLog::init() {
+    if (_recovered) {
+        Log.warn("Formatting %lu log records from before reset", _recovered);
+    }
+
+    if (!_thread && os_thread_create(&_thread, "tracker_binlog", OS_THREAD_PRIORITY_DEFAULT - 1, TrackerBinLog::thread_f, this, OS_THREAD_STACK_SIZE_DEFAULT)) {
+        _thread = nullptr;
+        Log.error("os_thread_create() failed");
+        return SYSTEM_ERROR_INTERNAL;
+    }
+    TrackerPerf::instance().regThread(_thread);
+
+    return regExport();
+}
+
+// Writers reserve a sequence number and mark the record busy before filling it in.  Storing the sequence
+// number last publishes the record to the formatting thread.
+void TrackerBinLog::record(TrackerBinLogId id, const Arg* args, size_t count, uint32_t startTicks) {
+    auto seq = __atomic_fetch_add(&_ring->head, 1, __ATOMIC_RELAXED);
+    auto& record = _ring->records[seq & (TrackerBinLogSlots - 1)];
+
+    __atomic_store_n(&record.seq, TrackerBinLogBusy, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    record.timeMs = millis();
+    record.id = (uint16_t)id;
+    record.count = count;
+    record.types = 0;
+    for (size_t i = 0; i < count; i++) {
+        record.args[i] = args[i].word;
+        record.types |= (uint8_t)args[i].type << (i * 2);
+    }
+    __atomic_store_n(&record.seq, seq, __ATOMIC_RELEASE);
+
+    _records++;
+    auto cycles = System.ticks() - startTicks;
+    if (cycles > _cyclesMax) {
+        _cyclesMax = cycles;
+    }
+    // Running average over about 16 calls, races between threads only blur it
+    uint32_t avg = _cyclesAvg;
+    _cyclesAvg = avg - (avg >> 4) + (cycles >> 4);
+}
+
+size_t TrackerBinLog::drain(size_t max) {
+    size_t done = 0;
+    while (done < max) {
+        auto head = __atomic_load_n(&_ring->head, __ATOMIC_ACQUIRE);
+        auto tail = _ring->tail;
+        if ((head - tail) > TrackerBinLogSlots) {
+            // Writers lapped the formatter
+            _dropped += (head - TrackerBinLogSlots) - tail;
+            tail = head - TrackerBinLogSlots;
+            _ring->tail = tail;
+        }
+        if (tail == head) {
+            break;
+        }
+
+        auto& slot = _ring->records[tail & (TrackerBinLogSlots - 1)];
+        auto seq = __atomic_load_n(&slot.seq, __ATOMIC_ACQUIRE);
+        if (seq != tail) {
+            if ((int32_t)(tail - _bootHead) >= 0) {
+                // Still being written
+                break;
+            }
+            // Interrupted by the reset and never completed
+            _dropped++;
+            _ring->tail = tail + 1;
+            done++;
+            continue;
+        }
+
+        TrackerBinLogRecord record;
+        memcpy(&record, &slot, sizeof(record));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&slot.seq, __ATOMIC_RELAXED) != tail) {
+            // Overwritten while copying, the lap is accounted for on the next pass
+            continue;
+        }
+
+        _ring->tail = tail + 1;
+        format(record);
+        done++;
+    }
+
+    return done;
+}
+
+// Format one conversion at a time so that each raw argument can be passed with the type its conversion expects
+void TrackerBinLog::format(const TrackerBinLogRecord& record) {
+    if (record.id >= (uint16_t)TrackerBinLogId::COUNT) {
+        Log.warn("Unknown binary log message %u", record.id);
+        return;
+    }
+
+    const auto& entry = formats[record.id];
+    bool previous = (int32_t)(record.seq - _bootHead) < 0;
+    char text[128];
+    size_t length = 0;
+    if (previous) {
+        length = snprintf(text, sizeof(text), "[previous boot at %lu ms] ", record.timeMs);
+    }
+
+    size_t arg = 0;
+    for (auto fmt = entry.format; *fmt && (length < sizeof(text) - 1);) {
+        if ((*fmt != '%') || (fmt[1] == '%')) {
+            text[length++] = *fmt;
+            fmt += (*fmt == '%') ? 2 : 1;
+            continue;
+        }
+
+        // Copy the conversion without length modifiers since every argument is 32 bits wide
+        char spec[16];
+        size_t specLength = 0;
+        spec[specLength++] = *fmt++;
+        while (*fmt && !strchr("diouxXcsfFeEgGp", *fmt)) {
+            if (!strchr("hlLjzt", *fmt) && (specLength < sizeof(spec) - 2)) {
+                spec[specLength++] = *fmt;
+            }
+            fmt++;
+        }
+        auto conversion = *fmt;
+        if (!conversion) {
+            break;
+        }
+        spec[specLength++] = *fmt++;
+        spec[specLength] = '\0';
+
+        auto remaining = sizeof(text) - length;
+        if (arg >= record.count) {
+            length += snprintf(text + length, remaining, "?");
+        }
+        else {
+            auto word = record.args[arg];
+            auto type = (TrackerBinLogArgType)((record.types >> (arg * 2)) & 0x3);
+            if (strchr("fFeEgG", conversion)) {
+                float value;
+                memcpy(&value, &word, sizeof(value));
+                length += snprintf(text + length, remaining, spec,
+                    (type == TrackerBinLogArgType::FLOAT) ? (double)value :
+                    (type == TrackerBinLogArgType::INT) ? (double)(int32_t)word : (double)word);
+            }
+            else if (conversion == 's') {
+                // Strings from before the reset may not be at the same address in this firmware
+                length += snprintf(text + length, remaining, spec,
+                    ((type == TrackerBinLogArgType::STRING) && !previous) ? (const char*)(uintptr_t)word : "?");
+            }
+            else if (strchr("dic", conversion)) {
+                length += snprintf(text + length, remaining, spec, (int)word);
+            }
+            else {
+                length += snprintf(text + length, remaining, spec, (unsigned int)word);
+            }
+        }
+        length = std::min(length, sizeof(text) - 1);
+        arg++;
+    }
+    text[length] = '\0';
+
+    Log.log(entry.level, "%s", text);
+}
+
+void TrackerBinLog::getStats(TrackerBinLogStats& stats) {
+    stats.records = _records;
+    stats.dropped = _dropped;
+    stats.recovered = _recovered;
+    stats.cyclesMax = _cyclesMax;
+    stats.cyclesAvg = _cyclesAvg;
+}
+
+// The raw ring is exported for decoding on a host, including records already formatted
+int TrackerBinLog::regExport() {
+    TrackerExportSource source = {
+        .name = "log",
+        .open = [this](size_t& size) -> int {
+            delete[] _export;
+            _export = new uint8_t[sizeof(TrackerBinLogRing)];
+            CHECK_TRUE(_export, SYSTEM_ERROR_NO_MEMORY);
+            memcpy(_export, _ring, sizeof(TrackerBinLogRing));
+            size = sizeof(TrackerBinLogRing);
+            return SYSTEM_ERROR_NONE;
+        },
+        .read = [this](size_t offset, uint8_t* data, size_t length) -> int {
+            CHECK_TRUE(_export, SYSTEM_ERROR_INVALID_STATE);
+            length = std::min(length, sizeof(TrackerBinLogRing) - std::min(offset, sizeof(TrackerBinLogRing)));
+            memcpy(data, _export + offset, length);
+            return (int)length;
+        },
+        .consume = nullptr,
+        .close = [this]() {
+            delete[] _export;
+            _export = nullptr;
+        },
+    };
+
+    return TrackerExport::instance().regSource(source);
+}
+
+void TrackerBinLog::thread_f(void* context) {
+    auto self = static_cast<TrackerBinLog*>(context);
+
+    while (true) {
+        if (!self->drain(TrackerBinLogSlots / 4)) {
+            delay(TrackerBinLogDrainMs);
+        }
+    }
+}
@@ -0,0 +1,197 @@
+/*
+ * Copyright (c) 2022 Particle Industries, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <atomic>
+
+#include "Particle.h"
+
+// Number of records held in the ring, must be a power of two
+constexpr size_t TrackerBinLogSlots = 32;
+
+// Maximum number of arguments recorded with a message
+constexpr size_t TrackerBinLogMaxArgs = 4;
+
+// Time, in milliseconds, the formatting thread waits when the ring is empty
+constexpr system_tick_t TrackerBinLogDrainMs = 100;
+
+static_assert((TrackerBinLogSlots & (TrackerBinLogSlots - 1)) == 0, "binary log ring size must be a power of two");
+
+/**
+ * @brief Message identifiers.  Each has a level and printf style format string in tracker_binlog.cpp.  Append
+ * new messages to the end so that records from older firmware keep decoding.
+ *
+ */
+enum class TrackerBinLogId : uint16_t {
+    ENV_SAMPLE,                     /**< temp=%.2lf hum=%.2lf */
+    ENV_NO_SENSOR,                  /**< no sensor err=%d */
+    CHARGE_TEMPERATURE,             /**< Charge temperature %.1f moves charge control from %s to %s */
+    CHARGE_CURRENT,                 /**< Charge current %u mA to %u mA, target %u mA */
+    LOC_INTERVAL,                   /**< TrackerLocation: last=%lu, interval=%ld, wake=%u */
+    LOC_PUBLISH_MAX,                /**< publishing from max interval */
+    LOC_PUBLISH_MAX_WAITED,         /**< publishing from max interval after waiting */
+    LOC_PUBLISH_TRIGGERS,           /**< publishing from triggers */
+    LOC_PUBLISH_TRIGGERS_WAITED,    /**< publishing from triggers after waiting */
+    LOC_WAIT_TRIGGERS,              /**< waiting for stable GNSS lock for triggers */
+    LOC_PUBLISH_IMMEDIATE,          /**< publishing from immediate */
+    COUNT,                          /**< Number of messages, must be last */
+};
+
+/**
+ * @brief Recorded argument types
+ *
+ */
+enum class TrackerBinLogArgType : uint8_t {
+    INT,                            /**< Signed 32-bit integer */
+    UINT,                           /**< Unsigned 32-bit integer */
+    FLOAT,                          /**< IEEE 754 single precision */
+    STRING,                         /**< Address of a string constant in flash */
+};
+
+/**
+ * @brief A record in the ring, little endian and without padding.  Exported as is for decoding on a host.
+ *
+ */
+struct TrackerBinLogRecord {
+    uint32_t seq;                   /**< Sequence number of the record, written last */
+    uint32_t timeMs;                /**< millis() when logged */
+    uint16_t id;                    /**< TrackerBinLogId */
+    uint8_t count;                  /**< Number of arguments */
+    uint8_t types;                  /**< Two bits of TrackerBinLogArgType per argument, first argument lowest */
+    uint32_t args[TrackerBinLogMaxArgs];
+};
+
+/**
+ * @brief The ring as kept in retained memory and exported.
+ *
+ */
+struct TrackerBinLogRing {
+    uint32_t magic;                 /**< Marks the ring as initialized */
+    uint32_t size;                  /**< Size of this structure, to detect layout changes */
+    uint32_t head;                  /**< Sequence number of the next record to be written */
+    uint32_t tail;                  /**< Sequence number of the next record to be formatted */
+    TrackerBinLogRecord records[TrackerBinLogSlots];
+};
+
+static_assert(sizeof(TrackerBinLogRecord) == 12 + (4 * TrackerBinLogMaxArgs), "binary log record must not be padded");
+
+/**
+ * @brief Logging cost and ring counters since boot
+ *
+ */
+struct TrackerBinLogStats {
+    uint32_t records;               /**< Records logged */
+    uint32_t dropped;               /**< Records overwritten before they were formatted */
+    uint32_t recovered;             /**< Records left unformatted by the previous boot */
+    uint32_t cyclesMax;             /**< Most CPU cycles taken by one log call */
+    uint32_t cyclesAvg;             /**< Running average of CPU cycles taken by a log call */
+};
+
+/**
+ * @brief TrackerBinLog class to log from busy code paths without formatting or serial output on the caller.
+ *
+ * @details A log call stores the message identifier and raw arguments in a lock free ring in retained
+ * memory.  A low priority thread later formats records and passes them to the system logger.  Records that
+ * were not formatted before a reset are formatted after the next boot and the whole ring can be read over the
+ * USB export interface for decoding on a host.  String arguments must be constants as only their address is
+ * recorded; strings from before a reset are not dereferenced.
+ */
+class TrackerBinLog {
+public:
+    /**
+     * @brief Singleton class instance access for TrackerBinLog.  Messages can be logged before init().
+     *
+     * @return TrackerBinLog&
+     */
+    static TrackerBinLog& instance() {
+        if (!_instance) {
+            _instance = new TrackerBinLog();
+        }
+        return *_instance;
+    }
+
+    /**
+     * @brief Start the formatting thread and register the ring for export.
+     *
+     * @retval SYSTEM_ERROR_NONE
+     * @retval SYSTEM_ERROR_INTERNAL
+     */
+    int init();
+
+    /**
+     * @brief Record a message.  Safe to call from any thread.
+     *
+     * @param id Message identifier
+     * @param args Arguments for the message format, integers, floating point or string constants
+     */
+    template <typename... Args>
+    void log(TrackerBinLogId id, Args... args) {
+        static_assert(sizeof...(Args) <= TrackerBinLogMaxArgs, "too many binary log arguments");
+        auto start = System.ticks();
+        const Arg packed[] = {Arg(0u), Arg(args)...};
+        record(id, &packed[1], sizeof...(Args), start);
+    }
+
+    /**
+     * @brief Format pending records.
+     *
+     * @param max Maximum number of records to format
+     * @return size_t Number of records formatted or skipped
+     */
+    size_t drain(size_t max);
+
+    /**
+     * @brief Get logging counters.
+     *
+     * @param[out] stats Current counters
+     */
+    void getStats(TrackerBinLogStats& stats);
+
+private:
+    TrackerBinLog();
+
+    struct Arg {
+        Arg(int value) : word((uint32_t)value), type(TrackerBinLogArgType::INT) {}
+        Arg(long value) : word((uint32_t)value), type(TrackerBinLogArgType::INT) {}
+        Arg(unsigned int value) : word(value), type(TrackerBinLogArgType::UINT) {}
+        Arg(unsigned long value) : word((uint32_t)value), type(TrackerBinLogArgType::UINT) {}
+        Arg(bool value) : word(value), type(TrackerBinLogArgType::UINT) {}
+        Arg(float value) : type(TrackerBinLogArgType::FLOAT) { memcpy(&word, &value, sizeof(word)); }
+        Arg(double value) : Arg((float)value) {}
+        Arg(const char* value) : word((uint32_t)(uintptr_t)value), type(TrackerBinLogArgType::STRING) {}
+
+        uint32_t word;
+        TrackerBinLogArgType type;
+    };
+
+    static TrackerBinLog* _instance;
+
+    TrackerBinLogRing* _ring;
+    uint32_t _bootHead;             // records before this sequence number were logged before the last reset
+    os_thread_t _thread;
+    std::atomic<uint32_t> _records;
+    std::atomic<uint32_t> _dropped;
+    std::atomic<uint32_t> _cyclesMax;
+    std::atomic<uint32_t> _cyclesAvg;
+    uint32_t _recovered;
+    uint8_t* _export;               // ring snapshot while it is being exported
+
+    void record(TrackerBinLogId id, const Arg* args, size_t count, uint32_t startTicks);
+    void format(const TrackerBinLogRecord& record);
+    int regExport();
+    static void thread_f(void* context);
+};
@@ -0,0 +1,479 @@
+/*
+ * Copyright (c) 2022 Particle Industries, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "tracker_can.h"
+#include "tracker.h"
+#include "tracker_diagnostics.h"
+#include "tracker_location.h"
+#include "tracker_perf.h"
+
+TrackerCan *TrackerCan::_instance = nullptr;
+
+// Controller identifier flags as returned by readMsgBuf()
+constexpr uint32_t TrackerCanIdExtendedFlag = 0x80000000;
+constexpr uint32_t TrackerCanIdRemoteFlag = 0x40000000;
+constexpr uint32_t TrackerCanIdMask = 0x1fffffff;
+
+TrackerCan::TrackerCan() :
+    _can(MCP_CAN_CS_PIN, MCP_CAN_SPI_INTERFACE),
+    _eventQueue(nullptr),
+    _thread(nullptr),
+    _running(false),
+    _reconfigure(false),
+    _lastFrameMs(0),
+    _frameSeen(false),
+    _busActive(false),
+    _wakeArmed(false),
+    _wokeByBus(false),
+    _lastExtendSec(0),
+    _lastErrorFlags(0),
+    _stats({}),
+    _diagStats({}),
+    _diagId(-1),
+    _ringHead(0),
+    _ringTail(0) {
+
+    _config = {
+        .enable = false,
+        .bitrate = CAN_500KBPS,
+        .listen_only = true,
+        .extended = true,
+        .mask = {},
+        .filter = {},
+        .wake = false,
+        .idle_seconds = TrackerCanDefaultIdleTime,
+        .active_trigger = false,
+    };
+}
+
+// Configuration service node setup
+// { "can" :
+//     { "enable": false,
+//       "bitrate": "500k",
+//       "listen_only": true,
+//       "ext": true,
+//       "mask0": 0, "mask1": 0,
+//       "filt0": 0, ... "filt5": 0,
+//       "wake": false,
+//       "idle": 0,
+//       "act_trig": false
+//      }
+//  }
+
+int TrackerCan::init() {
+    static ConfigObject canDesc
+    (
+        "can",
+        {
+            ConfigBool("enable", &_config.enable),
+            ConfigStringEnum(
+                "bitrate",
+                {
+                    {"125k", (int32_t) CAN_125KBPS},
+                    {"250k", (int32_t) CAN_250KBPS},
+                    {"500k", (int32_t) CAN_500KBPS},
+                    {"1000k", (int32_t) CAN_1000KBPS},
+                },
+                &_config.bitrate
+            ),
+            ConfigBool("listen_only", &_config.listen_only),
+            ConfigBool("ext", &_config.extended),
+            ConfigInt("mask0", &_config.mask[0], 0, (int32_t)TrackerCanIdMask),
+            ConfigInt("mask1", &_config.mask[1], 0, (int32_t)TrackerCanIdMask),
+            ConfigInt("filt0", &_config.filter[0], 0, (int32_t)TrackerCanIdMask),
+            ConfigInt("filt1", &_config.filter[1], 0, (int32_t)TrackerCanIdMask),
+            ConfigInt("filt2", &_config.filter[2], 0, (int32_t)TrackerCanIdMask),
+            ConfigInt("filt3", &_config.filter[3], 0, (int32_t)TrackerCanIdMask),
+            ConfigInt("filt4", &_config.filter[4], 0, (int32_t)TrackerCanIdMask),
+            ConfigInt("filt5", &_config.filter[5], 0, (int32_t)TrackerCanIdMask),
+            ConfigBool("wake", &_config.wake),
+            ConfigInt("idle", &_config.idle_seconds, 0, 86400l),
+            ConfigBool("act_trig", &_config.active_trigger),
+        },
+        [](bool write, const void* context){ return 0; },
+        std::bind(&TrackerCan::exitConfigCb, this, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3)
+    );
+
+    CHECK(ConfigService::instance().registerModule(canDesc));
+
+    if (os_queue_create(&_eventQueue, sizeof(TrackerCanCommand), 1, nullptr)) {
+        _eventQueue = nullptr;
+        Log.error("os_queue_create() failed");
+        return SYSTEM_ERROR_INTERNAL;
+    }
+
+    if (os_thread_create(&_thread, "tracker_can", OS_THREAD_PRIORITY_DEFAULT + 1, TrackerCan::thread_f, this, OS_THREAD_STACK_SIZE_DEFAULT)) {
+        _thread = nullptr;
+        Log.error("os_thread_create() failed");
+        return SYSTEM_ERROR_INTERNAL;
+    }
+    TrackerPerf::instance().regThread(_thread);
+
+    _diagId = TrackerDiagnostics::instance().regBlock("can", [this](JSONWriter& writer){ writeDiag(writer); });
+
+    TrackerSleep::instance().registerSleepPrepare([this](TrackerSleepContext context){ this->onSleepPrepare(context); });
+    TrackerSleep::instance().registerSleep([this](TrackerSleepContext context){ this->onSleep(context); });
+    TrackerSleep::instance().registerWake([this](TrackerSleepContext context){ this->onWake(context); });
+
+    // Configuration is applied from the loop once the configuration service has loaded it
+    _reconfigure = true;
+
+    return SYSTEM_ERROR_NONE;
+}
+
+int TrackerCan::regFrameCallback(TrackerCanFrameCallback callback) {
+    CHECK_TRUE(callback, SYSTEM_ERROR_INVALID_ARGUMENT);
+    CHECK_TRUE(_frameCallbacks.append(callback), SYSTEM_ERROR_NO_MEMORY);
+
+    return SYSTEM_ERROR_NONE;
+}
+
+int TrackerCan::exitConfigCb(bool write, int status, const void* context) {
+    if (write && !status) {
+        _reconfigure = true;
+    }
+    return status;
+}
+
+int TrackerCan::start() {
+    WITH_LOCK(*this) {
+        if (_running) {
+            return SYSTEM_ERROR_NONE;
+        }
+
+        if (!Tracker::instance().isIoCanPowerEnabled()) {
+            Log.warn("CAN power is off");
+            return SYSTEM_ERROR_INVALID_STATE;
+        }
+
+        // Take the transceiver out of standby
+        digitalWrite(MCP_CAN_STBY_PIN, LOW);
+
+        auto idMode = (_config.extended) ? MCP_STDEXT : MCP_STD;
+        if (_can.begin(idMode, (uint8_t)_config.bitrate, MCP_20MHZ) != CAN_OK) {
+            digitalWrite(MCP_CAN_STBY_PIN, HIGH);
+            Log.error("CAN begin failed");
+            return SYSTEM_ERROR_IO;
+        }
+
+        // Acceptance masks and filters.  A zero mask accepts every identifier.
+        uint8_t ext = (_config.extended) ? 1 : 0;
+        for (size_t i = 0; i < TrackerCanMaskCount; i++) {
+            _can.init_Mask(i, ext, (uint32_t)_config.mask[i]);
+        }
+        for (size_t i = 0; i < TrackerCanFilterCount; i++) {
+            _can.init_Filt(i, ext, (uint32_t)_config.filter[i]);
+        }
+
+        _can.setMode((_config.listen_only) ? MCP_LISTENONLY : MCP_NORMAL);
+
+        _lastErrorFlags = 0;
+        _frameSeen = false;
+        _running = true;
+        attachInterrupt(MCP_CAN_INT_PIN, &TrackerCan::isr, FALLING);
+    }
+
+    // Frames may have arrived before the interrupt was attached
+    auto event = TrackerCanCommand::Receive;
+    (void)os_queue_put(_eventQueue, &event, 0, nullptr);
+
+    Log.info("CAN capture started");
+    return SYSTEM_ERROR_NONE;
+}
+
+void TrackerCan::stop() {
+    WITH_LOCK(*this) {
+        if (!_running) {
+            return;
+        }
+
+        detachInterrupt(MCP_CAN_INT_PIN);
+        _running = false;
+        _can.setMode(MCP_SLEEP);
+        digitalWrite(MCP_CAN_STBY_PIN, HIGH);
+    }
+
+    Log.info("CAN capture stopped");
+}
+
+void TrackerCan::getStats(TrackerCanStats& stats) {
+    WITH_LOCK(*this) {
+        stats = _stats;
+    }
+}
+
+bool TrackerCan::push(const TrackerCanFrame& frame) {
+    auto head = _ringHead.load(std::memory_order_relaxed);
+    auto tail = _ringTail.load(std::memory_order_acquire);
+
+    if ((head - tail) >= TrackerCanFrameRingSize) {
+        _stats.ringOverruns++;
+        return false;
+    }
+
+    _ring[head & (TrackerCanFrameRingSize - 1)] = frame;
+    _ringHead.store(head + 1, std::memory_order_release);
+
+    return true;
+}
+
+bool TrackerCan::pop(TrackerCanFrame& frame) {
+    auto tail = _ringTail.load(std::memory_order_relaxed);
+    auto head = _ringHead.load(std::memory_order_acquire);
+
+    if (head == tail) {
+        return false;
+    }
+
+    frame = _ring[tail & (TrackerCanFrameRingSize - 1)];
+    _ringTail.store(tail + 1, std::memory_order_release);
+
+    return true;
+}
+
+// Read both receive buffers until the controller has nothing left.  Each readMsgBuf() is a single
+// READ RX BUFFER burst that also clears the buffer interrupt flag.  Returns true when the limit of frames
+// for one call was reached with more waiting; INT then stays low and no new edge is signalled.
+bool TrackerCan::drain() {
+    bool more = false;
+    WITH_LOCK(*this) {
+        if (!_running) {
+            return false;
+        }
+
+        unsigned int count = 0;
+        while (_can.checkReceive() == CAN_MSGAVAIL) {
+            if (count++ >= TrackerCanDrainMax) {
+                more = true;
+                break;
+            }
+
+            uint32_t id = 0;
+            uint8_t len = 0;
+            TrackerCanFrame frame {};
+
+            if (_can.readMsgBuf(&id, &len, frame.data) != CAN_OK) {
+                break;
+            }
+
+            frame.timestamp = millis();
+            frame.id = id & TrackerCanIdMask;
+            frame.extended = (id & TrackerCanIdExtendedFlag) != 0;
+            frame.rtr = (id & TrackerCanIdRemoteFlag) != 0;
+            frame.len = std::min<uint8_t>(len, sizeof(frame.data));
+
+            _stats.frames++;
+            _lastFrameMs = frame.timestamp;
+            _frameSeen = true;
+            (void)push(frame);
+        }
+
+        updateErrors();
+    }
+
+    return more;
+}
+
+void TrackerCan::updateErrors() {
+    constexpr uint8_t overflowFlags = MCP_EFLG_RX0OVR | MCP_EFLG_RX1OVR;
+    constexpr uint8_t errorStateFlags = MCP_EFLG_TXBO | MCP_EFLG_TXEP | MCP_EFLG_RXEP;
+
+    auto flags = _can.getError();
+
+    // Count transitions only since flags remain set until the controller is reinitialized
+    auto raised = flags & ~_lastErrorFlags;
+    if (raised & overflowFlags) {
+        _stats.rxOverflows++;
+    }
+    if (raised & errorStateFlags) {
+        _stats.errorStates++;
+    }
+    _lastErrorFlags = flags;
+
+    _stats.rxErrorCount = _can.errorCountRX();
+    _stats.txErrorCount = _can.errorCountTX();
+}
+
+void TrackerCan::loop() {
+    if (_reconfigure) {
+        _reconfigure = false;
+        stop();
+        if (_config.enable) {
+            (void)start();
+        }
+        if (_config.enable && _config.wake) {
+            TrackerSleep::instance().wakeFor(MCP_CAN_INT_PIN, FALLING);
+        }
+        else {
+            TrackerSleep::instance().ignore(MCP_CAN_INT_PIN);
+        }
+    }
+
+    updateBusActivity();
+
+    // Limit work per loop to what the ring can hold so other services are not starved
+    TrackerCanFrame frame;
+    for (size_t i = 0; (i < TrackerCanFrameRingSize) && pop(frame); i++) {
+        for (auto& callback : _frameCallbacks) {
+            callback(frame);
+        }
+    }
+
+    // Report losses as soon as they happen
+    TrackerCanStats stats;
+    getStats(stats);
+    if ((stats.ringOverruns != _diagStats.ringOverruns) ||
+        (stats.rxOverflows != _diagStats.rxOverflows) ||
+        (stats.errorStates != _diagStats.errorStates)) {
+
+        _diagStats = stats;
+        (void)TrackerDiagnostics::instance().submit(_diagId);
+    }
+}
+
+void TrackerCan::updateBusActivity() {
+    bool active = false;
+
+    if (_wokeByBus) {
+        // The frame that woke the controller is not captured so count the wake itself as activity
+        _wokeByBus = false;
+        _lastFrameMs = millis();
+        _frameSeen = true;
+        active = _config.idle_seconds > 0;
+        if (!active && _config.active_trigger) {
+            TrackerLocation::instance().triggerLocPub(Trigger::IMMEDIATE, TrackerCanActiveTrigger);
+        }
+    }
+
+    if (_running && _frameSeen && (_config.idle_seconds > 0)) {
+        active = (millis() - _lastFrameMs) < ((system_tick_t)_config.idle_seconds * 1000);
+    }
+
+    if (active != _busActive) {
+        _busActive = active;
+        Log.info("CAN bus %s", (active) ? "active" : "idle");
+        if (active && _config.active_trigger) {
+            TrackerLocation::instance().triggerLocPub(Trigger::IMMEDIATE, TrackerCanActiveTrigger);
+        }
+    }
+
+    // Hold off sleep until the bus has been quiet for the idle time
+    if (_busActive) {
+        auto now = System.uptime();
+        if (now != _lastExtendSec) {
+            _lastExtendSec = now;
+            uint32_t quietSec = (millis() - _lastFrameMs) / 1000;
+            uint32_t idleSec = (uint32_t)_config.idle_seconds;
+            TrackerSleep::instance().extendExecutionFromNow((quietSec < idleSec) ? (idleSec - quietSec) : 0);
+        }
+    }
+}
+
+void TrackerCan::writeDiag(JSONWriter& writer) {
+    writer.name("frames").value((unsigned int)_diagStats.frames);
+    writer.name("ovr").value((unsigned int)_diagStats.ringOverruns);
+    writer.name("rx_ovf").value((unsigned int)_diagStats.rxOverflows);
+    writer.name("err").value((unsigned int)_diagStats.errorStates);
+    writer.name("rec").value((unsigned int)_diagStats.rxErrorCount);
+    writer.name("tec").value((unsigned int)_diagStats.txErrorCount);
+}
+
+void TrackerCan::onSleepPrepare(TrackerSleepContext context) {
+    // Summarize the cycle if anything was received
+    TrackerCanStats stats;
+    getStats(stats);
+    if (stats.frames != _diagStats.frames) {
+        _diagStats = stats;
+        (void)TrackerDiagnostics::instance().submit(_diagId);
+    }
+}
+
+// Leave the controller in sleep mode with its wake-up interrupt enabled.  The transceiver standby
+// receiver keeps monitoring the bus and the first dominant edge asserts the interrupt pin.
+void TrackerCan::armWake() {
+    // Pending receive flags would hold the interrupt pin low and wake the system immediately
+    while (drain()) {}
+
+    WITH_LOCK(*this) {
+        detachInterrupt(MCP_CAN_INT_PIN);
+        _running = false;
+        _can.setSleepWakeup(1);
+        _can.setMode(MCP_SLEEP);
+        digitalWrite(MCP_CAN_STBY_PIN, HIGH);
+        _wakeArmed = true;
+    }
+}
+
+void TrackerCan::onSleep(TrackerSleepContext context) {
+    _busActive = false;
+
+    if (_running && _config.wake) {
+        armWake();
+        return;
+    }
+
+    // IO/CAN power may be removed during sleep and the controller loses its configuration
+    stop();
+}
+
+void TrackerCan::onWake(TrackerSleepContext context) {
+    if (_wakeArmed && (context.result.wakeupReason() == SystemSleepWakeupReason::BY_GPIO) &&
+        (context.result.wakeupPin() == MCP_CAN_INT_PIN)) {
+
+        Log.info("CAN bus activity woke the system");
+        _wokeByBus = true;
+    }
+    _wakeArmed = false;
+
+    if (_config.enable) {
+        _reconfigure = true;
+    }
+}
+
+void TrackerCan::isr() {
+    auto event = TrackerCanCommand::Receive;
+    (void)os_queue_put(_instance->_eventQueue, &event, 0, nullptr);
+}
+
+void TrackerCan::thread_f(void* context) {
+    auto self = static_cast<TrackerCan*>(context);
+
+    bool exitLoop = false;
+    bool more = false;
+    while (!exitLoop) {
+        auto event = TrackerCanCommand::None;
+        // A timeout falls through to a poll so that a missed edge cannot stall capture.  Frames left by a
+        // capped drain are read again straight away.
+        (void)os_queue_take(self->_eventQueue, &event, (more) ? 0 : TrackerCanPollMs, nullptr);
+        more = false;
+
+        switch (event) {
+            case TrackerCanCommand::Exit: {
+                exitLoop = true;
+                break;
+            }
+
+            case TrackerCanCommand::None:
+            // Fall through
+            case TrackerCanCommand::Receive: {
+                more = self->drain();
+                break;
+            }
+        }
+    }
+
+    os_thread_exit(nullptr);
+}
@@ -0,0 +1,238 @@
+/*
+ * Copyright (c) 2022 Particle Industries, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <atomic>
+
+#include "Particle.h"
+#include "config_service.h"
+#include "tracker_config.h"
+#include "tracker_sleep.h"
+#include "mcp_can.h"
+
+// Number of frames buffered between the capture thread and the application loop, must be a power of two
+constexpr size_t TrackerCanFrameRingSize = 128;
+
+// Longest time, in milliseconds, the capture thread waits for an interrupt before polling the controller
+constexpr system_tick_t TrackerCanPollMs = 100;
+
+// Maximum frames read from the controller before the capture thread yields
+constexpr unsigned int TrackerCanDrainMax = 32;
+
+// Number of acceptance masks and filters in the MCP25625
+constexpr size_t TrackerCanMaskCount = 2;
+constexpr size_t TrackerCanFilterCount = 6;
+
+// Default time, in seconds, without frames before the bus is considered idle.  Zero disables activity tracking.
+constexpr int32_t TrackerCanDefaultIdleTime = 0;
+
+// Trigger name added to location publishes when the bus becomes active
+constexpr const char* TrackerCanActiveTrigger = "can_act";
+
+static_assert((TrackerCanFrameRingSize & (TrackerCanFrameRingSize - 1)) == 0, "frame ring size must be a power of two");
+
+/**
+ * @brief Commands to instruct the CAN capture thread
+ *
+ */
+enum class TrackerCanCommand {
+    None,                   /**< Poll the controller */
+    Receive,                /**< Controller interrupt asserted */
+    Exit,                   /**< Exit from thread */
+};
+
+/**
+ * @brief CAN frame as captured from the controller
+ *
+ */
+struct TrackerCanFrame {
+    uint32_t id;                    /**< 11-bit or 29-bit identifier */
+    system_tick_t timestamp;        /**< millis() when the frame was read from the controller */
+    bool extended;                  /**< Identifier is 29 bits */
+    bool rtr;                       /**< Remote transmission request */
+    uint8_t len;                    /**< Data length, 0 to 8 */
+    uint8_t data[8];                /**< Frame data */
+};
+
+/**
+ * @brief CAN capture counters since the last reset of statistics
+ *
+ */
+struct TrackerCanStats {
+    uint32_t frames;                /**< Frames read from the controller */
+    uint32_t ringOverruns;          /**< Frames dropped because the application did not keep up */
+    uint32_t rxOverflows;           /**< Controller receive buffer overflows */
+    uint32_t errorStates;           /**< Entries into error passive or bus off states */
+    uint8_t rxErrorCount;           /**< Controller receive error counter (REC) */
+    uint8_t txErrorCount;           /**< Controller transmit error counter (TEC) */
+};
+
+struct tracker_can_config_t {
+    bool enable;                    // capture frames from the bus
+    int32_t bitrate;                // MCP_CAN speed setting
+    bool listen_only;               // do not acknowledge frames or send error frames
+    bool extended;                  // masks and filters apply to 29-bit identifiers
+    int32_t mask[TrackerCanMaskCount];
+    int32_t filter[TrackerCanFilterCount];
+    bool wake;                      // leave the controller listening during sleep and wake on bus activity
+    int32_t idle_seconds;           // time without frames before sleep is permitted, 0 to disable
+    bool active_trigger;            // trigger an immediate location publish when the bus becomes active
+};
+
+/**
+ * @brief Type definition of the callback for captured frames.
+ *
+ */
+using TrackerCanFrameCallback = std::function<void(const TrackerCanFrame& frame)>;
+
+/**
+ * @brief TrackerCan class to capture frames from the MCP25625 CAN controller.
+ *
+ */
+class TrackerCan {
+public:
+    /**
+     * @brief Singleton class instance access for TrackerCan.
+     *
+     * @return TrackerCan&
+     */
+    static TrackerCan& instance() {
+        if (!_instance) {
+            _instance = new TrackerCan();
+        }
+        return *_instance;
+    }
+
+    /**
+     * @brief Initialize TrackerCan.
+     *
+     * @retval SYSTEM_ERROR_NONE
+     * @retval SYSTEM_ERROR_INTERNAL
+     */
+    int init();
+
+    /**
+     * @brief Register a callback for captured frames.  Callbacks run from the application loop.
+     *
+     * @param callback Function to call with each frame
+     * @retval SYSTEM_ERROR_NONE
+     * @retval SYSTEM_ERROR_NO_MEMORY
+     */
+    int regFrameCallback(TrackerCanFrameCallback callback);
+
+    /**
+     * @brief Indicate whether frames are being captured.
+     *
+     * @return true Controller is configured and receiving
+     * @return false Capture is stopped
+     */
+    bool isRunning() const {
+        return _running;
+    }
+
+    /**
+     * @brief Indicate whether frames were received within the configured idle time.
+     *
+     * @return true Bus is active
+     * @return false Bus is idle or activity tracking is disabled
+     */
+    bool isBusActive() const {
+        return _busActive;
+    }
+
+    /**
+     * @brief Indicate whether the controller has been left in sleep mode to wake the system on bus activity.
+     * IO/CAN power must stay on while this is true.
+     *
+     * @return true Bus wake is armed
+     * @return false Bus wake is not armed
+     */
+    bool isWakeArmed() const {
+        return _wakeArmed;
+    }
+
+    /**
+     * @brief Get capture counters.
+     *
+     * @param[out] stats Copy of the counters
+     */
+    void getStats(TrackerCanStats& stats);
+
+    /**
+     * @brief Dispatch captured frames.  This must be executed within every system loop.
+     *
+     */
+    void loop();
+
+    /**
+     * @brief Lock object
+     *
+     */
+    inline void lock() {mutex.lock();}
+
+    /**
+     * @brief Unlock object
+     *
+     */
+    inline void unlock() {mutex.unlock();}
+
+private:
+    TrackerCan();
+
+    static TrackerCan* _instance;
+
+    tracker_can_config_t _config;
+    RecursiveMutex mutex;
+    MCP_CAN _can;
+    os_queue_t _eventQueue;
+    os_thread_t _thread;
+    volatile bool _running;
+    bool _reconfigure;
+    volatile system_tick_t _lastFrameMs;
+    volatile bool _frameSeen;       // a frame arrived since capture started
+    bool _busActive;
+    bool _wakeArmed;
+    bool _wokeByBus;
+    uint32_t _lastExtendSec;
+    uint8_t _lastErrorFlags;
+    TrackerCanStats _stats;
+    TrackerCanStats _diagStats;     // counters as of the last diagnostics submit
+    int _diagId;
+
+    // Single producer (capture thread), single consumer (application loop)
+    TrackerCanFrame _ring[TrackerCanFrameRingSize];
+    std::atomic<uint32_t> _ringHead;
+    std::atomic<uint32_t> _ringTail;
+
+    Vector<TrackerCanFrameCallback> _frameCallbacks;
+
+    int start();
+    void stop();
+    int exitConfigCb(bool write, int status, const void* context);
+    bool push(const TrackerCanFrame& frame);
+    bool pop(TrackerCanFrame& frame);
+    bool drain();
+    void updateErrors();
+    void updateBusActivity();
+    void armWake();
+    void writeDiag(JSONWriter& writer);
+    void onSleepPrepare(TrackerSleepContext context);
+    void onSleep(TrackerSleepContext context);
+    void onWake(TrackerSleepContext context);
+    static void isr();
+    static void thread_f(void* context);
+};
@@ -0,0 +1,200 @@
+/*
+ * Copyright (c) 2022 Particle Industries, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "tracker_can_events.h"
+#include "tracker_location.h"
+#include "tracker_diagnostics.h"
+
+// Bytes taken by the event array around its entries and by the dropped count in the location publish
+constexpr size_t CanEventsArrayHeaderSize = sizeof(",\"canev\":[]") - 1;
+constexpr size_t CanEventsDroppedSize = sizeof(",\"canev_drop\":4294967295") - 1;
+
+TrackerCanEvents *TrackerCanEvents::_instance = nullptr;
+
+int TrackerCanEvents::init() {
+    _generation = TrackerJ1939::instance().getConfigGeneration();
+
+    CHECK(TrackerJ1939::instance().regSampleCallback(
+        [this](size_t index, uint32_t raw, double value, system_tick_t timestamp){ onSample(index, raw, value, timestamp); }));
+    TrackerLocation::instance().regLocGenCallback(&TrackerCanEvents::loc_gen_cb, this);
+
+    return SYSTEM_ERROR_NONE;
+}
+
+void TrackerCanEvents::resetStates() {
+    for (auto& state : _states) {
+        state = {};
+    }
+}
+
+// Samples arrive already resolved to a signal index by the decoder's PGN table so each one costs a
+// constant amount of work here.
+void TrackerCanEvents::onSample(size_t index, uint32_t raw, double value, system_tick_t timestamp) {
+    auto generation = TrackerJ1939::instance().getConfigGeneration();
+    if (generation != _generation) {
+        _generation = generation;
+        resetStates();
+    }
+
+    const auto& signal = TrackerJ1939::instance().getSignal(index);
+    if ((TrackerJ1939EventMode)signal.event == TrackerJ1939EventMode::DISABLE) {
+        return;
+    }
+
+    auto& state = _states[index];
+    if (!state.hasReported) {
+        // The first sample sets the baseline
+        state.reported = value;
+        state.hasReported = true;
+        return;
+    }
+
+    // A change that falls back inside the deadband before the debounce time is ignored
+    if (std::abs(value - state.reported) <= signal.deadband) {
+        state.pending = false;
+        return;
+    }
+
+    if (!state.pending) {
+        state.pending = true;
+        state.candidateMs = timestamp;
+    }
+    state.candidate = value;
+
+    evaluate(index, timestamp);
+}
+
+void TrackerCanEvents::evaluate(size_t index, system_tick_t now) {
+    const auto& signal = TrackerJ1939::instance().getSignal(index);
+    auto& state = _states[index];
+
+    if (!state.pending) {
+        return;
+    }
+    if ((now - state.candidateMs) < (system_tick_t)signal.debounce_ms) {
+        return;
+    }
+    if (state.fired && ((now - state.lastEventMs) < (system_tick_t)signal.rate_seconds * 1000)) {
+        return;
+    }
+
+    report(index, now);
+}
+
+void TrackerCanEvents::report(size_t index, system_tick_t now) {
+    const auto& signal = TrackerJ1939::instance().getSignal(index);
+    auto& state = _states[index];
+
+    state.reported = state.candidate;
+    state.pending = false;
+    state.fired = true;
+    state.lastEventMs = now;
+
+    // Keep the most recent events when the log fills
+    if (_logCount == TrackerCanEventLogSize) {
+        _logHead = (_logHead + 1) % TrackerCanEventLogSize;
+        _logCount--;
+        _logDropped++;
+    }
+    _log[(_logHead + _logCount) % TrackerCanEventLogSize] = {
+        .uptime = System.uptime(),
+        .spn = signal.spn,
+        .value = state.reported,
+    };
+    _logCount++;
+
+    switch ((TrackerJ1939EventMode)signal.event) {
+        case TrackerJ1939EventMode::NORMAL: {
+            TrackerLocation::instance().triggerLocPub(Trigger::NORMAL, TrackerCanEventTrigger);
+            break;
+        }
+
+        case TrackerJ1939EventMode::IMMEDIATE: {
+            TrackerLocation::instance().triggerLocPub(Trigger::IMMEDIATE, TrackerCanEventTrigger);
+            break;
+        }
+
+        default: {
+            break;
+        }
+    }
+}
+
+void TrackerCanEvents::loop() {
+    auto now = millis();
+    for (size_t i = 0; i < TrackerJ1939MaxSignals; i++) {
+        if (_states[i].pending) {
+            evaluate(i, now);
+        }
+    }
+}
+
+void TrackerCanEvents::loc_gen_cb(JSONWriter& writer, LocationPoint& point, const void* context) {
+    if (_logCount == 0) {
+        return;
+    }
+
+    // Space is left for the publish fields written after the callbacks
+    size_t used = writer.dataSize() + 1 /* null */ + TrackerDiagnosticsPublishReserve +
+        CanEventsArrayHeaderSize + ((_logDropped) ? CanEventsDroppedSize : 0);
+    size_t remaining = (writer.bufferSize() > used) ? (writer.bufferSize() - used) : 0;
+
+    // Events are sent oldest first, those that do not fit wait for the next publish
+    auto now = System.uptime();
+    size_t written = 0;
+    while (written < _logCount) {
+        const auto& event = _log[(_logHead + written) % TrackerCanEventLogSize];
+        auto size = eventSize(event, now);
+        if (size > remaining) {
+            break;
+        }
+        remaining -= size;
+
+        if (!written) {
+            writer.name("canev").beginArray();
+        }
+        writeEvent(writer, event, now);
+        written++;
+    }
+    if (written) {
+        writer.endArray();
+    }
+
+    if (_logDropped) {
+        writer.name("canev_drop").value(_logDropped);
+        _logDropped = 0;
+    }
+
+    _logHead = (_logHead + written) % TrackerCanEventLogSize;
+    _logCount -= written;
+}
+
+// Each event is [spn, value, seconds before this publish]
+void TrackerCanEvents::writeEvent(JSONWriter& writer, const TrackerCanEvent& event, uint32_t now) {
+    writer.beginArray();
+    writer.value((int)event.spn);
+    writer.value(event.value, 3);
+    writer.value((unsigned int)(now - event.uptime));
+    writer.endArray();
+}
+
+size_t TrackerCanEvents::eventSize(const TrackerCanEvent& event, uint32_t now) {
+    // A writer without a buffer only counts the bytes that would have been written
+    JSONBufferWriter sizer(nullptr, 0);
+    writeEvent(sizer, event, now);
+
+    return sizer.dataSize() + 1 /* separator */;
+}
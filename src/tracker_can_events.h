@@ -0,0 +1,106 @@
+/*
+ * Copyright (c) 2022 Particle Industries, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "Particle.h"
+#include "location_service.h"
+#include "tracker_j1939.h"
+
+// Number of events kept between location publishes
+constexpr size_t TrackerCanEventLogSize = 16;
+
+// Trigger name added to location publishes caused by CAN signal events
+constexpr const char* TrackerCanEventTrigger = "can";
+
+/**
+ * @brief Debounced change in a J1939 signal
+ *
+ */
+struct TrackerCanEvent {
+    uint32_t uptime;                /**< System uptime in seconds when the change was reported */
+    int32_t spn;                    /**< Suspect parameter number of the signal */
+    double value;                   /**< New value in engineering units */
+};
+
+/**
+ * @brief TrackerCanEvents class to detect changes in decoded J1939 signals and report them with location publishes.
+ *
+ */
+class TrackerCanEvents {
+public:
+    /**
+     * @brief Singleton class instance access for TrackerCanEvents.
+     *
+     * @return TrackerCanEvents&
+     */
+    static TrackerCanEvents& instance() {
+        if (!_instance) {
+            _instance = new TrackerCanEvents();
+        }
+        return *_instance;
+    }
+
+    /**
+     * @brief Initialize TrackerCanEvents.
+     *
+     * @retval SYSTEM_ERROR_NONE
+     */
+    int init();
+
+    /**
+     * @brief Report changes held back by debounce or rate limits.  This must be executed within every system loop.
+     *
+     */
+    void loop();
+
+private:
+    TrackerCanEvents() :
+        _generation(0),
+        _logHead(0),
+        _logCount(0),
+        _logDropped(0) {
+
+        resetStates();
+    }
+
+    struct SignalState {
+        bool hasReported;           // a baseline value exists
+        bool pending;               // a change is waiting on debounce or rate limits
+        bool fired;                 // at least one event was reported
+        double reported;            // value of the last reported event or the baseline
+        double candidate;           // most recent value of the pending change
+        system_tick_t candidateMs;  // when the pending change was first seen
+        system_tick_t lastEventMs;  // when the last event was reported
+    };
+
+    static TrackerCanEvents* _instance;
+
+    SignalState _states[TrackerJ1939MaxSignals];
+    unsigned int _generation;
+    TrackerCanEvent _log[TrackerCanEventLogSize];
+    size_t _logHead;
+    size_t _logCount;
+    unsigned int _logDropped;
+
+    void resetStates();
+    void onSample(size_t index, uint32_t raw, double value, system_tick_t timestamp);
+    void evaluate(size_t index, system_tick_t now);
+    void report(size_t index, system_tick_t now);
+    void loc_gen_cb(JSONWriter& writer, LocationPoint& point, const void* context);
+    static void writeEvent(JSONWriter& writer, const TrackerCanEvent& event, uint32_t now);
+    static size_t eventSize(const TrackerCanEvent& event, uint32_t now);
+};
@@ -15,6 +15,7 @@
  */
 
 #include "tracker_cellular.h"
+#include "tracker_perf.h"
 
 #if (PLATFORM_ID == PLATFORM_TRACKERM)
     #define ARRAY_SIZE(arr) (sizeof(arr) / sizeof((arr)[0]))
@@ -158,6 +159,9 @@ TrackerCellularCommand TrackerCellular::waitOnEvent(system_tick_t timeout) {
 // a thread to capture cellular signal strength in a non-blocking fashion
 void TrackerCellular::thread_f()
 {
+    // The handle of a Thread object is not accessible so the thread registers itself
+    TrackerPerf::instance().regThread(os_thread_current(nullptr));
+
     auto loop = true;
     while (loop) {
         // Look for requests and provide a loop delay
@@ -0,0 +1,132 @@
+/*
+ * Copyright (c) 2022 Particle Industries, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+/**
+ * @brief Fields of a configuration module that changed since the last time changes were taken.
+ *
+ * @tparam Field Enumeration of the module's fields, no more than 32 values
+ */
+template <typename Field>
+struct TrackerConfigChange {
+    uint32_t version;               /**< Count of accepted writes to the module since boot */
+    uint32_t fields;                /**< Bit per Field that changed */
+
+    /**
+     * @brief Indicate whether a field changed.
+     *
+     * @param field Field to check
+     * @return true Field changed
+     * @return false Field is unchanged
+     */
+    bool has(Field field) const {
+        return fields & TrackerConfigChange::mask(field);
+    }
+
+    /**
+     * @brief Indicate whether any field changed.
+     *
+     */
+    explicit operator bool() const {
+        return fields != 0;
+    }
+
+    /**
+     * @brief Get the bit for a field.
+     *
+     * @param field Field
+     * @return uint32_t Bit mask
+     */
+    static constexpr uint32_t mask(Field field) {
+        return 1UL << (unsigned int)field;
+    }
+
+    /**
+     * @brief Get the bit for a field when its old and new values differ.
+     *
+     * @param field Field
+     * @param before Value before the write
+     * @param after Value after the write
+     * @return uint32_t Bit mask, 0 when the values are equal
+     */
+    template <typename T>
+    static uint32_t diff(Field field, const T& before, const T& after) {
+        return (before != after) ? TrackerConfigChange::mask(field) : 0;
+    }
+};
+
+/**
+ * @brief Collects configuration changes written by the configuration service so that the owning module
+ * can apply them once, at a point of its choosing, instead of comparing its configuration every loop.
+ *
+ * @details Changes are posted from configuration exit callbacks and accumulate until taken.  Any number of
+ * writes between two takes results in a single change with the union of the changed fields.
+ *
+ * @tparam Field Enumeration of the module's fields, no more than 32 values
+ */
+template <typename Field>
+class TrackerConfigNotifier {
+public:
+    /**
+     * @brief Post changed fields.  A write that changed nothing is ignored.
+     *
+     * @param fields Bit per Field that changed
+     */
+    void notify(uint32_t fields) {
+        if (fields) {
+            _pending.fetch_or(fields);
+            _version++;
+        }
+    }
+
+    /**
+     * @brief Post a single changed field.
+     *
+     * @param field Field that changed
+     */
+    void notify(Field field) {
+        notify(TrackerConfigChange<Field>::mask(field));
+    }
+
+    /**
+     * @brief Take the changes posted since the last call.
+     *
+     * @return TrackerConfigChange<Field> Changed fields, none when nothing was posted
+     */
+    TrackerConfigChange<Field> take() {
+        return {
+            .version = _version,
+            .fields = _pending.exchange(0),
+        };
+    }
+
+    /**
+     * @brief Get the count of changes posted since boot.
+     *
+     * @return uint32_t
+     */
+    uint32_t version() const {
+        return _version;
+    }
+
+private:
+    std::atomic<uint32_t> _pending {0};
+    std::atomic<uint32_t> _version {0};
+};
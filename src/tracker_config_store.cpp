@@ -0,0 +1,304 @@
+/*
+ * Copyright (c) 2022 Particle Industries, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <cstddef>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "tracker_config_store.h"
+#include "tracker_crc.h"
+
+TrackerConfigStore *TrackerConfigStore::_instance = nullptr;
+
+static const char StoreFilePath[] = "/usr/cfg_store";
+static const char StoreTempFilePath[] = "/usr/cfg_store.tmp";
+static constexpr uint32_t StoreMagic = 0x47464354; // "TCFG"
+static constexpr uint32_t StoreCommitKey = 0;
+
+struct __attribute__((packed)) StoreFileHeader {
+    uint32_t magic;
+    uint16_t schema;
+    uint16_t reserved;
+};
+
+// The CRC covers the key, length and record contents
+struct __attribute__((packed)) StoreRecordHeader {
+    uint32_t key;
+    uint16_t length;
+    uint16_t reserved;
+    uint32_t crc;
+};
+
+static uint32_t recordCrc(const StoreRecordHeader& record, const void* data) {
+    auto crc = tracker_crc32(&record, offsetof(StoreRecordHeader, crc));
+    return tracker_crc32(data, record.length, crc);
+}
+
+uint32_t TrackerConfigStore::key(const char* name) {
+    auto value = tracker_crc32(name, strlen(name));
+    return (value == StoreCommitKey) ? StoreCommitKey + 1 : value;
+}
+
+void TrackerConfigStore::update(Vector<Entry>& index, const Entry& entry) {
+    for (auto& existing : index) {
+        if (existing.key == entry.key) {
+            existing = entry;
+            return;
+        }
+    }
+    index.append(entry);
+}
+
+// Records after the last commit marker belong to an interrupted save and are cut off along with
+// anything that fails its CRC so that later appends start from a known good point.
+void TrackerConfigStore::load() {
+    if (_loaded) {
+        return;
+    }
+    _loaded = true;
+
+    auto startMs = millis();
+    int fd = open(StoreFilePath, O_RDWR);
+    if (fd < 0) {
+        return;
+    }
+
+    StoreFileHeader header = {};
+    if ((::read(fd, &header, sizeof(header)) != sizeof(header)) ||
+        (header.magic != StoreMagic) || (header.schema != TrackerConfigStoreSchema)) {
+
+        Log.info("Config store format changed, discarding records");
+        close(fd);
+        unlink(StoreFilePath);
+        return;
+    }
+
+    uint32_t offset = sizeof(header);
+    _end = offset;
+    Vector<Entry> pending;
+    uint8_t buffer[TrackerConfigStoreMaxRecord];
+    while (true) {
+        StoreRecordHeader record = {};
+        if (::read(fd, &record, sizeof(record)) != sizeof(record)) {
+            break;
+        }
+        if ((record.length > sizeof(buffer)) ||
+            (record.length && (::read(fd, buffer, record.length) != record.length)) ||
+            (recordCrc(record, buffer) != record.crc)) {
+            break;
+        }
+        offset += sizeof(record) + record.length;
+
+        if (record.key == StoreCommitKey) {
+            for (const auto& entry : pending) {
+                update(_index, entry);
+            }
+            pending.clear();
+            _end = offset;
+        }
+        else {
+            pending.append({record.key, offset - record.length, record.length});
+        }
+    }
+
+    auto size = lseek(fd, 0, SEEK_END);
+    if ((size > 0) && ((uint32_t)size > _end)) {
+        _stats.discarded = (uint32_t)size - _end;
+        Log.warn("Config store discarding %lu bytes after the last commit", _stats.discarded);
+        (void)ftruncate(fd, _end);
+    }
+    close(fd);
+
+    _stats.records = _index.size();
+    _stats.loadMs = millis() - startMs;
+}
+
+int TrackerConfigStore::read(const char* name, void* data, size_t size) {
+    load();
+
+    auto wanted = key(name);
+    for (const auto& entry : _index) {
+        if (entry.key != wanted) {
+            continue;
+        }
+        CHECK_TRUE(entry.length == size, SYSTEM_ERROR_NOT_FOUND);
+
+        int fd = open(StoreFilePath, O_RDONLY);
+        CHECK_TRUE(fd >= 0, SYSTEM_ERROR_IO);
+        bool ok = (lseek(fd, entry.offset, SEEK_SET) == (off_t)entry.offset) &&
+            (::read(fd, data, size) == (ssize_t)size);
+        close(fd);
+
+        return (ok) ? SYSTEM_ERROR_NONE : SYSTEM_ERROR_IO;
+    }
+
+    return SYSTEM_ERROR_NOT_FOUND;
+}
+
+int TrackerConfigStore::writeRecord(int fd, uint32_t key, const void* data, size_t size) {
+    StoreRecordHeader record = {
+        .key = key,
+        .length = (uint16_t)size,
+        .reserved = 0,
+        .crc = 0,
+    };
+    record.crc = recordCrc(record, data);
+
+    CHECK_TRUE(write(fd, &record, sizeof(record)) == sizeof(record), SYSTEM_ERROR_IO);
+    if (size) {
+        CHECK_TRUE(write(fd, data, size) == (ssize_t)size, SYSTEM_ERROR_IO);
+    }
+
+    return SYSTEM_ERROR_NONE;
+}
+
+// Copy the latest committed record of each module into a new log and swap it in
+int TrackerConfigStore::compact() {
+    int in = open(StoreFilePath, O_RDONLY);
+    CHECK_TRUE(in >= 0, SYSTEM_ERROR_IO);
+    int out = open(StoreTempFilePath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out < 0) {
+        close(in);
+        return SYSTEM_ERROR_IO;
+    }
+
+    StoreFileHeader header = {
+        .magic = StoreMagic,
+        .schema = TrackerConfigStoreSchema,
+        .reserved = 0,
+    };
+    int ret = (write(out, &header, sizeof(header)) == sizeof(header)) ? SYSTEM_ERROR_NONE : SYSTEM_ERROR_IO;
+
+    Vector<Entry> index;
+    uint32_t offset = sizeof(header);
+    uint8_t buffer[TrackerConfigStoreMaxRecord];
+    for (const auto& entry : _index) {
+        if (ret) {
+            break;
+        }
+        if ((lseek(in, entry.offset, SEEK_SET) != (off_t)entry.offset) ||
+            (::read(in, buffer, entry.length) != entry.length)) {
+            ret = SYSTEM_ERROR_IO;
+            break;
+        }
+        ret = writeRecord(out, entry.key, buffer, entry.length);
+        offset += sizeof(StoreRecordHeader) + entry.length;
+        index.append({entry.key, offset - entry.length, entry.length});
+    }
+    if (!ret) {
+        ret = writeRecord(out, StoreCommitKey, nullptr, 0);
+        offset += sizeof(StoreRecordHeader);
+    }
+
+    close(in);
+    close(out);
+    if (!ret && rename(StoreTempFilePath, StoreFilePath)) {
+        ret = SYSTEM_ERROR_IO;
+    }
+    if (ret) {
+        unlink(StoreTempFilePath);
+        return ret;
+    }
+
+    _index = index;
+    _end = offset;
+    _stats.compactions++;
+
+    return SYSTEM_ERROR_NONE;
+}
+
+int TrackerConfigStore::begin(size_t records, size_t bytes) {
+    load();
+    CHECK_TRUE(_fd < 0, SYSTEM_ERROR_INVALID_STATE);
+
+    auto needed = (records + 1) * sizeof(StoreRecordHeader) + bytes;
+    if (_end && ((_end + needed) > TrackerConfigStoreMaxBytes)) {
+        CHECK(compact());
+    }
+    CHECK_TRUE((sizeof(StoreFileHeader) + needed) <= TrackerConfigStoreMaxBytes, SYSTEM_ERROR_TOO_LARGE);
+    CHECK_TRUE((_end + needed) <= TrackerConfigStoreMaxBytes, SYSTEM_ERROR_TOO_LARGE);
+
+    _fd = open(StoreFilePath, O_WRONLY | O_CREAT, 0644);
+    CHECK_TRUE(_fd >= 0, SYSTEM_ERROR_IO);
+
+    if (_end == 0) {
+        StoreFileHeader header = {
+            .magic = StoreMagic,
+            .schema = TrackerConfigStoreSchema,
+            .reserved = 0,
+        };
+        if (write(_fd, &header, sizeof(header)) != sizeof(header)) {
+            abandon();
+            return SYSTEM_ERROR_IO;
+        }
+        _end = sizeof(header);
+    }
+    // Uncommitted records from an earlier failed group are overwritten
+    if (lseek(_fd, _end, SEEK_SET) != (off_t)_end) {
+        abandon();
+        return SYSTEM_ERROR_IO;
+    }
+    _appendEnd = _end;
+    _staged.clear();
+
+    return SYSTEM_ERROR_NONE;
+}
+
+int TrackerConfigStore::append(const char* name, const void* data, size_t size) {
+    CHECK_TRUE(_fd >= 0, SYSTEM_ERROR_INVALID_STATE);
+    CHECK_TRUE(size <= TrackerConfigStoreMaxRecord, SYSTEM_ERROR_TOO_LARGE);
+
+    auto ret = writeRecord(_fd, key(name), data, size);
+    if (ret) {
+        abandon();
+        return ret;
+    }
+    _appendEnd += sizeof(StoreRecordHeader) + size;
+    _staged.append({key(name), _appendEnd - (uint32_t)size, (uint16_t)size});
+    _stats.appends++;
+
+    return SYSTEM_ERROR_NONE;
+}
+
+int TrackerConfigStore::commit() {
+    CHECK_TRUE(_fd >= 0, SYSTEM_ERROR_INVALID_STATE);
+
+    auto ret = writeRecord(_fd, StoreCommitKey, nullptr, 0);
+    if (ret || close(_fd)) {
+        _fd = -1;
+        _staged.clear();
+        return SYSTEM_ERROR_IO;
+    }
+    _fd = -1;
+
+    _appendEnd += sizeof(StoreRecordHeader);
+    _end = _appendEnd;
+    for (const auto& entry : _staged) {
+        update(_index, entry);
+    }
+    _staged.clear();
+
+    return SYSTEM_ERROR_NONE;
+}
+
+void TrackerConfigStore::abandon() {
+    if (_fd >= 0) {
+        close(_fd);
+        _fd = -1;
+    }
+    _staged.clear();
+}
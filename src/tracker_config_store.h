@@ -0,0 +1,150 @@
+/*
+ * Copyright (c) 2022 Particle Industries, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "Particle.h"
+
+// Bump when the layout of any stored configuration structure changes so that old records are dropped
+constexpr uint16_t TrackerConfigStoreSchema = 1;
+
+// Size, in bytes, the record log may grow to before it is compacted
+constexpr size_t TrackerConfigStoreMaxBytes = 4096;
+
+// Largest configuration record, in bytes
+constexpr size_t TrackerConfigStoreMaxRecord = 256;
+
+/**
+ * @brief Record log counters since boot
+ *
+ */
+struct TrackerConfigStoreStats {
+    uint32_t records;               /**< Committed records found by the boot scan */
+    uint32_t discarded;             /**< Bytes dropped at the end of the log because of a torn or corrupt write */
+    uint32_t loadMs;                /**< Time taken by the boot scan */
+    uint32_t appends;               /**< Records appended */
+    uint32_t compactions;           /**< Times the log was rewritten to reclaim space */
+};
+
+/**
+ * @brief TrackerConfigStore class to persist module configuration structures as a binary record log.
+ *
+ * @details Each save appends CRC-checked records followed by a commit marker so that a group of modules is
+ * stored all or nothing.  Appending spreads writes over the file system instead of rewriting a file per
+ * module, and the log is only rewritten when it reaches its size limit.  Committed records are indexed by
+ * one linear scan of the log.
+ */
+class TrackerConfigStore {
+public:
+    /**
+     * @brief Singleton class instance access for TrackerConfigStore.
+     *
+     * @return TrackerConfigStore&
+     */
+    static TrackerConfigStore& instance() {
+        if (!_instance) {
+            _instance = new TrackerConfigStore();
+        }
+        return *_instance;
+    }
+
+    /**
+     * @brief Read the latest committed record for a module.
+     *
+     * @param name Configuration module name
+     * @param[out] data Destination of the record
+     * @param size Expected size of the record
+     * @retval SYSTEM_ERROR_NONE
+     * @retval SYSTEM_ERROR_NOT_FOUND No record, or the stored record has a different size
+     * @retval SYSTEM_ERROR_IO
+     */
+    int read(const char* name, void* data, size_t size);
+
+    /**
+     * @brief Start a group of records.  Space for them is reclaimed first if needed.
+     *
+     * @param records Number of records to be appended
+     * @param bytes Total size of the records to be appended
+     * @retval SYSTEM_ERROR_NONE
+     * @retval SYSTEM_ERROR_INVALID_STATE
+     * @retval SYSTEM_ERROR_TOO_LARGE
+     * @retval SYSTEM_ERROR_IO
+     */
+    int begin(size_t records, size_t bytes);
+
+    /**
+     * @brief Append a record to the group.  It is not visible until commit().
+     *
+     * @param name Configuration module name
+     * @param data Record contents
+     * @param size Size of the record
+     * @retval SYSTEM_ERROR_NONE
+     * @retval SYSTEM_ERROR_INVALID_STATE
+     * @retval SYSTEM_ERROR_TOO_LARGE
+     * @retval SYSTEM_ERROR_IO
+     */
+    int append(const char* name, const void* data, size_t size);
+
+    /**
+     * @brief Write the commit marker that makes the group visible.
+     *
+     * @retval SYSTEM_ERROR_NONE
+     * @retval SYSTEM_ERROR_INVALID_STATE
+     * @retval SYSTEM_ERROR_IO
+     */
+    int commit();
+
+    /**
+     * @brief Get record log counters.
+     *
+     * @param[out] stats Current counters
+     */
+    void getStats(TrackerConfigStoreStats& stats) {
+        load();
+        stats = _stats;
+    }
+
+private:
+    TrackerConfigStore() :
+        _loaded(false),
+        _end(0),
+        _appendEnd(0),
+        _fd(-1) {
+    }
+
+    struct Entry {
+        uint32_t key;
+        uint32_t offset;            // file offset of the record contents
+        uint16_t length;
+    };
+
+    static TrackerConfigStore* _instance;
+
+    bool _loaded;
+    uint32_t _end;                  // file offset after the last committed record
+    uint32_t _appendEnd;            // file offset after the last record of the group being appended
+    int _fd;                        // open while a group is being appended
+    Vector<Entry> _index;           // committed records
+    Vector<Entry> _staged;          // records appended since begin()
+    TrackerConfigStoreStats _stats {};
+
+    void load();
+    int compact();
+    int writeRecord(int fd, uint32_t key, const void* data, size_t size);
+    void abandon();
+    static uint32_t key(const char* name);
+    static void update(Vector<Entry>& index, const Entry& entry);
+};
@@ -0,0 +1,205 @@
+/*
+ * Copyright (c) 2022 Particle Industries, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "tracker_config_txn.h"
+#include "tracker_config_store.h"
+#include "tracker_diagnostics.h"
+
+TrackerConfigTransaction *TrackerConfigTransaction::_instance = nullptr;
+
+// Modules without a stored record, or written by the configuration service after joining, are saved
+// so that the store starts out matching the configuration in use
+int TrackerConfigTransaction::init() {
+    const std::lock_guard<Mutex> lock(_lock);
+
+    persist();
+    capture();
+    _started = true;
+
+    // Module writes were already accepted when a transaction is rolled back so the cloud is told here
+    _diagId = TrackerDiagnostics::instance().regBlock("cfg_rb", [this](JSONWriter& writer){
+        writer.name("err").value(_stats.lastError);
+        writer.name("n").value((unsigned int)_stats.rollbacks);
+        writer.name("mods").beginArray();
+        for (size_t i = 0; i < _participants.size(); i++) {
+            if (_rolledBack & (1UL << i)) {
+                writer.value(_participants[i].name);
+            }
+        }
+        writer.endArray();
+    });
+
+    return SYSTEM_ERROR_NONE;
+}
+
+int TrackerConfigTransaction::join(const char* name, void* config, size_t size) {
+    CHECK_TRUE(config && size, SYSTEM_ERROR_INVALID_ARGUMENT);
+
+    const std::lock_guard<Mutex> lock(_lock);
+    Participant participant = {
+        .name = name,
+        .config = config,
+        .committed = new uint8_t[size],
+        .size = size,
+        .stored = false,
+    };
+    CHECK_TRUE(participant.committed, SYSTEM_ERROR_NO_MEMORY);
+
+    // The last committed configuration in the store takes over from what the configuration service
+    // loaded in case the service was interrupted while saving it.  Every later change is saved to the
+    // store so the two only differ after such an interruption.
+    if (TrackerConfigStore::instance().read(name, config, size) == SYSTEM_ERROR_NONE) {
+        Log.info("Loaded %s configuration from store", name);
+        participant.stored = true;
+    }
+    memcpy(participant.committed, config, size);
+    CHECK_TRUE(_participants.append(participant), SYSTEM_ERROR_NO_MEMORY);
+
+    return SYSTEM_ERROR_NONE;
+}
+
+int TrackerConfigTransaction::regValidator(TrackerConfigValidator validator) {
+    CHECK_TRUE(validator, SYSTEM_ERROR_INVALID_ARGUMENT);
+    CHECK_TRUE(_validators.append(validator), SYSTEM_ERROR_NO_MEMORY);
+
+    return SYSTEM_ERROR_NONE;
+}
+
+void TrackerConfigTransaction::touch() {
+    if (!_started) {
+        return;
+    }
+
+    auto now = millis();
+    _lastWriteMs = now;
+    if (!_open) {
+        _openMs = now;
+        _open = true;
+    }
+    _stats.writes++;
+}
+
+void TrackerConfigTransaction::capture() {
+    for (auto& participant : _participants) {
+        memcpy(participant.committed, participant.config, participant.size);
+    }
+}
+
+bool TrackerConfigTransaction::isChanged(const Participant& participant) {
+    return !participant.stored || memcmp(participant.committed, participant.config, participant.size);
+}
+
+// Save participants that differ from their last committed values, or were never saved, as one group
+void TrackerConfigTransaction::persist() {
+    size_t records = 0;
+    size_t bytes = 0;
+    for (const auto& participant : _participants) {
+        if (isChanged(participant)) {
+            records++;
+            bytes += participant.size;
+        }
+    }
+    if (!records) {
+        return;
+    }
+
+    auto& store = TrackerConfigStore::instance();
+    int ret = store.begin(records, bytes);
+    for (const auto& participant : _participants) {
+        if (ret) {
+            break;
+        }
+        if (isChanged(participant)) {
+            ret = store.append(participant.name, participant.config, participant.size);
+        }
+    }
+    if (!ret) {
+        ret = store.commit();
+    }
+    if (ret) {
+        // Leaving stored unset saves the whole group again with the next commit
+        Log.warn("Unable to save configuration to store (%d)", ret);
+    }
+    for (auto& participant : _participants) {
+        if (isChanged(participant)) {
+            participant.stored = !ret;
+        }
+    }
+}
+
+void TrackerConfigTransaction::restore() {
+    _rolledBack = 0;
+    for (size_t i = 0; i < _participants.size(); i++) {
+        auto& participant = _participants[i];
+        if (memcmp(participant.committed, participant.config, participant.size)) {
+            Log.info("Restoring %s configuration", participant.name);
+            memcpy(participant.config, participant.committed, participant.size);
+            _rolledBack |= (i < 32) ? (1UL << i) : 0;
+        }
+    }
+}
+
+bool TrackerConfigTransaction::loop() {
+    if (!_started) {
+        return false;
+    }
+
+    // The configuration service may reload or reset a module without passing through its exit callback.
+    // The change is checked and saved like any other write so that the store does not bring back the old
+    // values on the next boot.
+    if (!_open) {
+        for (const auto& participant : _participants) {
+            if (memcmp(participant.committed, participant.config, participant.size)) {
+                touch();
+                break;
+            }
+        }
+    }
+
+    if (!_open) {
+        return false;
+    }
+
+    auto now = millis();
+    if (((now - _lastWriteMs) < TrackerConfigTxnSettleMs) && ((now - _openMs) < TrackerConfigTxnMaxOpenMs)) {
+        return false;
+    }
+
+    const std::lock_guard<Mutex> lock(_lock);
+    int error = SYSTEM_ERROR_NONE;
+    for (auto& validator : _validators) {
+        error = validator();
+        if (error) {
+            break;
+        }
+    }
+
+    if (error) {
+        Log.error("Configuration transaction rejected (%d), rolling back", error);
+        restore();
+        _stats.rollbacks++;
+        _stats.lastError = error;
+        (void)TrackerDiagnostics::instance().submit(_diagId, true);
+    }
+    else {
+        persist();
+        capture();
+        _stats.commits++;
+    }
+    _open = false;
+
+    return true;
+}
@@ -0,0 +1,171 @@
+/*
+ * Copyright (c) 2022 Particle Industries, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "Particle.h"
+
+// Time, in milliseconds, without further configuration writes before a transaction is committed
+constexpr system_tick_t TrackerConfigTxnSettleMs = 2000;
+
+// Longest time, in milliseconds, a transaction stays open under a steady stream of writes
+constexpr system_tick_t TrackerConfigTxnMaxOpenMs = 30000;
+
+/**
+ * @brief Type definition of a cross-module configuration check run before a transaction commits.
+ *
+ * @details Returns SYSTEM_ERROR_NONE when the staged configuration is consistent.
+ */
+using TrackerConfigValidator = std::function<int()>;
+
+/**
+ * @brief Transaction counters since boot
+ *
+ */
+struct TrackerConfigTxnStats {
+    uint32_t commits;               /**< Transactions applied */
+    uint32_t rollbacks;             /**< Transactions rejected by a validator and rolled back */
+    uint32_t writes;                /**< Module writes grouped into transactions */
+    int lastError;                  /**< Validator error of the last rollback */
+};
+
+/**
+ * @brief TrackerConfigTransaction class to apply configuration written to several modules as one unit.
+ *
+ * @details Configuration arrives from the cloud one module at a time.  Each write to a participating module
+ * opens, or extends, a transaction.  While it is open modules keep their written values staged and continue
+ * to run on their last applied values.  Once writes settle, cross-module validators run and either every
+ * participating module applies its staged values at its next safe point, with a single configuration flush,
+ * or every participant is restored to its last committed values.  Module writes were already accepted by
+ * then so a rollback is reported with the validator error in the "cfg_rb" diagnostics block.  Committed
+ * values are also saved together to the config store, as are changes the configuration service makes
+ * outside of a module write, so that the store always follows the configuration in use.
+ */
+class TrackerConfigTransaction {
+public:
+    /**
+     * @brief Singleton class instance access for TrackerConfigTransaction.
+     *
+     * @return TrackerConfigTransaction&
+     */
+    static TrackerConfigTransaction& instance() {
+        if (!_instance) {
+            _instance = new TrackerConfigTransaction();
+        }
+        return *_instance;
+    }
+
+    /**
+     * @brief Start grouping writes into transactions.  Writes made while loading stored configuration
+     * at boot, before this call, are not grouped but are saved to the config store.
+     *
+     * @retval SYSTEM_ERROR_NONE
+     */
+    int init();
+
+    /**
+     * @brief Add module configuration to transactions.  It is captured when joining and after each commit and
+     * restored on rollback so it must be plain data.  Configuration committed to the config store replaces
+     * the given values when joining, so call this before the module first applies its configuration.
+     *
+     * @param name Configuration module name
+     * @param config Staged configuration written by the configuration service
+     * @param size Size of the configuration
+     * @retval SYSTEM_ERROR_NONE
+     * @retval SYSTEM_ERROR_INVALID_ARGUMENT
+     * @retval SYSTEM_ERROR_NO_MEMORY
+     */
+    int join(const char* name, void* config, size_t size);
+
+    /**
+     * @brief Register a check run against staged configuration before commit.
+     *
+     * @param validator Function returning SYSTEM_ERROR_NONE when the staged configuration is valid
+     * @retval SYSTEM_ERROR_NONE
+     * @retval SYSTEM_ERROR_NO_MEMORY
+     */
+    int regValidator(TrackerConfigValidator validator);
+
+    /**
+     * @brief Record a write to a participating module.  Call from the module's configuration exit callback.
+     *
+     */
+    void touch();
+
+    /**
+     * @brief Indicate whether writes are staged and waiting on commit.  Modules hold off applying
+     * configuration changes while this is true.
+     *
+     * @return true Transaction is open
+     * @return false No transaction is open
+     */
+    bool isOpen() const {
+        return _open;
+    }
+
+    /**
+     * @brief Get transaction counters.
+     *
+     * @param[out] stats Current counters
+     */
+    void getStats(TrackerConfigTxnStats& stats) const {
+        stats = _stats;
+    }
+
+    /**
+     * @brief Commit or roll back a settled transaction.  This must be executed within every system loop.
+     *
+     * @return true A transaction completed on this call and configuration should be flushed
+     * @return false Nothing to flush
+     */
+    bool loop();
+
+private:
+    TrackerConfigTransaction() :
+        _started(false),
+        _open(false),
+        _openMs(0),
+        _lastWriteMs(0),
+        _rolledBack(0),
+        _diagId(-1) {
+    }
+
+    struct Participant {
+        const char* name;
+        void* config;
+        uint8_t* committed;
+        size_t size;
+        bool stored;                // the config store holds the committed values
+    };
+
+    static TrackerConfigTransaction* _instance;
+
+    Vector<Participant> _participants;
+    Vector<TrackerConfigValidator> _validators;
+    bool _started;
+    volatile bool _open;
+    system_tick_t _openMs;
+    volatile system_tick_t _lastWriteMs;
+    TrackerConfigTxnStats _stats {};
+    Mutex _lock;
+    uint32_t _rolledBack;           // bit per participant restored by the last rollback
+    int _diagId;
+
+    void capture();
+    static bool isChanged(const Participant& participant);
+    void persist();
+    void restore();
+};
@@ -0,0 +1,32 @@
+/*
+ * Copyright (c) 2022 Particle Industries, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * @brief Compute a CRC-32 (IEEE 802.3, as used by zlib) over a buffer.
+ *
+ * @details Pass the result of a previous call as crc to continue over several buffers.
+ *
+ * @param data Data to check
+ * @param length Length of data in bytes
+ * @param crc CRC of the preceding data, 0 to start
+ * @return uint32_t CRC of all data so far
+ */
+uint32_t tracker_crc32(const void* data, size_t length, uint32_t crc = 0);
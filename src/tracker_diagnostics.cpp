@@ -0,0 +1,241 @@
+/*
+ * Copyright (c) 2022 Particle Industries, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "tracker_diagnostics.h"
+#include "tracker_location.h"
+
+TrackerDiagnostics *TrackerDiagnostics::_instance = nullptr;
+
+// Configuration service node setup
+// { "diagnostics" :
+//     { "coalesce": false,
+//       "max_defer": 3600
+//      }
+//  }
+
+int TrackerDiagnostics::init() {
+    static ConfigObject diagnosticsDesc
+    (
+        "diagnostics",
+        {
+            ConfigBool("coalesce", &_config.coalesce),
+            ConfigInt("max_defer", &_config.max_defer_seconds, 0, 86400l),
+        }
+    );
+
+    CHECK(ConfigService::instance().registerModule(diagnosticsDesc));
+
+    TrackerSleep::instance().registerWake([this](TrackerSleepContext context){ this->onWake(context); });
+    TrackerSleep::instance().registerSleepPrepare([this](TrackerSleepContext context){ this->onSleepPrepare(context); });
+    TrackerLocation::instance().regLocGenCallback(&TrackerDiagnostics::loc_gen_cb, this);
+
+    return SYSTEM_ERROR_NONE;
+}
+
+int TrackerDiagnostics::regBlock(const char* name, DiagnosticsWriterCallback callback) {
+    CHECK_TRUE(name && callback, SYSTEM_ERROR_INVALID_ARGUMENT);
+    CHECK_TRUE(_blockCount < TrackerDiagnosticsMaxBlocks, SYSTEM_ERROR_NO_MEMORY);
+
+    _blocks[_blockCount] = {
+        .name = name,
+        .callback = callback,
+        .pending = false,
+        .pendingSec = 0,
+    };
+
+    return (int)_blockCount++;
+}
+
+int TrackerDiagnostics::submit(int id, bool immediate) {
+    CHECK_TRUE((id >= 0) && ((size_t)id < _blockCount), SYSTEM_ERROR_INVALID_ARGUMENT);
+
+    auto& block = _blocks[id];
+    if (!block.pending) {
+        block.pending = true;
+        block.pendingSec = System.uptime();
+    }
+    if (immediate) {
+        _pendingAfterPublish = true;
+    }
+
+    return SYSTEM_ERROR_NONE;
+}
+
+void TrackerDiagnostics::writeBlock(JSONWriter& writer, const Block& block) {
+    writer.name(block.name).beginObject();
+    block.callback(writer);
+    writer.endObject();
+}
+
+// Callbacks are expected to write the same content until the block is submitted again so that the
+// measured size is exactly what is written into the publish.
+size_t TrackerDiagnostics::blockSize(const Block& block) {
+    // A writer without a buffer only counts the bytes that would have been written
+    JSONBufferWriter sizer(nullptr, 0);
+    sizer.beginObject();
+    writeBlock(sizer, block);
+    sizer.endObject();
+
+    return sizer.dataSize() - 2 /* enclosing braces */ + 1 /* separator */;
+}
+
+// Blocks that do not fit are left pending for another event and blocks stay pending until they are sent
+int TrackerDiagnostics::publishBlocks(const char* event, bool single) {
+    CloudService &cloud_service = CloudService::instance();
+    std::lock_guard<CloudService> lg(cloud_service);
+
+    cloud_service.beginCommand(event);
+    auto& cloudWriter = cloud_service.writer();
+    size_t used = cloudWriter.dataSize() + 1 /* null */ + TrackerDiagnosticsEndCommandSize;
+    size_t remaining = (cloudWriter.bufferSize() > used) ? (cloudWriter.bufferSize() - used) : 0;
+
+    uint32_t written = 0;
+    bool deferred = false;
+    for (size_t i = 0; i < _blockCount; i++) {
+        auto& block = _blocks[i];
+        if (!block.pending || (single && strcmp(block.name, event))) {
+            continue;
+        }
+
+        auto size = blockSize(block);
+        if (size > remaining) {
+            if (written) {
+                deferred = true;
+            }
+            else {
+                // Could never be sent, even alone
+                Log.error("Diagnostics block %s of %u bytes is too large", block.name, size);
+                block.pending = false;
+            }
+            continue;
+        }
+
+        writeBlock(cloudWriter, block);
+        written |= 1u << i;
+        remaining -= size;
+    }
+
+    if (!written) {
+        return SYSTEM_ERROR_NONE;
+    }
+
+    auto ret = cloud_service.send();
+    if (ret) {
+        // Everything is retried once the holdoff from tick() has passed
+        _pendingAfterPublish = true;
+        _sendFailed = true;
+        _sendFailSec = System.uptime();
+        return ret;
+    }
+    _cycleDiagMessages++;
+
+    for (size_t i = 0; i < _blockCount; i++) {
+        if (written & (1u << i)) {
+            _blocks[i].pending = false;
+        }
+    }
+    if (deferred) {
+        _pendingAfterPublish = true;
+    }
+
+    return SYSTEM_ERROR_NONE;
+}
+
+void TrackerDiagnostics::loc_gen_cb(JSONWriter& writer, LocationPoint& point, const void* context) {
+    _cycleLocMessages++;
+
+    if (!_config.coalesce) {
+        return;
+    }
+
+    // The location publish is written into the cloud service buffer so the space left can be known exactly
+    auto& cloudWriter = CloudService::instance().writer();
+    size_t used = cloudWriter.dataSize() + 1 /* null */ + TrackerDiagnosticsPublishReserve;
+    size_t remaining = (cloudWriter.bufferSize() > used) ? (cloudWriter.bufferSize() - used) : 0;
+
+    for (size_t i = 0; i < _blockCount; i++) {
+        auto& block = _blocks[i];
+        if (!block.pending) {
+            continue;
+        }
+
+        auto size = blockSize(block);
+        if (size > remaining) {
+            // Send whatever doesn't fit in one combined event after this publish
+            _pendingAfterPublish = true;
+            continue;
+        }
+
+        writeBlock(writer, block);
+        block.pending = false;
+        remaining -= size;
+    }
+}
+
+void TrackerDiagnostics::tick() {
+    if (!Particle.connected()) {
+        return;
+    }
+
+    auto now = System.uptime();
+    if (_sendFailed && ((now - _sendFailSec) < TrackerDiagnosticsRetrySec)) {
+        return;
+    }
+    _sendFailed = false;
+
+    bool pending = false;
+    bool expired = false;
+
+    for (size_t i = 0; i < _blockCount; i++) {
+        auto& block = _blocks[i];
+        if (!block.pending) {
+            continue;
+        }
+        pending = true;
+        if (now - block.pendingSec >= (uint32_t)_config.max_defer_seconds) {
+            expired = true;
+        }
+    }
+
+    if (!pending) {
+        _pendingAfterPublish = false;
+        return;
+    }
+
+    if (!_config.coalesce) {
+        // Each block is its own event
+        for (size_t i = 0; i < _blockCount; i++) {
+            if (_blocks[i].pending && publishBlocks(_blocks[i].name, true)) {
+                break;
+            }
+        }
+        return;
+    }
+
+    if (_pendingAfterPublish || expired) {
+        _pendingAfterPublish = false;
+        publishBlocks(TrackerDiagnosticsEventName, false);
+    }
+}
+
+void TrackerDiagnostics::onWake(TrackerSleepContext context) {
+    _cycleLocMessages = 0;
+    _cycleDiagMessages = 0;
+}
+
+void TrackerDiagnostics::onSleepPrepare(TrackerSleepContext context) {
+    Log.info("Cloud messages this cycle: loc=%u diag=%u", _cycleLocMessages, _cycleDiagMessages);
+}
@@ -0,0 +1,164 @@
+/*
+ * Copyright (c) 2022 Particle Industries, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "Particle.h"
+#include "cloud_service.h"
+#include "config_service.h"
+#include "location_service.h"
+#include "tracker_sleep.h"
+
+// Maximum number of diagnostic blocks that can be registered
+constexpr size_t TrackerDiagnosticsMaxBlocks = 8;
+
+// Bytes kept free in the location publish for triggers and tower information
+constexpr size_t TrackerDiagnosticsPublishReserve = 256;
+
+// Default maximum time, in seconds, that a pending block may wait for a location publish
+constexpr int32_t TrackerDiagnosticsDefaultMaxDefer = 3600;
+
+// Bytes kept free for the end of a diagnostics event
+constexpr size_t TrackerDiagnosticsEndCommandSize = sizeof(",\"req_id\":4294967295}") - 1;
+
+// Time, in seconds, to wait before sending pending blocks again after a send fails
+constexpr uint32_t TrackerDiagnosticsRetrySec = 30;
+
+// Event name for diagnostics that could not be attached to a location publish
+constexpr const char* TrackerDiagnosticsEventName = "diag";
+
+/**
+ * @brief Type definition of the callback that writes the fields of a diagnostic block.
+ *
+ */
+using DiagnosticsWriterCallback = std::function<void(JSONWriter& writer)>;
+
+struct tracker_diagnostics_config_t {
+    bool coalesce;                  // attach pending blocks to the next location publish
+    int32_t max_defer_seconds;      // longest time a block waits for a location publish
+};
+
+/**
+ * @brief TrackerDiagnostics class to collect low priority diagnostic blocks and send them with as few cloud
+ * messages as possible.
+ *
+ */
+class TrackerDiagnostics {
+public:
+    /**
+     * @brief Singleton class instance access for TrackerDiagnostics.
+     *
+     * @return TrackerDiagnostics&
+     */
+    static TrackerDiagnostics& instance() {
+        if (!_instance) {
+            _instance = new TrackerDiagnostics();
+        }
+        return *_instance;
+    }
+
+    /**
+     * @brief Initialize TrackerDiagnostics.
+     *
+     * @retval SYSTEM_ERROR_NONE
+     */
+    int init();
+
+    /**
+     * @brief Register a diagnostic block.
+     *
+     * @param name Name of the block.  Used as the object key in publishes and as the event name when sent alone.
+     * @param callback Function to write the fields of the block.
+     * @retval Non-negative block identifier
+     * @retval SYSTEM_ERROR_NO_MEMORY
+     */
+    int regBlock(const char* name, DiagnosticsWriterCallback callback);
+
+    /**
+     * @brief Mark a diagnostic block as having data to send.
+     *
+     * @param id Block identifier returned from regBlock().
+     * @param immediate Send without waiting for a location publish to coalesce with
+     * @retval SYSTEM_ERROR_NONE
+     * @retval SYSTEM_ERROR_INVALID_ARGUMENT
+     */
+    int submit(int id, bool immediate = false);
+
+    /**
+     * @brief Indicate whether diagnostic blocks are attached to location publishes.
+     *
+     * @return true Blocks are coalesced
+     * @return false Blocks are sent as individual events
+     */
+    bool isCoalescing() const {
+        return _config.coalesce;
+    }
+
+    /**
+     * @brief Get the number of cloud messages sent during the current wake cycle.
+     *
+     * @return unsigned int Count of location and diagnostic events
+     */
+    unsigned int getCycleMessages() const {
+        return _cycleLocMessages + _cycleDiagMessages;
+    }
+
+    /**
+     * @brief Process pending blocks.  This must be executed within every system loop.
+     *
+     */
+    void tick();
+
+private:
+    TrackerDiagnostics() :
+        _blockCount(0),
+        _pendingAfterPublish(false),
+        _sendFailed(false),
+        _sendFailSec(0),
+        _cycleLocMessages(0),
+        _cycleDiagMessages(0) {
+
+        _config = {
+            .coalesce = false,
+            .max_defer_seconds = TrackerDiagnosticsDefaultMaxDefer,
+        };
+    }
+
+    struct Block {
+        const char* name;
+        DiagnosticsWriterCallback callback;
+        bool pending;
+        uint32_t pendingSec;
+    };
+
+    static TrackerDiagnostics* _instance;
+
+    tracker_diagnostics_config_t _config;
+    Block _blocks[TrackerDiagnosticsMaxBlocks];
+    size_t _blockCount;
+    bool _pendingAfterPublish;
+    bool _sendFailed;               // hold off sending until the retry time has passed
+    uint32_t _sendFailSec;
+    unsigned int _cycleLocMessages;
+    unsigned int _cycleDiagMessages;
+
+    static void writeBlock(JSONWriter& writer, const Block& block);
+    static size_t blockSize(const Block& block);
+    int publishBlocks(const char* event, bool single);
+    void loc_gen_cb(JSONWriter& writer, LocationPoint& point, const void* context);
+    void onWake(TrackerSleepContext context);
+    void onSleepPrepare(TrackerSleepContext context);
+};
@@ -0,0 +1,206 @@
+/*
+ * Copyright (c) 2022 Particle Industries, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "tracker_export.h"
+#include "tracker_crc.h"
+
+TrackerExport *TrackerExport::_instance = nullptr;
+
+int TrackerExport::regSource(const TrackerExportSource& source) {
+    CHECK_TRUE(source.name && source.open && source.read, SYSTEM_ERROR_INVALID_ARGUMENT);
+    CHECK_TRUE(_sources.size() < (int)TrackerExportMaxSources, SYSTEM_ERROR_NO_MEMORY);
+    CHECK_TRUE(_sources.append(source), SYSTEM_ERROR_NO_MEMORY);
+
+    return SYSTEM_ERROR_NONE;
+}
+
+bool TrackerExport::isExportRequest(const char* data, size_t size) {
+    return data && (size >= sizeof(TrackerExportRequest)) && ((uint8_t)data[0] == TrackerExportMagic);
+}
+
+int TrackerExport::queue(ctrl_request* req) {
+    ctrl_request* expected = nullptr;
+    return (_pending.compare_exchange_strong(expected, req)) ? SYSTEM_ERROR_NONE : SYSTEM_ERROR_BUSY;
+}
+
+// Control requests are completed here, on the application thread, so that sources do not need to be
+// safe against the system thread
+void TrackerExport::loop() {
+    auto req = _pending.exchange(nullptr);
+    if (req) {
+        auto result = process(req);
+        system_ctrl_set_result(req, result, nullptr, nullptr, nullptr);
+        _sessionLastMs = millis();
+    }
+    else if (_sessionOpen && ((millis() - _sessionLastMs) >= TrackerExportIdleMs)) {
+        Log.warn("Closing idle export of %s", _sources[_sessionSource].name);
+        closeSession();
+    }
+}
+
+void TrackerExport::closeSession() {
+    if (!_sessionOpen) {
+        return;
+    }
+    auto& source = _sources[_sessionSource];
+    if (source.close) {
+        source.close();
+    }
+    _sessionOpen = false;
+}
+
+int TrackerExport::snapshotCrc(uint32_t& crc) {
+    auto& source = _sources[_sessionSource];
+    uint8_t buffer[128];
+    crc = 0;
+    for (size_t offset = 0; offset < _sessionSize;) {
+        auto ret = source.read(offset, buffer, std::min(sizeof(buffer), _sessionSize - offset));
+        CHECK(ret);
+        CHECK_TRUE(ret > 0, SYSTEM_ERROR_IO);
+        crc = tracker_crc32(buffer, ret, crc);
+        offset += ret;
+    }
+
+    return SYSTEM_ERROR_NONE;
+}
+
+// Allocate the reply and copy the header in front of length bytes of data already placed after it
+int TrackerExport::reply(ctrl_request* req, const TrackerExportReply& header, size_t length) {
+    if (!req->reply_data) {
+        CHECK_TRUE(!system_ctrl_alloc_reply_data(req, sizeof(header) + length, nullptr), SYSTEM_ERROR_NO_MEMORY);
+    }
+    memcpy(req->reply_data, &header, sizeof(header));
+    req->reply_size = sizeof(header) + length;
+
+    return SYSTEM_ERROR_NONE;
+}
+
+int TrackerExport::process(ctrl_request* req) {
+    TrackerExportRequest request = {};
+    memcpy(&request, req->request_data, sizeof(request));
+
+    TrackerExportReply header = {
+        .magic = TrackerExportMagic,
+        .op = request.op,
+        .source = request.source,
+        .reserved = 0,
+        .session = request.session,
+        .offset = request.offset,
+        .total = 0,
+        .length = 0,
+        .reserved2 = 0,
+        .crc = 0,
+    };
+
+    switch ((TrackerExportOp)request.op) {
+        case TrackerExportOp::LIST: {
+            size_t length = 0;
+            for (const auto& source : _sources) {
+                length += strlen(source.name) + 1;
+            }
+            CHECK_TRUE(!system_ctrl_alloc_reply_data(req, sizeof(header) + length, nullptr), SYSTEM_ERROR_NO_MEMORY);
+
+            auto data = req->reply_data + sizeof(header);
+            for (const auto& source : _sources) {
+                auto size = strlen(source.name) + 1;
+                memcpy(data, source.name, size);
+                data += size;
+            }
+            header.total = _sources.size();
+            header.length = length;
+            header.crc = tracker_crc32(req->reply_data + sizeof(header), length);
+            return reply(req, header, length);
+        }
+
+        case TrackerExportOp::OPEN: {
+            CHECK_TRUE(request.source < _sources.size(), SYSTEM_ERROR_INVALID_ARGUMENT);
+            closeSession();
+
+            size_t size = 0;
+            CHECK(_sources[request.source].open(size));
+            _sessionOpen = true;
+            _sessionSource = request.source;
+            _sessionSize = size;
+            _sessionBytes = 0;
+            _sessionStartMs = millis();
+            if (++_session == 0) {
+                _session = 1;
+            }
+
+            uint32_t crc = 0;
+            auto ret = snapshotCrc(crc);
+            if (ret) {
+                closeSession();
+                return ret;
+            }
+            header.session = _session;
+            header.offset = 0;
+            header.total = size;
+            header.crc = crc;
+            return reply(req, header, 0);
+        }
+
+        case TrackerExportOp::READ: {
+            CHECK_TRUE(_sessionOpen && (request.session == _session), SYSTEM_ERROR_INVALID_STATE);
+            CHECK_TRUE(request.offset <= _sessionSize, SYSTEM_ERROR_OUT_OF_RANGE);
+
+            size_t length = (request.length) ? std::min((size_t)request.length, TrackerExportMaxPage) : TrackerExportMaxPage;
+            length = std::min(length, _sessionSize - request.offset);
+            CHECK_TRUE(!system_ctrl_alloc_reply_data(req, sizeof(header) + length, nullptr), SYSTEM_ERROR_NO_MEMORY);
+
+            auto data = (uint8_t*)req->reply_data + sizeof(header);
+            auto ret = (length) ? _sources[_sessionSource].read(request.offset, data, length) : 0;
+            CHECK(ret);
+            header.source = _sessionSource;
+            header.total = _sessionSize;
+            header.length = ret;
+            header.crc = tracker_crc32(data, ret);
+            _sessionBytes += ret;
+            return reply(req, header, ret);
+        }
+
+        case TrackerExportOp::CONSUME: {
+            CHECK_TRUE(_sessionOpen && (request.session == _session), SYSTEM_ERROR_INVALID_STATE);
+            auto& source = _sources[_sessionSource];
+            CHECK_TRUE(source.consume, SYSTEM_ERROR_NOT_SUPPORTED);
+
+            auto ret = source.consume();
+            // The snapshot no longer matches the source either way
+            closeSession();
+            CHECK(ret);
+            header.source = _sessionSource;
+            return reply(req, header, 0);
+        }
+
+        case TrackerExportOp::CLOSE: {
+            CHECK_TRUE(_sessionOpen && (request.session == _session), SYSTEM_ERROR_INVALID_STATE);
+
+            auto elapsed = millis() - _sessionStartMs;
+            Log.info("Exported %lu bytes of %s in %lu ms (%lu KB/s)", _sessionBytes, _sources[_sessionSource].name,
+                elapsed, (uint32_t)(((uint64_t)_sessionBytes * 1000) / 1024 / std::max(elapsed, (system_tick_t)1)));
+
+            header.source = _sessionSource;
+            header.offset = elapsed;
+            header.total = _sessionBytes;
+            closeSession();
+            return reply(req, header, 0);
+        }
+
+        default: {
+            return SYSTEM_ERROR_NOT_SUPPORTED;
+        }
+    }
+}
@@ -0,0 +1,179 @@
+/*
+ * Copyright (c) 2022 Particle Industries, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <atomic>
+
+#include "Particle.h"
+
+// First byte of every export request and reply.  Never the start of a JSON text command.
+constexpr uint8_t TrackerExportMagic = 0xeb;
+
+// Maximum number of export sources that can be registered
+constexpr size_t TrackerExportMaxSources = 6;
+
+// Largest page of data returned by one read request, in bytes
+constexpr size_t TrackerExportMaxPage = 1024;
+
+// Time, in milliseconds, without requests before an open session is closed so that its source is released
+constexpr system_tick_t TrackerExportIdleMs = 60000;
+
+/**
+ * @brief Export request operations
+ *
+ */
+enum class TrackerExportOp : uint8_t {
+    LIST,                           /**< Reply data is the NUL separated source names, total is the count */
+    OPEN,                           /**< Snapshot a source, total is its size and crc covers all of it */
+    READ,                           /**< Read a page of the open snapshot at offset */
+    CONSUME,                        /**< Drop the exported snapshot from the source, where supported */
+    CLOSE,                          /**< End the session, total is bytes read and offset the session time in ms */
+};
+
+/**
+ * @brief Export request as sent by the host, little endian
+ *
+ */
+struct __attribute__((packed)) TrackerExportRequest {
+    uint8_t magic;                  /**< TrackerExportMagic */
+    uint8_t op;                     /**< TrackerExportOp */
+    uint8_t source;                 /**< Source index from LIST, for OPEN */
+    uint8_t reserved;
+    uint32_t session;               /**< Session from OPEN, for READ, CONSUME and CLOSE */
+    uint32_t offset;                /**< Offset into the snapshot, for READ */
+    uint16_t length;                /**< Maximum bytes to return, for READ */
+    uint16_t reserved2;
+};
+
+/**
+ * @brief Header of every export reply, little endian, followed by length bytes of data
+ *
+ */
+struct __attribute__((packed)) TrackerExportReply {
+    uint8_t magic;                  /**< TrackerExportMagic */
+    uint8_t op;                     /**< Operation replied to */
+    uint8_t source;                 /**< Source of the session */
+    uint8_t reserved;
+    uint32_t session;               /**< Session identifier */
+    uint32_t offset;                /**< Offset of the data in the snapshot */
+    uint32_t total;                 /**< Operation specific, see TrackerExportOp */
+    uint16_t length;                /**< Bytes of data following this header */
+    uint16_t reserved2;
+    uint32_t crc;                   /**< CRC-32 of the data, or of the whole snapshot for OPEN */
+};
+
+/**
+ * @brief Callbacks of an export source.  All are called from the application loop.
+ *
+ */
+struct TrackerExportSource {
+    const char* name;
+    std::function<int(size_t& size)> open;                                  /**< Take a snapshot and report its size */
+    std::function<int(size_t offset, uint8_t* data, size_t length)> read;   /**< Copy from the snapshot, return bytes copied */
+    std::function<int()> consume;                                           /**< Optional, drop the snapshot from the source */
+    std::function<void()> close;                                            /**< Optional, release the snapshot */
+};
+
+/**
+ * @brief TrackerExport class to read stored records and diagnostics over USB control requests.
+ *
+ * @details A host lists the sources, opens one to snapshot it and then reads it a page at a time.  Each page
+ * and the whole snapshot carry a CRC-32 so that a host can retry a bad page or resume an interrupted
+ * transfer from the last good offset while the session is open.  Sources that are drained as they are
+ * exported, such as the store and forward queue, only drop data on an explicit CONSUME after the host has
+ * verified it.
+ */
+class TrackerExport {
+public:
+    /**
+     * @brief Singleton class instance access for TrackerExport.
+     *
+     * @return TrackerExport&
+     */
+    static TrackerExport& instance() {
+        if (!_instance) {
+            _instance = new TrackerExport();
+        }
+        return *_instance;
+    }
+
+    /**
+     * @brief Register an export source.
+     *
+     * @param source Source callbacks, open and read are required
+     * @retval SYSTEM_ERROR_NONE
+     * @retval SYSTEM_ERROR_INVALID_ARGUMENT
+     * @retval SYSTEM_ERROR_NO_MEMORY
+     */
+    int regSource(const TrackerExportSource& source);
+
+    /**
+     * @brief Indicate whether a control request carries an export request.
+     *
+     * @param data Request data
+     * @param size Request size
+     * @return true Export request
+     * @return false Other request, such as a text command
+     */
+    static bool isExportRequest(const char* data, size_t size);
+
+    /**
+     * @brief Accept a control request to be completed from the application loop.  Called from the
+     * system thread.
+     *
+     * @param req Control request
+     * @retval SYSTEM_ERROR_NONE Request will be completed later
+     * @retval SYSTEM_ERROR_BUSY A request is already waiting
+     */
+    int queue(ctrl_request* req);
+
+    /**
+     * @brief Complete waiting export requests and close idle sessions.  This must be executed within
+     * every system loop.
+     *
+     */
+    void loop();
+
+private:
+    TrackerExport() :
+        _pending(nullptr),
+        _sessionOpen(false),
+        _session(0),
+        _sessionSource(0),
+        _sessionSize(0),
+        _sessionBytes(0),
+        _sessionStartMs(0),
+        _sessionLastMs(0) {
+    }
+
+    static TrackerExport* _instance;
+
+    Vector<TrackerExportSource> _sources;
+    std::atomic<ctrl_request*> _pending;
+    bool _sessionOpen;
+    uint32_t _session;
+    uint8_t _sessionSource;
+    size_t _sessionSize;
+    uint32_t _sessionBytes;
+    system_tick_t _sessionStartMs;
+    system_tick_t _sessionLastMs;
+
+    int process(ctrl_request* req);
+    int reply(ctrl_request* req, const TrackerExportReply& header, size_t length);
+    int snapshotCrc(uint32_t& crc);
+    void closeSession();
+};
@@ -17,6 +17,9 @@
 #include "Particle.h"
 #include "tracker_fuelgauge.h"
 #include "model_gauge.h"
+#include "tracker_diagnostics.h"
+#include "tracker_power.h"
+#include "tracker_sleep.h"
 
 using namespace particle::power;
 
@@ -42,6 +45,46 @@ const model_config_t model_config_lg18650_1S4P = {
 TrackerFuelGauge *TrackerFuelGauge::_instance = nullptr;
 static ModelGauge model_gauge(model_config_lg18650_1S4P);
 
+// Resting cell voltage, in millivolts, to state of charge, in 0.001 %
+static constexpr struct {
+    int32_t mv;
+    int32_t soc;
+} ocvTable[] = {
+    {3300, 0}, {3500, 5000}, {3600, 10000}, {3650, 20000}, {3700, 30000}, {3750, 40000}, {3790, 50000},
+    {3830, 60000}, {3870, 70000}, {3920, 80000}, {4000, 90000}, {4100, 95000}, {4200, 100000},
+};
+
+// Measurement variances in (0.001 %)^2.  The voltage estimate is only trusted loosely since it
+// sags under load and cools with temperature.
+static constexpr int64_t SocVarianceModel = 2000LL * 2000LL;
+static constexpr int64_t SocVarianceFuel = 4000LL * 4000LL;
+static constexpr int64_t SocVarianceVoltage = 8000LL * 8000LL;
+static constexpr int64_t SocVarianceInitial = 5000LL * 5000LL;
+// Growth of the estimate variance per second for unmodelled current
+static constexpr int64_t SocVariancePerSec = 100LL;
+
+static int32_t voltageToSoc(int32_t mv) {
+    constexpr size_t count = sizeof(ocvTable) / sizeof(ocvTable[0]);
+    if (mv <= ocvTable[0].mv) {
+        return ocvTable[0].soc;
+    }
+    for (size_t i = 1; i < count; i++) {
+        if (mv < ocvTable[i].mv) {
+            auto& low = ocvTable[i - 1];
+            auto& high = ocvTable[i];
+            return low.soc + (high.soc - low.soc) * (mv - low.mv) / (high.mv - low.mv);
+        }
+    }
+    return ocvTable[count - 1].soc;
+}
+
+// One step of a scalar Kalman update with the gain in Q16
+static void socMeasure(TrackerSocEstimate& est, int32_t z, int64_t r) {
+    int64_t gain = (est.variance << 16) / (est.variance + r);
+    est.soc += (int32_t)((gain * (int64_t)(z - est.soc)) >> 16);
+    est.variance -= (gain * est.variance) >> 16;
+}
+
 void TrackerFuelGauge::init()
 {
     // load model config when power on
@@ -64,25 +107,183 @@ void TrackerFuelGauge::init()
     System.setPowerConfiguration(cfg);
 
     verify_model();
+    sample_soc();
+
+    // Verification is considered after each wake and charge state change rather than on a fixed period
+    TrackerSleep::instance().registerWake([this](TrackerSleepContext context){ request_verify(VerifyReason::WAKE); });
+    TrackerPower::instance().regTransitionCallback([this](const TrackerPowerTransition& transition){
+        if (transition.type == TrackerPowerEvent::CHARGE) {
+            request_verify(VerifyReason::CHARGE);
+        }
+    });
+
+    diagId = TrackerDiagnostics::instance().regBlock("fg", [this](JSONWriter& writer){
+        writer.name("ver").value((unsigned int)statsSubmitted.verifyCount);
+        writer.name("rel").value((unsigned int)statsSubmitted.verifyFail);
+        writer.name("skip").value((unsigned int)statsSubmitted.verifySkipped);
+        writer.name("jump").value((unsigned int)statsSubmitted.socJumps);
+    });
+
+#ifdef FUEL_GAUGE_TEST
+    testDiagId = TrackerDiagnostics::instance().regBlock("FUEL_GUAGE_TEST",
+        [this](JSONWriter& writer){ writeTest(writer); });
+#endif
 }
 
 void TrackerFuelGauge::verify_model()
 {
     // verify model, reload model if verify failed
     auto ret = model_gauge.verify_model();
-    verifyCount++;
+    lastVerify = System.uptime();
+    stats.verifyCount++;
     if (ModelGaugeStatus::NONE != ret) {
-        verifyFail++;
+        stats.verifyFail++;
+        Log.warn("Fuel gauge model drift detected and reloaded");
+    }
+}
+
+void TrackerFuelGauge::request_verify(VerifyReason reason)
+{
+    // Keep the most pressing reason
+    if (reason > pendingReason) {
+        pendingReason = reason;
+    }
+}
+
+// Battery current expected from the power state; only the sign and rough size matter since the
+// measurements correct the estimate
+int32_t TrackerFuelGauge::estimate_current()
+{
+    auto& power = TrackerPower::instance();
+    switch (power.getChargeState()) {
+        case BATTERY_STATE_CHARGING: {
+            return (int32_t)System.getPowerConfiguration().batteryChargeCurrent() / 2;
+        }
+
+        case BATTERY_STATE_DISCHARGING:
+        // Fall through
+        case BATTERY_STATE_NOT_CHARGING: {
+            return (power.isExternalPower()) ? 0 : -TrackerFuelGaugeAwakeLoadMa;
+        }
+
+        default: {
+            return 0;
+        }
+    }
+}
+
+// Fixed point scalar Kalman filter with a constant number of operations per update.  The prediction
+// integrates the assumed current and the correction folds in each available measurement.
+void TrackerFuelGauge::fuse_soc(int32_t modelSoc, int32_t fuelSoc, int32_t voltageMv)
+{
+    auto now = System.uptime();
+    auto& est = socEstimate;
+
+    if (!est.valid) {
+        if (modelSoc < 0) {
+            return;
+        }
+        est.valid = true;
+        est.soc = modelSoc;
+        est.variance = SocVarianceInitial;
+        est.uptime = now;
+        est.currentMa = estimate_current();
+        return;
+    }
+
+    // Predict; time spent asleep adds uncertainty but no assumed current
+    int64_t elapsed = now - est.uptime;
+    int64_t awake = std::min<int64_t>(elapsed, 2 * TrackerFuelGaugeSampleInterval);
+    est.soc += (int32_t)((int64_t)est.currentMa * awake * 100000 / ((int64_t)TrackerFuelGaugeCapacityMah * 3600));
+    est.variance += SocVariancePerSec * elapsed;
+
+    // Correct
+    if (modelSoc >= 0) {
+        socMeasure(est, modelSoc, SocVarianceModel);
+    }
+    if (fuelSoc >= 0) {
+        socMeasure(est, fuelSoc, SocVarianceFuel);
     }
+    // The cell voltage only approximates rest while on battery and not charging
+    est.currentMa = estimate_current();
+    if ((voltageMv > 0) && (est.currentMa <= 0) && !TrackerPower::instance().isExternalPower()) {
+        socMeasure(est, voltageToSoc(voltageMv), SocVarianceVoltage);
+    }
+
+    est.soc = std::max<int32_t>(0, std::min<int32_t>(100000, est.soc));
+    est.uptime = now;
+}
+
+void TrackerFuelGauge::sample_soc()
+{
+    auto soc = getSoC();
+    lastSample = System.uptime();
+
+    FuelGauge fuel;
+    auto fuelSoc = fuel.getSoC();
+    auto volt = getVolt();
+    fuse_soc((soc >= 0.0f) ? (int32_t)(soc * 1000.0f) : -1,
+        (fuelSoc >= 0.0f) ? (int32_t)(fuelSoc * 1000.0f) : -1,
+        (volt > 0.0f) ? (int32_t)(volt * 1000.0f) : 0);
+
+    if (soc < 0.0f) {
+        return;
+    }
+
+    if ((lastSoc >= 0.0f) && (std::abs(soc - lastSoc) > TrackerFuelGaugeSocJump)) {
+        Log.warn("Fuel gauge state of charge jumped from %.1f to %.1f", lastSoc, soc);
+        stats.socJumps++;
+        request_verify(VerifyReason::SOC_JUMP);
+    }
+    lastSoc = soc;
 }
 
 void TrackerFuelGauge::loop()
 {
-    // verify model every 1 hour
-    if(System.uptime() - last_1h >= 3600)
-    {
-        last_1h = System.uptime();
-        verify_model();
+    auto now = System.uptime();
+
+    // A fresh sample after wake or a charge change lets a jump be caught by the same verification
+    if ((pendingReason != VerifyReason::NONE) || (now - lastSample >= TrackerFuelGaugeSampleInterval)) {
+        sample_soc();
+    }
+
+    if (now - lastVerify >= TrackerFuelGaugeMaxVerifyInterval) {
+        request_verify(VerifyReason::WATCHDOG);
+    }
+
+    switch (pendingReason) {
+        case VerifyReason::NONE: {
+            break;
+        }
+
+        case VerifyReason::WAKE:
+        // Fall through
+        case VerifyReason::CHARGE: {
+            // Readings were consistent and the model was checked recently
+            if (now - lastVerify < TrackerFuelGaugeMinVerifyInterval) {
+                stats.verifySkipped++;
+                break;
+            }
+            verify_model();
+            break;
+        }
+
+        case VerifyReason::SOC_JUMP:
+        // Fall through
+        case VerifyReason::WATCHDOG: {
+            verify_model();
+            break;
+        }
+    }
+    pendingReason = VerifyReason::NONE;
+
+    // Routine verifications happen every wake so on their own they only ride along with location publishes
+    // when blocks are coalesced, drift and jumps are always reported
+    auto& diagnostics = TrackerDiagnostics::instance();
+    bool anomaly = (stats.verifyFail != statsSubmitted.verifyFail) || (stats.socJumps != statsSubmitted.socJumps);
+    if (anomaly || (diagnostics.isCoalescing() && memcmp(&stats, &statsSubmitted, sizeof(stats)))) {
+        statsSubmitted = stats;
+        (void)diagnostics.submit(diagId);
     }
 #ifdef FUEL_GAUGE_TEST
     test();
@@ -135,6 +336,8 @@ void TrackerFuelGauge::enable_publish_pmic_regs(bool enable)
 }
 
 
+// Capture the readings when the test is due so that the diagnostic block writes the same content
+// no matter when, or how many times, it is serialized
 void TrackerFuelGauge::test()
 {
     static uint32_t publicInterval = 0;
@@ -142,65 +345,71 @@ void TrackerFuelGauge::test()
     extern float stsTemperature;
     if (System.uptime() - publicInterval > 60 && Particle.connected())
     {
-        float thTemperature = get_temperature();
-        auto source = System.powerSource();
-        int state = System.batteryState();
-        float batterySocSystem = System.batteryCharge();
-        const String szPowerSources[] = {
-            "unknown", "vin", "usb host", "usb adapter",
-            "usb otg", "battery"
-        };
-        const String szBatteryState[] =
-        {
-            "UNKNOWN","NOT_CHARGING","CHARGING","CHARGED","DISCHARGING","FAULT","DISCONNECTED"
-        };
-        if (state > BATTERY_STATE_DISCONNECTED)
-        {
-            state = BATTERY_STATE_UNKNOWN;
-        }
-
-
-
-
-        CloudService &cloud_service = CloudService::instance();
-        cloud_service.beginCommand("FUEL_GUAGE_TEST");
-        cloud_service.writer().name("FUEL_GUAGE_TEST").beginObject();
-        cloud_service.writer().name("source").value(szPowerSources[source].c_str());
-        cloud_service.writer().name("state").value(szBatteryState[state].c_str());
-        cloud_service.writer().name("sys_soc").value(batterySocSystem,2);
-        cloud_service.writer().name("fg_soc").value(fuel.getSoC(),2);
-        cloud_service.writer().name("mg_soc").value(getSoC(),2);
-        cloud_service.writer().name("voltage").value(getVolt(),3);
-        cloud_service.writer().name("verify").value(verifyCount);
-        cloud_service.writer().name("reload").value(verifyFail);
-        cloud_service.writer().name("stemp").value((double)stsTemperature, 1);
-        cloud_service.writer().name("ttemp").value((double)thTemperature, 1);
+        testSnapshot.thTemperature = get_temperature();
+        testSnapshot.source = System.powerSource();
+        testSnapshot.state = System.batteryState();
+        testSnapshot.sysSoc = System.batteryCharge();
+        testSnapshot.fgSoc = fuel.getSoC();
+        testSnapshot.mgSoc = getSoC();
+        testSnapshot.voltage = getVolt();
+        testSnapshot.stsTemperature = stsTemperature;
+        testSnapshot.regsValid = publishPMICRegs;
         if (publishPMICRegs)
         {
-            uint8_t regs[11] {};
             {
                 PMIC pmic(true);
-                auto ret = readPmicRegister(0x6b, 0, regs, ARRAY_SIZE(regs));
+                auto ret = readPmicRegister(0x6b, 0, testSnapshot.regs, ARRAY_SIZE(testSnapshot.regs));
             }
             auto powerConfig = System.getPowerConfiguration();
-            cloud_service.writer().name("charge_current").value(powerConfig.batteryChargeCurrent());
-            cloud_service.writer().name("regs").beginArray();
-            for (int i = 0;i < ARRAY_SIZE(regs);i++) {
-                cloud_service.writer().value((unsigned int)regs[i]);
-            }
-            cloud_service.writer().endArray();
+            testSnapshot.chargeCurrent = powerConfig.batteryChargeCurrent();
         }
 
+        TrackerDiagnostics::instance().submit(testDiagId);
 
-        cloud_service.writer().endObject();
+        publicInterval = System.uptime();
+    }
+}
 
-        cloud_service.lock();
-        int rval = cloud_service.send();
-        cloud_service.unlock();
-        //Log.info("%.*s", cloud_service.writer().dataSize(), cloud_service.writer().buffer());
-        //Log.info("### Publish FuelGauge Data %s ###",rval == -EBUSY ? "FAIL" : "SUCCESS");
+static constexpr const char* szPowerSources[] = {
+    "unknown", "vin", "usb host", "usb adapter",
+    "usb otg", "battery"
+};
+static constexpr const char* szBatteryState[] =
+{
+    "UNKNOWN","NOT_CHARGING","CHARGING","CHARGED","DISCHARGING","FAULT","DISCONNECTED"
+};
 
-        publicInterval = System.uptime();
+void TrackerFuelGauge::writeTest(JSONWriter& writer)
+{
+    int source = testSnapshot.source;
+    if ((source < 0) || (source >= (int)ARRAY_SIZE(szPowerSources)))
+    {
+        source = POWER_SOURCE_UNKNOWN;
+    }
+    int state = testSnapshot.state;
+    if ((state < 0) || (state > BATTERY_STATE_DISCONNECTED))
+    {
+        state = BATTERY_STATE_UNKNOWN;
+    }
+
+    writer.name("source").value(szPowerSources[source]);
+    writer.name("state").value(szBatteryState[state]);
+    writer.name("sys_soc").value(testSnapshot.sysSoc,2);
+    writer.name("fg_soc").value(testSnapshot.fgSoc,2);
+    writer.name("mg_soc").value(testSnapshot.mgSoc,2);
+    writer.name("voltage").value(testSnapshot.voltage,3);
+    writer.name("verify").value((unsigned int)stats.verifyCount);
+    writer.name("reload").value((unsigned int)stats.verifyFail);
+    writer.name("stemp").value((double)testSnapshot.stsTemperature, 1);
+    writer.name("ttemp").value((double)testSnapshot.thTemperature, 1);
+    if (testSnapshot.regsValid)
+    {
+        writer.name("charge_current").value(testSnapshot.chargeCurrent);
+        writer.name("regs").beginArray();
+        for (int i = 0;i < ARRAY_SIZE(testSnapshot.regs);i++) {
+            writer.value((unsigned int)testSnapshot.regs[i]);
+        }
+        writer.endArray();
     }
 }
 #endif
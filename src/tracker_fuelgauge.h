@@ -18,6 +18,48 @@
 
 #include "config_service.h"
 
+// Minimum time, in seconds, between model verifications requested by wake or charge state changes
+constexpr uint32_t TrackerFuelGaugeMinVerifyInterval = 15 * 60;
+
+// Maximum time, in seconds, between model verifications regardless of activity
+constexpr uint32_t TrackerFuelGaugeMaxVerifyInterval = 6 * 3600;
+
+// Time, in seconds, between state of charge samples used to detect jumps
+constexpr uint32_t TrackerFuelGaugeSampleInterval = 60;
+
+// Change in state of charge, in percent, between samples that is treated as implausible
+constexpr float TrackerFuelGaugeSocJump = 5.0f;
+
+// Nominal capacity, in milliamp hours, of the battery described by the gauge model (LG 18650 1S4P)
+constexpr int32_t TrackerFuelGaugeCapacityMah = 4 * 3000;
+
+// Estimated system load, in milliamps, while awake on battery
+constexpr int32_t TrackerFuelGaugeAwakeLoadMa = 80;
+
+/**
+ * @brief Fixed point state of the fused state of charge estimate
+ *
+ * Charge is held in thousandths of a percent and the variance in the square of that unit.
+ */
+struct TrackerSocEstimate {
+    bool valid;                     /**< The estimate has been seeded */
+    int32_t soc;                    /**< State of charge in 0.001 % */
+    int64_t variance;               /**< Variance of the estimate in (0.001 %)^2 */
+    uint32_t uptime;                /**< System uptime of the last update */
+    int32_t currentMa;              /**< Battery current assumed since the last update, positive when charging */
+};
+
+/**
+ * @brief Counters for fuel gauge model verification
+ *
+ */
+struct TrackerFuelGaugeStats {
+    uint32_t verifyCount;           /**< Model verifications performed */
+    uint32_t verifyFail;            /**< Verifications that found drift and reloaded the model */
+    uint32_t verifySkipped;         /**< Opportunities skipped because readings were consistent */
+    uint32_t socJumps;              /**< Implausible state of charge jumps detected */
+};
+
 class TrackerFuelGauge
 {
     public:
@@ -43,18 +85,69 @@ class TrackerFuelGauge
          * @return voltage value
          */
         float getVolt();
+
+        /**
+         * @brief get the state of charge fused from the gauge model, the fuel gauge and the battery voltage
+         * @return soc percentage value, negative if not yet available
+         */
+        float getFusedSoC() const
+        {
+            return (socEstimate.valid) ? (float)socEstimate.soc / 1000.0f : -1.0f;
+        }
+
+        /**
+         * @brief get model verification counters
+         * @return counters since boot
+         */
+        TrackerFuelGaugeStats getStats() const
+        {
+            return stats;
+        }
 #ifdef FUEL_GAUGE_TEST
         void enable_publish_pmic_regs(bool enable);
 #endif
     private:
         TrackerFuelGauge() {}
+        // Reasons to consider a model verification
+        enum class VerifyReason {
+            NONE,
+            WAKE,
+            CHARGE,
+            SOC_JUMP,
+            WATCHDOG,
+        };
         void verify_model();
+        void request_verify(VerifyReason reason);
+        void sample_soc();
+        void fuse_soc(int32_t modelSoc, int32_t fuelSoc, int32_t voltageMv);
+        int32_t estimate_current();
 #ifdef FUEL_GAUGE_TEST
+        struct TestSnapshot {
+            int source;
+            int state;
+            float sysSoc;
+            float fgSoc;
+            float mgSoc;
+            float voltage;
+            float stsTemperature;
+            float thTemperature;
+            bool regsValid;
+            uint16_t chargeCurrent;
+            uint8_t regs[11];
+        };
         void test();
+        void writeTest(JSONWriter& writer);
         bool publishPMICRegs = false;
+        int testDiagId = -1;
+        TestSnapshot testSnapshot {};
 #endif
         static TrackerFuelGauge *_instance;
-        uint32_t last_1h = 0;
-        uint32_t verifyCount {};
-        uint32_t verifyFail {};
+        uint32_t lastVerify = 0;
+        uint32_t lastSample = 0;
+        float lastSoc = -1.0f;
+        VerifyReason pendingReason = VerifyReason::NONE;
+        int diagId = -1;
+        TrackerFuelGaugeStats stats {};
+        TrackerFuelGaugeStats statsSubmitted {};
+        TrackerSocEstimate socEstimate {};
 };
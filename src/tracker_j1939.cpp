@@ -0,0 +1,438 @@
+/*
+ * Copyright (c) 2022 Particle Industries, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "tracker_j1939.h"
+#include "tracker_location.h"
+#include "tracker_diagnostics.h"
+
+TrackerJ1939 *TrackerJ1939::_instance = nullptr;
+
+// Transport protocol connection management control bytes
+constexpr uint8_t J1939TpCmRts = 16;
+constexpr uint8_t J1939TpCmBam = 32;
+constexpr uint8_t J1939TpCmAbort = 255;
+
+// Bytes of payload in each transport protocol data packet
+constexpr size_t J1939TpDtPayload = 7;
+
+// Bytes taken by the signal array around its objects in the location publish
+constexpr size_t J1939ArrayHeaderSize = sizeof(",\"j1939\":[]") - 1;
+
+TrackerJ1939::TrackerJ1939() :
+    _tpDropped(0),
+    _configGeneration(0) {
+
+    _config = {};
+    for (auto& signal : _config.signals) {
+        signal.src = -1;
+        signal.len = 8;
+        signal.scale = 1.0;
+        signal.event = (int32_t)TrackerJ1939EventMode::DISABLE;
+    }
+
+    buildIndex();
+    for (auto& aggregate : _aggregates) {
+        aggregate = {};
+    }
+    for (auto& session : _sessions) {
+        session.active = false;
+    }
+}
+
+static ConfigObject signalDesc(const char* name, tracker_j1939_signal_config_t& signal) {
+    return ConfigObject(name, {
+        ConfigBool("enable", &signal.enable),
+        ConfigInt("pgn", &signal.pgn, 0, 0x3ffff),
+        ConfigInt("spn", &signal.spn, 0, 0x7ffff),
+        ConfigInt("src", &signal.src, -1, 255),
+        ConfigInt("start", &signal.start, 0, (int32_t)(TrackerJ1939MaxTpSize * 8 - 1)),
+        ConfigInt("len", &signal.len, 1, 32),
+        ConfigFloat("scale", &signal.scale),
+        ConfigFloat("offset", &signal.offset),
+        ConfigStringEnum(
+            "evt",
+            {
+                {"disable", (int32_t) TrackerJ1939EventMode::DISABLE},
+                {"log", (int32_t) TrackerJ1939EventMode::LOG},
+                {"normal", (int32_t) TrackerJ1939EventMode::NORMAL},
+                {"immediate", (int32_t) TrackerJ1939EventMode::IMMEDIATE},
+            },
+            &signal.event
+        ),
+        ConfigFloat("deadband", &signal.deadband, 0.0, 1000000.0),
+        ConfigInt("debounce", &signal.debounce_ms, 0, 3600000),
+        ConfigInt("rate", &signal.rate_seconds, 0, 86400),
+    });
+}
+
+// Configuration service node setup
+// { "j1939" :
+//     { "enable": false,
+//       "sig1": { "enable": true, "pgn": 65262, "spn": 110, "src": -1, "start": 0, "len": 8, "scale": 1.0, "offset": -40.0,
+//                 "evt": "disable", "deadband": 0.0, "debounce": 0, "rate": 0 },
+//       ...
+//       "sig8": { ... }
+//      }
+//  }
+
+int TrackerJ1939::init() {
+    static_assert(TrackerJ1939MaxSignals == 8, "signal configuration objects");
+    static ConfigObject j1939Desc
+    (
+        "j1939",
+        {
+            ConfigBool("enable", &_config.enable),
+            signalDesc("sig1", _config.signals[0]),
+            signalDesc("sig2", _config.signals[1]),
+            signalDesc("sig3", _config.signals[2]),
+            signalDesc("sig4", _config.signals[3]),
+            signalDesc("sig5", _config.signals[4]),
+            signalDesc("sig6", _config.signals[5]),
+            signalDesc("sig7", _config.signals[6]),
+            signalDesc("sig8", _config.signals[7]),
+        },
+        [](bool write, const void* context){ return 0; },
+        std::bind(&TrackerJ1939::exitConfigCb, this, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3)
+    );
+
+    CHECK(ConfigService::instance().registerModule(j1939Desc));
+
+    buildIndex();
+
+    CHECK(TrackerCan::instance().regFrameCallback([this](const TrackerCanFrame& frame){ onFrame(frame); }));
+    TrackerLocation::instance().regLocGenCallback(&TrackerJ1939::loc_gen_cb, this);
+
+    return SYSTEM_ERROR_NONE;
+}
+
+int TrackerJ1939::regSampleCallback(TrackerJ1939SampleCallback callback) {
+    CHECK_TRUE(callback, SYSTEM_ERROR_INVALID_ARGUMENT);
+    CHECK_TRUE(_sampleCallbacks.append(callback), SYSTEM_ERROR_NO_MEMORY);
+
+    return SYSTEM_ERROR_NONE;
+}
+
+int TrackerJ1939::exitConfigCb(bool write, int status, const void* context) {
+    if (write && !status) {
+        // Previous summaries and partial messages may no longer match the signal table
+        _configGeneration++;
+        buildIndex();
+        for (auto& aggregate : _aggregates) {
+            aggregate = {};
+        }
+        for (auto& session : _sessions) {
+            session.active = false;
+        }
+    }
+    return status;
+}
+
+// Build an open addressed table from PGN to the first signal carried in it.  Signals sharing a PGN
+// are chained so that a frame visits only the signals it carries.
+void TrackerJ1939::buildIndex() {
+    for (auto& entry : _index) {
+        entry.first = -1;
+    }
+
+    for (int i = (int)TrackerJ1939MaxSignals - 1; i >= 0; i--) {
+        _nextSignal[i] = -1;
+        const auto& signal = _config.signals[i];
+        if (!signal.enable) {
+            continue;
+        }
+
+        uint32_t pgn = (uint32_t)signal.pgn;
+        auto slot = hashPgn(pgn);
+        while ((_index[slot].first >= 0) && (_index[slot].pgn != pgn)) {
+            slot = (slot + 1) & (TrackerJ1939IndexSize - 1);
+        }
+        // Walking backwards keeps each chain in signal order
+        _nextSignal[i] = _index[slot].first;
+        _index[slot].pgn = pgn;
+        _index[slot].first = (int8_t)i;
+    }
+}
+
+int TrackerJ1939::findFirstSignal(uint32_t pgn) const {
+    auto slot = hashPgn(pgn);
+    for (size_t probe = 0; probe < TrackerJ1939IndexSize; probe++) {
+        const auto& entry = _index[slot];
+        if (entry.first < 0) {
+            break;
+        }
+        if (entry.pgn == pgn) {
+            return entry.first;
+        }
+        slot = (slot + 1) & (TrackerJ1939IndexSize - 1);
+    }
+    return -1;
+}
+
+void TrackerJ1939::resetAggregate(TrackerJ1939Aggregate& aggregate) {
+    aggregate.count = 0;
+    aggregate.changes = 0;
+    aggregate.sum = 0.0;
+}
+
+// J1939-71 reserves the top of each range for error and not available indications
+bool TrackerJ1939::isValidRaw(uint32_t raw, unsigned int len) {
+    if (len < 2) {
+        return true;
+    }
+    if (len < 8) {
+        uint32_t mask = (1ul << len) - 1;
+        return raw <= (mask - 2);
+    }
+    uint32_t maxValid = (0xfaul << (len - 8)) | ((1ul << (len - 8)) - 1);
+    return raw <= maxValid;
+}
+
+// Extract a little endian bit field
+bool TrackerJ1939::extract(const uint8_t* data, size_t size, unsigned int start, unsigned int len, uint32_t& raw) {
+    if ((len == 0) || (len > 32) || ((start + len) > (size * 8))) {
+        return false;
+    }
+
+    auto firstByte = start / 8;
+    auto lastByte = (start + len - 1) / 8;
+    uint64_t acc = 0;
+    for (auto b = lastByte + 1; b-- > firstByte;) {
+        acc = (acc << 8) | data[b];
+    }
+
+    acc >>= (start % 8);
+    raw = (uint32_t)(acc & ((1ull << len) - 1));
+
+    return true;
+}
+
+void TrackerJ1939::onFrame(const TrackerCanFrame& frame) {
+    if (!_config.enable || !frame.extended || frame.rtr) {
+        return;
+    }
+
+    auto pgn = pgnFromId(frame.id);
+    uint8_t src = frame.id & 0xff;
+    uint8_t dst = (frame.id >> 8) & 0xff;
+
+    if ((pgn == J1939PgnTpCm) || (pgn == J1939PgnTpDt)) {
+        if (frame.len == 8) {
+            onTransport(pgn, src, dst, frame.data, frame.timestamp);
+        }
+        return;
+    }
+
+    decode(pgn, src, frame.data, frame.len, frame.timestamp);
+}
+
+// Reassemble broadcast (BAM) and connection mode (RTS/CTS) transfers.  The tracker only listens
+// so connection mode transfers are followed without taking part in flow control.
+void TrackerJ1939::onTransport(uint32_t pgn, uint8_t src, uint8_t dst, const uint8_t* data, system_tick_t timestamp) {
+    TpSession* session = nullptr;
+    for (auto& s : _sessions) {
+        if (s.active && (s.src == src) && (s.dst == dst)) {
+            session = &s;
+            break;
+        }
+    }
+
+    if (pgn == J1939PgnTpCm) {
+        auto control = data[0];
+        if (control == J1939TpCmAbort) {
+            if (session) {
+                session->active = false;
+            }
+            return;
+        }
+        if ((control != J1939TpCmBam) && (control != J1939TpCmRts)) {
+            return;
+        }
+
+        uint32_t tpPgn = data[5] | ((uint32_t)data[6] << 8) | ((uint32_t)data[7] << 16);
+        if (findFirstSignal(tpPgn) < 0) {
+            return;
+        }
+
+        uint16_t size = data[1] | ((uint16_t)data[2] << 8);
+        if (size > TrackerJ1939MaxTpSize) {
+            _tpDropped++;
+            Log.trace("J1939 TP message too large, pgn=%lu size=%u", tpPgn, size);
+            return;
+        }
+
+        // A packet count that does not cover the size exactly would decode bytes left from an earlier transfer
+        uint8_t packets = data[3];
+        if ((size == 0) || (packets != (size + J1939TpDtPayload - 1) / J1939TpDtPayload)) {
+            _tpDropped++;
+            Log.trace("J1939 TP packet count mismatch, pgn=%lu size=%u packets=%u", tpPgn, size, packets);
+            return;
+        }
+
+        // A new announcement from the same sender replaces any unfinished transfer
+        if (!session) {
+            for (auto& s : _sessions) {
+                if (!s.active || ((timestamp - s.lastMs) > TrackerJ1939TpTimeoutMs)) {
+                    session = &s;
+                    break;
+                }
+            }
+        }
+        if (!session) {
+            _tpDropped++;
+            return;
+        }
+
+        session->active = true;
+        session->src = src;
+        session->dst = dst;
+        session->pgn = tpPgn;
+        session->size = size;
+        session->packets = packets;
+        session->filled = 0;
+        session->nextSeq = 1;
+        session->lastMs = timestamp;
+        return;
+    }
+
+    // Data transfer packet
+    if (!session) {
+        return;
+    }
+
+    auto seq = data[0];
+    if (((timestamp - session->lastMs) > TrackerJ1939TpTimeoutMs) || (seq != session->nextSeq)) {
+        session->active = false;
+        _tpDropped++;
+        return;
+    }
+
+    size_t offset = (seq - 1) * J1939TpDtPayload;
+    if (offset < session->size) {
+        auto length = std::min(J1939TpDtPayload, session->size - offset);
+        memcpy(&session->data[offset], &data[1], length);
+        session->filled += length;
+    }
+    session->nextSeq++;
+    session->lastMs = timestamp;
+
+    if (seq >= session->packets) {
+        session->active = false;
+        if (session->filled == session->size) {
+            decode(session->pgn, session->src, session->data, session->size, timestamp);
+        }
+        else {
+            _tpDropped++;
+        }
+    }
+}
+
+void TrackerJ1939::decode(uint32_t pgn, uint8_t src, const uint8_t* data, size_t size, system_tick_t timestamp) {
+    for (int i = findFirstSignal(pgn); i >= 0; i = _nextSignal[i]) {
+        const auto& signal = _config.signals[i];
+        if ((signal.src >= 0) && (signal.src != src)) {
+            continue;
+        }
+
+        uint32_t raw = 0;
+        if (!extract(data, size, signal.start, signal.len, raw) || !isValidRaw(raw, signal.len)) {
+            continue;
+        }
+
+        double value = (double)raw * signal.scale + signal.offset;
+        auto& aggregate = _aggregates[i];
+        if (aggregate.hasLast && (raw != aggregate.lastRaw)) {
+            aggregate.changes++;
+        }
+        if (aggregate.count == 0) {
+            aggregate.min = value;
+            aggregate.max = value;
+        }
+        else {
+            aggregate.min = std::min(aggregate.min, value);
+            aggregate.max = std::max(aggregate.max, value);
+        }
+        aggregate.count++;
+        aggregate.sum += value;
+        aggregate.last = value;
+        aggregate.lastRaw = raw;
+        aggregate.hasLast = true;
+
+        for (auto& callback : _sampleCallbacks) {
+            callback((size_t)i, raw, value, timestamp);
+        }
+    }
+}
+
+void TrackerJ1939::loc_gen_cb(JSONWriter& writer, LocationPoint& point, const void* context) {
+    if (!_config.enable) {
+        return;
+    }
+
+    // Space is left for the publish fields written after the callbacks
+    size_t used = writer.dataSize() + 1 /* null */ + TrackerDiagnosticsPublishReserve;
+    size_t remaining = (writer.bufferSize() > used) ? (writer.bufferSize() - used) : 0;
+
+    bool any = false;
+    for (size_t i = 0; i < TrackerJ1939MaxSignals; i++) {
+        auto& aggregate = _aggregates[i];
+        if (!_config.signals[i].enable || (aggregate.count == 0)) {
+            continue;
+        }
+
+        // Signals that do not fit keep aggregating until the next publish
+        auto size = aggregateSize(i) + ((any) ? 0 : J1939ArrayHeaderSize);
+        if (size > remaining) {
+            continue;
+        }
+        remaining -= size;
+
+        if (!any) {
+            writer.name("j1939").beginArray();
+            any = true;
+        }
+        writeAggregate(writer, i);
+        resetAggregate(aggregate);
+    }
+    if (any) {
+        writer.endArray();
+    }
+
+    if (_tpDropped) {
+        Log.info("J1939 TP messages dropped: %u", _tpDropped);
+        _tpDropped = 0;
+    }
+}
+
+void TrackerJ1939::writeAggregate(JSONWriter& writer, size_t index) {
+    const auto& aggregate = _aggregates[index];
+    writer.beginObject();
+    writer.name("spn").value((int)_config.signals[index].spn);
+    writer.name("last").value(aggregate.last, 3);
+    writer.name("min").value(aggregate.min, 3);
+    writer.name("max").value(aggregate.max, 3);
+    writer.name("mean").value(aggregate.sum / aggregate.count, 3);
+    writer.name("n").value(aggregate.count);
+    writer.name("chg").value(aggregate.changes);
+    writer.endObject();
+}
+
+size_t TrackerJ1939::aggregateSize(size_t index) {
+    // A writer without a buffer only counts the bytes that would have been written
+    JSONBufferWriter sizer(nullptr, 0);
+    writeAggregate(sizer, index);
+
+    return sizer.dataSize() + 1 /* separator */;
+}
@@ -0,0 +1,214 @@
+/*
+ * Copyright (c) 2022 Particle Industries, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "Particle.h"
+#include "config_service.h"
+#include "location_service.h"
+#include "tracker_can.h"
+
+// Number of configurable J1939 signals
+constexpr size_t TrackerJ1939MaxSignals = 8;
+
+// PGN index slots, must be a power of two and larger than the number of signals
+constexpr size_t TrackerJ1939IndexSize = 16;
+
+// Number of transport protocol messages reassembled at once
+constexpr size_t TrackerJ1939MaxSessions = 4;
+
+// Largest transport protocol message reassembled, in bytes
+constexpr size_t TrackerJ1939MaxTpSize = 256;
+
+// Maximum time, in milliseconds, between transport protocol data packets (J1939-21 T1)
+constexpr system_tick_t TrackerJ1939TpTimeoutMs = 750;
+
+static_assert((TrackerJ1939IndexSize & (TrackerJ1939IndexSize - 1)) == 0, "index size must be a power of two");
+static_assert(TrackerJ1939IndexSize > TrackerJ1939MaxSignals, "index must have free slots");
+
+// Parameter group numbers used by the transport protocol
+constexpr uint32_t J1939PgnTpCm = 0xec00;
+constexpr uint32_t J1939PgnTpDt = 0xeb00;
+
+/**
+ * @brief Handling of debounced changes in a signal
+ *
+ */
+enum class TrackerJ1939EventMode {
+    DISABLE,                /**< Changes are not detected */
+    LOG,                    /**< Changes are recorded in the event log */
+    NORMAL,                 /**< Changes are recorded and trigger a location publish */
+    IMMEDIATE,              /**< Changes are recorded and trigger an immediate location publish */
+};
+
+struct tracker_j1939_signal_config_t {
+    bool enable;
+    int32_t pgn;            // parameter group number carrying the signal
+    int32_t spn;            // suspect parameter number, used to identify the signal in publishes
+    int32_t src;            // source address to accept, -1 for any
+    int32_t start;          // position of the least significant bit in the message
+    int32_t len;            // length in bits, 1 to 32
+    double scale;           // engineering units per bit
+    double offset;          // engineering units added after scaling
+    int32_t event;          // TrackerJ1939EventMode
+    double deadband;        // change in engineering units needed to report an event
+    int32_t debounce_ms;    // time a change must persist before it is reported
+    int32_t rate_seconds;   // minimum time between reported events
+};
+
+struct tracker_j1939_config_t {
+    bool enable;
+    tracker_j1939_signal_config_t signals[TrackerJ1939MaxSignals];
+};
+
+/**
+ * @brief Summary of a J1939 signal between location publishes
+ *
+ */
+struct TrackerJ1939Aggregate {
+    bool hasLast;               /**< A sample has been received since configuration */
+    unsigned int count;         /**< Valid samples */
+    unsigned int changes;       /**< Samples that differed from the one before */
+    uint32_t lastRaw;           /**< Most recent raw value */
+    double last;                /**< Most recent value in engineering units */
+    double min;                 /**< Smallest value */
+    double max;                 /**< Largest value */
+    double sum;                 /**< Sum of values for the mean */
+};
+
+/**
+ * @brief Type definition of the callback for decoded signal samples.
+ *
+ */
+using TrackerJ1939SampleCallback = std::function<void(size_t index, uint32_t raw, double value, system_tick_t timestamp)>;
+
+/**
+ * @brief TrackerJ1939 class to decode J1939 signals from captured CAN frames and summarize them in location publishes.
+ *
+ */
+class TrackerJ1939 {
+public:
+    /**
+     * @brief Singleton class instance access for TrackerJ1939.
+     *
+     * @return TrackerJ1939&
+     */
+    static TrackerJ1939& instance() {
+        if (!_instance) {
+            _instance = new TrackerJ1939();
+        }
+        return *_instance;
+    }
+
+    /**
+     * @brief Initialize TrackerJ1939.
+     *
+     * @retval SYSTEM_ERROR_NONE
+     */
+    int init();
+
+    /**
+     * @brief Register a callback for every valid decoded sample.
+     *
+     * @param callback Function to call with the signal index, raw and scaled values
+     * @retval SYSTEM_ERROR_NONE
+     * @retval SYSTEM_ERROR_NO_MEMORY
+     */
+    int regSampleCallback(TrackerJ1939SampleCallback callback);
+
+    /**
+     * @brief Get the configuration of a signal.
+     *
+     * @param index Signal index
+     * @return const tracker_j1939_signal_config_t&
+     */
+    const tracker_j1939_signal_config_t& getSignal(size_t index) const {
+        return _config.signals[index];
+    }
+
+    /**
+     * @brief Get a counter that changes whenever the signal configuration is written.
+     *
+     * @return unsigned int Configuration generation
+     */
+    unsigned int getConfigGeneration() const {
+        return _configGeneration;
+    }
+
+    /**
+     * @brief Calculate the parameter group number from a 29-bit identifier.
+     *
+     * @param id CAN identifier
+     * @return uint32_t Parameter group number
+     */
+    static uint32_t pgnFromId(uint32_t id) {
+        uint32_t pgn = (id >> 8) & 0x3ffff;
+        // PDU1 formats carry a destination address in place of the group extension
+        if (((pgn >> 8) & 0xff) < 0xf0) {
+            pgn &= 0x3ff00;
+        }
+        return pgn;
+    }
+
+private:
+    TrackerJ1939();
+
+    struct IndexEntry {
+        uint32_t pgn;
+        int8_t first;               // first signal for the PGN, -1 when the slot is free
+    };
+
+    struct TpSession {
+        bool active;
+        uint8_t src;
+        uint8_t dst;
+        uint32_t pgn;
+        uint16_t size;
+        uint8_t packets;
+        uint16_t filled;            // bytes of data received for this transfer
+        uint8_t nextSeq;
+        system_tick_t lastMs;
+        uint8_t data[TrackerJ1939MaxTpSize];
+    };
+
+    static TrackerJ1939* _instance;
+
+    tracker_j1939_config_t _config;
+    IndexEntry _index[TrackerJ1939IndexSize];
+    int8_t _nextSignal[TrackerJ1939MaxSignals];     // next signal sharing the same PGN, -1 at the end
+    TrackerJ1939Aggregate _aggregates[TrackerJ1939MaxSignals];
+    TpSession _sessions[TrackerJ1939MaxSessions];
+    Vector<TrackerJ1939SampleCallback> _sampleCallbacks;
+    unsigned int _tpDropped;
+    unsigned int _configGeneration;
+
+    static size_t hashPgn(uint32_t pgn) {
+        return (pgn ^ (pgn >> 7)) & (TrackerJ1939IndexSize - 1);
+    }
+    static bool isValidRaw(uint32_t raw, unsigned int len);
+    static bool extract(const uint8_t* data, size_t size, unsigned int start, unsigned int len, uint32_t& raw);
+
+    int findFirstSignal(uint32_t pgn) const;
+    void buildIndex();
+    static void resetAggregate(TrackerJ1939Aggregate& aggregate);
+    void writeAggregate(JSONWriter& writer, size_t index);
+    size_t aggregateSize(size_t index);
+    int exitConfigCb(bool write, int status, const void* context);
+    void onFrame(const TrackerCanFrame& frame);
+    void onTransport(uint32_t pgn, uint8_t src, uint8_t dst, const uint8_t* data, system_tick_t timestamp);
+    void decode(uint32_t pgn, uint8_t src, const uint8_t* data, size_t size, system_tick_t timestamp);
+    void loc_gen_cb(JSONWriter& writer, LocationPoint& point, const void* context);
+};
@@ -20,6 +20,10 @@
 #include "Particle.h"
 #include "tracker_config.h"
 #include "tracker_location.h"
+#include "tracker_binlog.h"
+#include "tracker_trace.h"
+#include "tracker_perf.h"
+#include "tracker_config_txn.h"
 #include "tracker_cellular.h"
 
 #include "config_service.h"
@@ -36,6 +40,10 @@ static constexpr uint32_t WifiPowerOnSec = 3; // seconds - time to wait for WiFi
 static constexpr uint32_t WifiPowerScanSec = 1; // seconds - time to wait for WiFi scan
 
 static constexpr size_t EnhancedLocationQueueSize = 5; // up to this many elements
+static constexpr float EnhancedLocationUere = 5.0; // meters - user equivalent range error to estimate HDOP from accuracy
+static constexpr uint32_t RestoredFixMaxAgeSec = 600; // seconds - oldest restored fix used as a geofence starting point
+static constexpr uint32_t SnapshotFixIntervalSec = 60; // seconds - most frequent snapshot rewrite for a stationary fix
+static constexpr float SnapshotFixMoveMeters = 50.0; // meters - movement that rewrites the snapshot before the interval
 static constexpr size_t ObjectEstimateWpsHeaderSize = sizeof(",{\"wps\":[]}") - 1 /* null */;
 static constexpr size_t ObjectEstimateWpsDataSize = sizeof("{\"bssid\":\"00:11:22:33:44:55\",\"ch\":99,\"str\":-999},") - 1 /* null */;
 static constexpr size_t ObjectEstimateEndCommandSize = sizeof(",\"req_id\":4294967295}") - 1; /* null */;
@@ -79,7 +87,26 @@ int TrackerLocation::exit_location_config_cb(bool write, int status, const void
         {
             return -EINVAL;
         }
+
+        using Change = TrackerLocationConfigChange;
+        using Field = TrackerLocationConfigField;
+        const auto& from = _config_state;
+        const auto& to = _config_state_shadow;
+        _configChanges.notify(
+            Change::diff(Field::INTERVAL_MIN, from.interval_min_seconds, to.interval_min_seconds) |
+            Change::diff(Field::INTERVAL_MAX, from.interval_max_seconds, to.interval_max_seconds) |
+            Change::diff(Field::MIN_PUBLISH, from.min_publish, to.min_publish) |
+            Change::diff(Field::LOCK_TRIGGER, from.lock_trigger, to.lock_trigger) |
+            Change::diff(Field::PROCESS_ACK, from.process_ack, to.process_ack) |
+            Change::diff(Field::TOWER, from.tower, to.tower) |
+            Change::diff(Field::GNSS, from.gnss, to.gnss) |
+            Change::diff(Field::WPS, from.wps, to.wps) |
+            Change::diff(Field::ENHANCE_LOC, from.enhance_loc, to.enhance_loc) |
+            Change::diff(Field::LOC_CB, from.loc_cb, to.loc_cb) |
+            Change::diff(Field::DIAG, from.diag, to.diag));
+
         memcpy(&_config_state, &_config_state_shadow, sizeof(_config_state));
+        TrackerConfigTransaction::instance().touch();
     }
     return status;
 }
@@ -143,6 +170,19 @@ void TrackerLocation::init(unsigned int gnssRetries)
 
     ConfigService::instance().registerModule(location_desc);
 
+    // Stored configuration applies right away, later writes once their transaction commits
+    TrackerConfigTransaction::instance().join("location", &_config_state, sizeof(_config_state));
+    _config_state_loop_safe = _config_state;
+    TrackerConfigTransaction::instance().regValidator([this](){
+        // An execution cycle longer than the max interval would keep a sleeping device awake for good
+        const auto& sleep = _sleep.getStagedConfig();
+        if ((sleep.mode == TrackerSleepMode::Enable) && (_config_state.interval_max_seconds != 0) &&
+            (_config_state.interval_max_seconds < sleep.execute_min_seconds)) {
+            return (int)SYSTEM_ERROR_INVALID_ARGUMENT;
+        }
+        return (int)SYSTEM_ERROR_NONE;
+    });
+
     static ConfigObject geofence_desc("geofence", {
         ConfigInt("interval", &_geofenceConfig.interval, 0, 86400l),
         ConfigObject("zone1", {
@@ -210,7 +250,7 @@ void TrackerLocation::init(unsigned int gnssRetries)
 
     CloudService::instance().registerCommand("get_loc", std::bind(&TrackerLocation::get_loc_cb, this, std::placeholders::_1));
 
-    _last_location_publish_sec = System.uptime() - _config_state.interval_min_seconds;
+    _last_location_publish_sec = System.uptime() - getIntervalMin();
 
     _sleep.registerSleepPrepare([this](TrackerSleepContext context){ this->onSleepPrepare(context); });
     _sleep.registerSleep([this](TrackerSleepContext context){ this->onSleep(context); });
@@ -221,88 +261,236 @@ void TrackerLocation::init(unsigned int gnssRetries)
     _geofence.RegisterGeofenceCallback([this](CallbackContext& context){ this->onGeofenceCallback(context); });
     _geofence.init();
 
+    os_queue_create(&_enhancedLocQueue, sizeof(TrackerEnhancedLocation), EnhancedLocationQueueSize, nullptr);
     CloudService::instance().registerCommand("loc-enhanced", std::bind(&TrackerLocation::enhanced_cb, this, std::placeholders::_1));
 
     _gnssRetryDefault = gnssRetries;
     setGnssCycle();
+
+    restoreSnapshot();
+}
+
+// Carry the pending triggers and publish schedule over from before an unexpected reset.  When the cloud
+// already had a location from before the reset the schedule continues instead of starting over with a first
+// publish and the GNSS lock that it waits for.  Uptimes are rebuilt from Unix times so they may lie before
+// this boot; only their differences are used.
+void TrackerLocation::restoreSnapshot() {
+    auto state = TrackerSnapshot::instance().restored();
+    if (!state) {
+        return;
+    }
+    _snapshotState = *state;
+
+    for (size_t i = 0; i < state->triggerCount; i++) {
+        triggerLocPub(Trigger::NORMAL, state->triggers[i]);
+    }
+    if (state->flags & TRACKER_SNAPSHOT_IMMEDIATE) {
+        _pending_immediate = true;
+    }
+    if (state->flags & TRACKER_SNAPSHOT_GEOFENCE) {
+        _pendingGeofence = true;
+    }
+
+    if (!Time.isValid()) {
+        return;
+    }
+    auto now = System.uptime();
+    auto unixNow = (uint32_t)Time.now();
+    bool scheduled = state->lastPublishTime && (state->lastPublishTime <= unixNow) &&
+        state->monotonicPublishTime && (state->monotonicPublishTime <= unixNow);
+    if (scheduled) {
+        _last_location_publish_sec = now - (unixNow - state->lastPublishTime);
+        _monotonic_publish_sec = now - (unixNow - state->monotonicPublishTime);
+        _newMonotonic = false;
+        if (state->flags & TRACKER_SNAPSHOT_PUBLISHED) {
+            _first_publish = false;
+        }
+    }
+
+    // Give geofences a starting point while GNSS acquires
+    if (state->fixTime && ((unixNow - state->fixTime) < RestoredFixMaxAgeSec) && _geofence.AnyGeofenceEnabled()) {
+        PointData geofence_point;
+        geofence_point.lat = state->latitude;
+        geofence_point.lon = state->longitude;
+        geofence_point.hdop = state->horizontalAccuracy / EnhancedLocationUere;
+
+        _geofence.UpdateGeofencePoint(geofence_point);
+        _geofence.loop();
+    }
+
+    Log.info("restored %u triggers, schedule %s", state->triggerCount, (scheduled) ? "kept" : "reset");
+}
+
+// Loop updates only rewrite the snapshot once the fix has moved or aged; publishes always record their fix
+void TrackerLocation::snapshotFix(const LocationPoint& point, bool force) {
+    if (!point.locked) {
+        return;
+    }
+    auto now = System.uptime();
+    if (!force && _snapshotFixValid && (now - _snapshotFixSec < SnapshotFixIntervalSec)) {
+        PointThreshold last = {.radius = 0.0, .latitude = _snapshotState.latitude, .longitude = _snapshotState.longitude};
+        float distance = 0.0;
+        if ((SYSTEM_ERROR_NONE != LocationService::instance().getDistance(distance, last, point)) ||
+            (distance < SnapshotFixMoveMeters)) {
+            return;
+        }
+    }
+    _snapshotFixValid = true;
+    _snapshotFixSec = now;
+    _snapshotState.latitude = point.latitude;
+    _snapshotState.longitude = point.longitude;
+    _snapshotState.altitude = point.altitude;
+    _snapshotState.horizontalAccuracy = point.horizontalAccuracy;
+    _snapshotState.fixTime = (Time.isValid()) ? (uint32_t)Time.now() : 0;
+    _snapshotPending = true;
+}
+
+// Uptimes are converted to Unix times, which are left at 0 while the time is not valid
+void TrackerLocation::saveSnapshot() {
+    std::lock_guard<RecursiveMutex> lg(mutex);
+    _snapshotPending = false;
+
+    auto& state = _snapshotState;
+    state.lastPublishTime = 0;
+    state.monotonicPublishTime = 0;
+    if (Time.isValid()) {
+        auto now = System.uptime();
+        auto unixNow = (uint32_t)Time.now();
+        state.lastPublishTime = unixNow - (now - _last_location_publish_sec);
+        state.monotonicPublishTime = (_newMonotonic) ? 0 : unixNow - (now - _monotonic_publish_sec);
+    }
+    state.flags = ((_pending_immediate) ? TRACKER_SNAPSHOT_IMMEDIATE : 0) |
+        ((_pendingGeofence) ? TRACKER_SNAPSHOT_GEOFENCE : 0) |
+        ((!_first_publish) ? TRACKER_SNAPSHOT_PUBLISHED : 0);
+
+    memset(state.triggers, 0, sizeof(state.triggers));
+    state.triggerCount = 0;
+    for (auto trigger : _pending_triggers) {
+        if (state.triggerCount >= TrackerSnapshotMaxTriggers) {
+            break;
+        }
+        snprintf(state.triggers[state.triggerCount++], TrackerSnapshotTriggerSize, "%s", trigger);
+    }
+
+    TrackerSnapshot::instance().update(state);
 }
 
-int TrackerLocation::buildEnhLocation(JSONValue& node, LocationPoint& point) {
+// Walk the enhanced location object in place and copy the fields of interest into a fixed
+// structure.  No strings or location points are created here so that the response can be handled
+// without touching the heap.
+int TrackerLocation::parseEnhLocation(const JSONValue& node, TrackerEnhancedLocation& loc) {
+    bool hasLat = false;
+    bool hasLon = false;
     JSONObjectIterator locChild(node);
 
     while(locChild.next()) {
-        if (locChild.name() == "lat") {
-            if (!locChild.value().isNumber()) {
+        auto name = locChild.name();
+        auto value = locChild.value();
+        if (name == "lat") {
+            if (!value.isNumber()) {
                 return -EINVAL;
             }
-            point.latitude = locChild.value().toDouble();
+            loc.latitude = value.toDouble();
+            hasLat = true;
         }
-        else if (locChild.name() == "lon") {
-            if (!locChild.value().isNumber()) {
+        else if (name == "lon") {
+            if (!value.isNumber()) {
                 return -EINVAL;
             }
-            point.longitude = locChild.value().toDouble();
+            loc.longitude = value.toDouble();
+            hasLon = true;
         }
-        else if (locChild.name() == "h_acc") {
-            if (!locChild.value().isNumber()) {
+        else if (name == "h_acc") {
+            if (!value.isNumber()) {
                 return -EINVAL;
             }
-            point.horizontalAccuracy = (float)locChild.value().toDouble();
+            loc.horizontalAccuracy = (float)value.toDouble();
         }
-        else if (locChild.name() == "src") {
-            if (!locChild.value().isArray()) {
+        else if (name == "src") {
+            if (!value.isArray()) {
                 return -EINVAL;
             }
-            JSONArrayIterator srcList(locChild.value());
+            JSONArrayIterator srcList(value);
             while (srcList.next()) {
-                if (srcList.value().isString()) {
-                    auto source = LocationSource::NONE;
-                    if (srcList.value().toString() == "cell") {
-                        source = LocationSource::CELL;
-                    }
-                    else if (srcList.value().toString() == "wifi") {
-                        source = LocationSource::WIFI;
-                    }
-                    else if (srcList.value().toString() == "gnss") {
-                        source = LocationSource::GNSS;
-                    }
-                    else {
-                        continue;
-                    }
-                    point.sources.append(source);
-                }
-                else {
+                if (!srcList.value().isString()) {
                     return -EINVAL;
                 }
+                auto src = srcList.value().toString();
+                if (src == "cell") {
+                    loc.sources |= (1 << (int)LocationSource::CELL);
+                }
+                else if (src == "wifi") {
+                    loc.sources |= (1 << (int)LocationSource::WIFI);
+                }
+                else if (src == "gnss") {
+                    loc.sources |= (1 << (int)LocationSource::GNSS);
+                }
             }
         }
     }
 
-    return 0;
+    return (hasLat && hasLon) ? 0 : -ENODATA;
 }
 
 int TrackerLocation::enhanced_cb(JSONValue *root) {
-    LocationPoint point = {};
-    JSONValue* locObject = nullptr;
-    JSONValue child;
-
     JSONObjectIterator item(*root);
     while(item.next()) {
         if ((item.name() == "loc-enhanced") && item.value().isObject()) {
-            child = item.value();
-            locObject = &child;
+            TrackerEnhancedLocation loc = {};
+            if (parseEnhLocation(item.value(), loc)) {
+                return 0;
+            }
+            loc.requestSec = _last_location_publish_sec;
+            loc.receivedSec = System.uptime();
+
+            // Keep the newest responses when the queue is full
+            if (os_queue_put(_enhancedLocQueue, &loc, 0, nullptr)) {
+                TrackerEnhancedLocation dropped;
+                (void)os_queue_take(_enhancedLocQueue, &dropped, 0, nullptr);
+                (void)os_queue_put(_enhancedLocQueue, &loc, 0, nullptr);
+            }
+            break;
         }
     }
 
-    if (locObject) {
-        point.type = LocationType::CLOUD;
-        buildEnhLocation(*locObject, point);
-        for (auto item : enhancedLocCallbacks) {
-            item(point);
+    return 0;
+}
+
+// Consume queued enhanced locations from the loop.  Geofences are evaluated against the cloud
+// location whenever GNSS cannot provide a stable lock of its own.
+void TrackerLocation::processEnhancedLocations() {
+    TrackerEnhancedLocation loc;
+    while (!os_queue_take(_enhancedLocQueue, &loc, 0, nullptr)) {
+        Log.trace("enhanced location for publish at %lu received at %lu", loc.requestSec, loc.receivedSec);
+
+        if (_geofence.AnyGeofenceEnabled() && !LocationService::instance().isLockStable()) {
+            PointData geofence_point;
+            geofence_point.lat = loc.latitude;
+            geofence_point.lon = loc.longitude;
+            geofence_point.hdop = loc.horizontalAccuracy / EnhancedLocationUere;
+
+            _geofence.UpdateGeofencePoint(geofence_point);
+            _geofence.loop();
         }
-    }
 
-    return 0;
+        if (enhancedLocCallbacks.isEmpty()) {
+            continue;
+        }
+
+        _enhancedPoint.type = LocationType::CLOUD;
+        _enhancedPoint.latitude = loc.latitude;
+        _enhancedPoint.longitude = loc.longitude;
+        _enhancedPoint.horizontalAccuracy = loc.horizontalAccuracy;
+        _enhancedPoint.sources.clear();
+        for (auto source : {LocationSource::GNSS, LocationSource::WIFI, LocationSource::CELL}) {
+            if (loc.sources & (1 << (int)source)) {
+                _enhancedPoint.sources.append(source);
+            }
+        }
+        for (auto& cb : enhancedLocCallbacks) {
+            cb(_enhancedPoint);
+        }
+    }
 }
 
 int TrackerLocation::regLocGenCallback(
@@ -354,11 +542,13 @@ int TrackerLocation::triggerLocPub(Trigger type, const char *s)
     if(!matched)
     {
         _pending_triggers.append(s);
+        _snapshotPending = true;
     }
 
     if(type == Trigger::IMMEDIATE)
     {
         _pending_immediate = true;
+        _snapshotPending = true;
     }
 
     return 0;
@@ -375,6 +565,7 @@ void TrackerLocation::issue_location_publish_callbacks(CloudServiceStatus status
 
 int TrackerLocation::location_publish_cb(CloudServiceStatus status, String&& req_event, std::uint32_t last_publish_time)
 {
+    TrackerTrace::instance().record(TrackerTraceEvent::PUBLISH_RESULT, (uint8_t)status, (uint16_t)last_publish_time);
     if(status == CloudServiceStatus::SUCCESS)
     {
         // this could either be on the Particle Cloud ack (default) OR the
@@ -382,14 +573,21 @@ int TrackerLocation::location_publish_cb(CloudServiceStatus status, String&& req
         Log.info("location cb publish %lu success!", last_publish_time);
         _first_publish = false;
         _pending_first_publish = false;
+        _snapshotPending = true;
+        _stats.publishSuccess++;
     }
     else if(status == CloudServiceStatus::FAILURE)
     {
         Log.info("location cb publish %lu failure", last_publish_time);
+        // The cloud may be missing a histogram delta
+        _satHistKeyframe = true;
+        _stats.publishFailure++;
     }
     else if(status == CloudServiceStatus::TIMEOUT)
     {
         Log.info("location cb publish %lu timeout", last_publish_time);
+        _satHistKeyframe = true;
+        _stats.publishTimeout++;
     }
     else
     {
@@ -403,6 +601,24 @@ int TrackerLocation::location_publish_cb(CloudServiceStatus status, String&& req
     return 0;
 }
 
+void TrackerLocation::powerFail(system_tick_t startMs) {
+    std::lock_guard<RecursiveMutex> lg(mutex);
+    _powerFailMs = startMs;
+    _pendingPowerFail = true;
+    triggerLocPub(Trigger::IMMEDIATE, "pwr");
+}
+
+void TrackerLocation::finishPowerFail(const char* outcome) {
+    _pendingPowerFail = false;
+    _powerFailLatencyMs = millis() - _powerFailMs;
+    if (_powerFailLatencyMs > TrackerLocationPowerFailBudgetMs) {
+        Log.warn("Power loss %s after %lu ms, over %lu ms budget", outcome, _powerFailLatencyMs, TrackerLocationPowerFailBudgetMs);
+    }
+    else {
+        Log.info("Power loss %s after %lu ms", outcome, _powerFailLatencyMs);
+    }
+}
+
 void TrackerLocation::location_publish()
 {
     // maintain cloud service lock across the send to allow us to save off
@@ -410,9 +626,11 @@ void TrackerLocation::location_publish()
     std::lock_guard<CloudService> lg(CloudService::instance());
 
     CloudServicePublishFlags cloud_flags =
-        (_config_state.process_ack) ? CloudServicePublishFlags::FULL_ACK : CloudServicePublishFlags::NONE;
+        (_config_state_loop_safe.process_ack) ? CloudServicePublishFlags::FULL_ACK : CloudServicePublishFlags::NONE;
 
     // publish a new loc (contained in cloud_service buffer)
+    TrackerTrace::instance().record(TrackerTraceEvent::PUBLISH_SEND, 0,
+        (uint16_t)CloudService::instance().writer().dataSize());
     CloudService::instance().send(WITH_ACK,
         cloud_flags,
         std::bind(&TrackerLocation::location_publish_cb, this, std::placeholders::_1, std::placeholders::_2, _last_location_publish_sec));
@@ -428,13 +646,30 @@ int TrackerLocation::enableGnss() {
         decGnssCycle();
     }
     _gnssStartedSec = System.uptime();
+    if ((SYSTEM_ERROR_NONE == ret) && !_gnssOn) {
+        _gnssOn = true;
+        _ttffPending = true;
+        _gnssOnSinceMs = millis();
+    }
     return ret;
 }
 
 int TrackerLocation::disableGnss() {
+    if (_gnssOn) {
+        _gnssOn = false;
+        _ttffPending = false;
+        _stats.gnssOnMs += millis() - _gnssOnSinceMs;
+    }
     return LocationService::instance().stop();
 }
 
+void TrackerLocation::getStats(TrackerLocationStats& stats) {
+    stats = _stats;
+    if (_gnssOn) {
+        stats.gnssOnMs += millis() - _gnssOnSinceMs;
+    }
+}
+
 bool TrackerLocation::isSleepEnabled() {
     return !_sleep.isSleepDisabled();
 }
@@ -460,13 +695,15 @@ EvaluationResults TrackerLocation::evaluatePublish(bool error) {
     uint32_t maxInterval = now - _monotonic_publish_sec;
 
     bool networkNeeded = false;
-    uint32_t max = (uint32_t)_config_state.interval_max_seconds;
+    auto intervalMax = getIntervalMax();
+    auto intervalMin = getIntervalMin();
+    uint32_t max = (uint32_t)intervalMax;
     auto maxNetwork = max;
     if  (maxNetwork > (uint32_t)_nextEarlyWake) {
         maxNetwork -= (uint32_t)_nextEarlyWake;
     }
 
-    if (_config_state.interval_max_seconds) {
+    if (intervalMax) {
         if (maxInterval >= maxNetwork) {
             // max interval adjusted for early wake
             Log.trace("%s maxNetwork", __FUNCTION__);
@@ -481,21 +718,21 @@ EvaluationResults TrackerLocation::evaluatePublish(bool error) {
         }
     }
 
-    uint32_t min = (uint32_t)_config_state.interval_min_seconds;
+    uint32_t min = (uint32_t)intervalMin;
     auto minNetwork = min;
     if  (minNetwork > (uint32_t)_nextEarlyWake) {
         minNetwork -= (uint32_t)_nextEarlyWake;
     }
 
     if (_pending_triggers.size()) {
-        if (!_config_state.interval_min_seconds ||
+        if (!intervalMin ||
             (interval >= minNetwork)) {
             // min interval adjusted for early wake
             Log.trace("%s minNetwork", __FUNCTION__);
             networkNeeded = true;
         }
 
-        if (!_config_state.interval_min_seconds ||
+        if (!intervalMin ||
             (interval >= min)) {
             // no min interval or past the min interval so can publish
             Log.trace("%s min", __FUNCTION__);
@@ -510,9 +747,14 @@ EvaluationResults TrackerLocation::evaluatePublish(bool error) {
 // The purpose of thhe sleep prepare callback is to allow each task to calculate
 // the next time it needs to wake and process inputs, publish, and what not.
 void TrackerLocation::onSleepPrepare(TrackerSleepContext context) {
+    // A publish staged while connecting goes to the store and forward queue rather than being lost in sleep
+    if (_staging.valid && LocationPublish::instance().isStoreEnabled()) {
+        publishLocation(_staging.point);
+    }
+
     // The first thing to figure out is the needed interval, min or max
     int32_t interval = (_pending_triggers.size()) ?
-        _config_state.interval_min_seconds : _config_state.interval_max_seconds;
+        getIntervalMin() : getIntervalMax();
 
     auto published = (0 != _publishAttempted.exchange(0));
     auto fullWake = _sleep.isFullWakeCycle();
@@ -566,6 +808,7 @@ void TrackerLocation::onSleepPrepare(TrackerSleepContext context) {
             wake = geoWake;
         }
         _pendingGeofence = true;
+        _snapshotPending = true;
     }
 
     TrackerSleepError wakeRet = _sleep.wakeAtSeconds(wake);
@@ -577,7 +820,7 @@ void TrackerLocation::onSleepPrepare(TrackerSleepContext context) {
         _sleep.extendExecutionFromNow(interval + _sleep.getConfigExecuteTime());
     }
 
-    Log.trace("TrackerLocation: last=%lu, interval=%ld, wake=%u", _last_location_publish_sec, interval, wake);
+    TrackerBinLog::instance().log(TrackerBinLogId::LOC_INTERVAL, _last_location_publish_sec, interval, wake);
 }
 
 // The purpose of this callback is to alert us that sleep has been cancelled by another task or improper wake settings.
@@ -589,6 +832,8 @@ void TrackerLocation::onSleepCancel(TrackerSleepContext context) {
 // of no return to cancel the pending sleep cycle.
 void TrackerLocation::onSleep(TrackerSleepContext context) {
     disableGnss();
+    // Anything still staged could not be stored and will be collected again on the next cycle
+    clearStaging();
 }
 
 // This callback will be called immediately after wake from sleep and allows us to figure out if the network interface
@@ -639,7 +884,7 @@ void TrackerLocation::onSleepState(TrackerSleepContext context) {
 
 void TrackerLocation::onGeofenceCallback(CallbackContext& context) {
     // Associate the zone with static zone strings
-    char* zoneStr = nullptr;
+    const char* zoneStr = nullptr;
     constexpr const char* outsideStr[] = {"outside1", "outside2", "outside3", "outside4"};
     constexpr const char* insideStr[] = {"inside1", "inside2", "inside3", "inside4"};
     constexpr const char* enterStr[] = {"enter1", "enter2", "enter3", "enter4"};
@@ -647,22 +892,22 @@ void TrackerLocation::onGeofenceCallback(CallbackContext& context) {
 
     switch(context.event_type) {
         case GeofenceEventType::OUTSIDE:
-            zoneStr = (char*)outsideStr[context.index];
+            zoneStr = outsideStr[context.index];
             //Log.info("Outside CB Triggered in %s", zoneStr);
             break;
 
         case GeofenceEventType::INSIDE:
-            zoneStr = (char*)insideStr[context.index];
+            zoneStr = insideStr[context.index];
             //Log.info("Inside CB Triggered in %s", zoneStr);
             break;
 
         case GeofenceEventType::ENTER:
-            zoneStr = (char*)enterStr[context.index];
+            zoneStr = enterStr[context.index];
             //Log.info("Enter CB Triggered in %s", zoneStr);
             break;
 
         case GeofenceEventType::EXIT:
-            zoneStr = (char*)exitStr[context.index];
+            zoneStr = exitStr[context.index];
             //Log.info("Exit CB Triggered in %s", zoneStr);
             break;
 
@@ -684,8 +929,11 @@ size_t TrackerLocation::buildTowerInfo(JSONBufferWriter& writer, size_t size) {
         return 0;
     }
 
-    TrackerCellular::instance().startScan();
-    delay(TRACKER_CELLULAR_SCAN_DELAY);
+    // The scan may have already been collected while waiting for the cloud connection
+    if (!_staging.towers) {
+        TrackerCellular::instance().startScan();
+        delay(TRACKER_CELLULAR_SCAN_DELAY);
+    }
     size_t written = writer.dataSize();
 
     // The cellular information here is always sent and not configurable
@@ -705,7 +953,7 @@ size_t TrackerLocation::buildTowerInfo(JSONBufferWriter& writer, size_t size) {
         Vector<CellularNeighbor> towerList;
         TrackerCellular::instance().getNeighborTowers(towerList);
         auto towerCount = TrackerLocationMaxTowerSend - 1;  // one has already been taken as the serving tower
-        for (auto tower: towerList) {
+        for (auto& tower: towerList) {
             if (towerCount-- <= 0) {
                 break;
             }
@@ -727,6 +975,17 @@ void TrackerLocation::wifi_cb(WiFiAccessPoint* wap, TrackerLocation* context) {
         context->wpsList.append(*wap);
 }
 
+void TrackerLocation::scanWps() {
+    wpsList.clear();
+
+    // Power on and immediately scan for access points then power off
+    WiFi.on();
+    delay(WifiPowerOnSec * 1000);
+    (void)WiFi.scan(wifi_cb, this);
+    delay(WifiPowerScanSec * 1000);
+    WiFi.off();
+}
+
 size_t TrackerLocation::buildWpsInfo(JSONBufferWriter& writer, size_t size) {
     if (!_config_state_loop_safe.wps) {
         return 0;
@@ -749,24 +1008,21 @@ size_t TrackerLocation::buildWpsInfo(JSONBufferWriter& writer, size_t size) {
             break;
         }
 
-        wpsList.clear();
-
-        // Power on and immediately scan for access points then power off
-        WiFi.on();
-        delay(WifiPowerOnSec * 1000);
-        (void)WiFi.scan(wifi_cb, this);
-        delay(WifiPowerScanSec * 1000);
-        WiFi.off();
+        // The scan may have already been collected while waiting for the cloud connection
+        if (!_staging.wps) {
+            scanWps();
+        }
 
         // NOTE: Any sorting of WiFi access points should be performed here
         if (!wpsList.isEmpty()) {
             writer.name("wps").beginArray();
             int wifiCount = wpsCount;
-            for (auto ap: wpsList) {
+            for (auto& ap: wpsList) {
                 if (wifiCount-- <= 0) {
                     break;
                 }
-                String bssid = String::format("%02x:%02x:%02x:%02x:%02x:%02x",
+                char bssid[sizeof("00:11:22:33:44:55")];
+                snprintf(bssid, sizeof(bssid), "%02x:%02x:%02x:%02x:%02x:%02x",
                     ap.bssid[0], ap.bssid[1], ap.bssid[2], ap.bssid[3], ap.bssid[4], ap.bssid[5]);
                 writer.beginObject();
                 writer.name("bssid").value(bssid);
@@ -782,7 +1038,7 @@ size_t TrackerLocation::buildWpsInfo(JSONBufferWriter& writer, size_t size) {
 }
 
 GnssState TrackerLocation::loopLocation(LocationPoint& cur_loc) {
-    if (!_config_state.gnss) {
+    if (!_config_state_loop_safe.gnss) {
         return GnssState::DISABLED;
     }
     GnssState currentGnssState = GnssState::ON_LOCKED_STABLE;
@@ -831,19 +1087,213 @@ GnssState TrackerLocation::loopLocation(LocationPoint& cur_loc) {
             _firstLockSec = System.uptime();
         }
 
+        // Capture the time to the first lock of each GNSS power on
+        if (_ttffPending) {
+            _ttffPending = false;
+            _stats.lastTtffMs = millis() - _gnssOnSinceMs;
+            _stats.fixes++;
+            TrackerPerf::instance().recordTtff(_stats.lastTtffMs);
+        }
+        snapshotFix(cur_loc);
+
         // Only publish with "lock" trigger when not sleeping and when enabled to do so
-        if (_sleep.isSleepDisabled() && _config_state.lock_trigger) {
+        if (_sleep.isSleepDisabled() && _config_state_loop_safe.lock_trigger) {
             triggerLocPub(Trigger::NORMAL,"lock");
         }
     }
 
+    if (currentGnssState != _lastGnssState) {
+        TrackerTrace::instance().record(TrackerTraceEvent::GNSS_STATE, (uint8_t)currentGnssState,
+            (uint16_t)((currentGnssState == GnssState::ERROR) ? 0 : cur_loc.satsInUse));
+    }
     _lastGnssState = currentGnssState;
 
     return currentGnssState;
 }
 
+// Decide whether a candidate location is more useful to publish than the current one.  Locked and
+// stable fixes win over anything else and, between comparable fixes, the more accurate or more
+// recent one is kept.
+bool TrackerLocation::isBetterFix(const LocationPoint& candidate, const LocationPoint& current) {
+    if (candidate.locked != current.locked) {
+        return candidate.locked;
+    }
+
+    if (!candidate.locked) {
+        // Neither is locked so the newest satellite information is preferred
+        return true;
+    }
+
+    if (candidate.stable != current.stable) {
+        return candidate.stable;
+    }
+
+    return (candidate.horizontalAccuracy <= current.horizontalAccuracy);
+}
+
+// Collect the slow parts of a pending publish while the cloud connection is being established so
+// that the publish can be sent as soon as the connection is made.
+void TrackerLocation::stagePublish(const LocationPoint& cur_loc) {
+    if (!_staging.valid) {
+        _staging.valid = true;
+        _staging.stagedMs = millis();
+        _staging.point = cur_loc;
+        Log.trace("%s staging publish while connecting", __FUNCTION__);
+    }
+    else if (isBetterFix(cur_loc, _staging.point)) {
+        _staging.point = cur_loc;
+    }
+
+    if (!_config_state_loop_safe.enhance_loc) {
+        return;
+    }
+
+    // Tower information needs a registered modem which usually happens well before the cloud session
+    if (_config_state_loop_safe.tower && !_staging.towers && Cellular.ready()) {
+        TrackerCellular::instance().startScan();
+        delay(TRACKER_CELLULAR_SCAN_DELAY);
+        _staging.towers = true;
+    }
+
+    if (_config_state_loop_safe.wps && !_staging.wps) {
+        scanWps();
+        _staging.wps = true;
+    }
+}
+
+// Build and send a location publish, preferring a staged point unless the current one is better.  The
+// publish goes to the store and forward queue when the cloud is not connected.
+void TrackerLocation::publishLocation(LocationPoint& cur_loc)
+{
+    Log.info("publishing now...");
+    auto& pub_loc = (_staging.valid && !isBetterFix(cur_loc, _staging.point)) ? _staging.point : cur_loc;
+    if (_staging.valid) {
+        Log.info("publishing payload staged %lu ms ago", millis() - _staging.stagedMs);
+    }
+    buildPublish(pub_loc, (0 == getGnssCycle()));
+    snapshotFix(pub_loc, true);
+    clearStaging();
+    pendingLocPubCallbacks = locPubCallbacks;
+    locPubCallbacks.clear();
+    _last_location_publish_sec = System.uptime();
+    if ((_first_publish && !_pending_first_publish) || _newMonotonic)
+    {
+        _monotonic_publish_sec = _last_location_publish_sec;
+        _newMonotonic = false;
+    }
+    else
+    {
+        _monotonic_publish_sec += (uint32_t)getIntervalMax();
+    }
+
+    // Prevent flooding of first publishes when there are no acknowledges.
+    if (!_config_state_loop_safe.process_ack && _first_publish) {
+        _first_publish = false;
+    }
+
+    location_publish();
+    _snapshotPending = true;
+
+    if (_pendingPowerFail) {
+        finishPowerFail((Particle.connected()) ? "publish sent" : "publish queued to store");
+    }
+
+    // There may be a delay between the first event being published and an acknowledgement
+    // from the cloud.  This leads to multiple event publishes meant to be the first publish.
+    if (_first_publish && !_pending_first_publish) {
+        _pending_first_publish = true;
+    }
+}
+
+SatConstellation TrackerLocation::satConstellation(unsigned int num) {
+    // Extended NMEA satellite numbering as reported in GSV sentences
+    if ((num >= 1) && (num <= 32)) {
+        return SatConstellation::GPS;
+    }
+    if ((num >= 65) && (num <= 96)) {
+        return SatConstellation::GLONASS;
+    }
+    if ((num >= 301) && (num <= 336)) {
+        return SatConstellation::GALILEO;
+    }
+    if (((num >= 159) && (num <= 163)) || ((num >= 401) && (num <= 437))) {
+        return SatConstellation::BEIDOU;
+    }
+    return SatConstellation::OTHER;
+}
+
+void TrackerLocation::buildSatDiag(JSONWriter& writer, const LocationPoint& cur_loc) {
+    constexpr const char* constellationNames[] = {"gps", "glo", "gal", "bds"};
+    static_assert(sizeof(constellationNames) / sizeof(constellationNames[0]) == (size_t)SatConstellation::COUNT,
+        "constellation names");
+
+    writer.name("satu").value(cur_loc.satsInUse);
+    writer.name("satv").value(cur_loc.satsInView);
+
+    // Collect local statistics and the histogram in a single integer pass over the most recent
+    // reported constellations
+    TrackerSatHistogram hist {};
+    unsigned int min {UINT8_MAX};
+    unsigned int max {};
+    unsigned int sum {};
+    unsigned int count = std::min<unsigned int>(cur_loc.satsInView, NUM_SAT_DESC);
+    for (unsigned int i = 0; i < count; i++) {
+        const auto& sat = cur_loc.sats_in_view_desc[i];
+        unsigned int snr = sat.snr;
+        sum += snr;
+        min = std::min(min, snr);
+        max = std::max(max, snr);
+
+        auto constellation = satConstellation(sat.num);
+        if (constellation != SatConstellation::OTHER) {
+            auto bucket = std::min<size_t>(snr >> TrackerSatHistBucketShift, TrackerSatHistBuckets - 1);
+            auto& bin = hist.counts[(size_t)constellation][bucket];
+            if (bin < UINT8_MAX) {
+                bin++;
+            }
+        }
+    }
+
+    // No satellites keeps the previous sentinel of 255 for the minimum
+    writer.name("satmin").value(min);
+    writer.name("satmax").value(max);
+    // Don't divide by zero
+    writer.name("satmean").value((count) ? (sum + count / 2) / count : 0u);
+
+    // Histogram counts are sent as absolute values on keyframes and otherwise as differences from the
+    // previous publish.  Constellations without changes are omitted from delta publishes.
+    bool keyframe = _satHistKeyframe || (_satHistSinceKeyframe >= TrackerSatHistKeyframeInterval);
+    _satHistSeq++;
+    writer.name("sath").beginObject();
+    writer.name("seq").value((unsigned int)_satHistSeq);
+    writer.name("key").value(keyframe);
+    for (size_t c = 0; c < (size_t)SatConstellation::COUNT; c++) {
+        bool changed = keyframe;
+        for (size_t b = 0; !changed && (b < TrackerSatHistBuckets); b++) {
+            changed = hist.counts[c][b] != _satHistSent.counts[c][b];
+        }
+        if (!changed) {
+            continue;
+        }
+        writer.name(constellationNames[c]).beginArray();
+        for (size_t b = 0; b < TrackerSatHistBuckets; b++) {
+            int value = hist.counts[c][b];
+            if (!keyframe) {
+                value -= _satHistSent.counts[c][b];
+            }
+            writer.value(value);
+        }
+        writer.endArray();
+    }
+    writer.endObject();
+
+    _satHistSent = hist;
+    _satHistKeyframe = false;
+    _satHistSinceKeyframe = (keyframe) ? 1 : _satHistSinceKeyframe + 1;
+}
+
 void TrackerLocation::buildPublish(LocationPoint& cur_loc, bool error) {
-    bool locked = (_config_state.gnss) ? cur_loc.locked : false;
+    bool locked = (_config_state_loop_safe.gnss) ? cur_loc.locked : false;
 
     if(locked) {
         LocationService::instance().setWayPoint(cur_loc.latitude, cur_loc.longitude);
@@ -857,7 +1307,7 @@ void TrackerLocation::buildPublish(LocationPoint& cur_loc, bool error) {
         cloud_service.writer().name("time").value((unsigned int) cur_loc.epochTime);
         cloud_service.writer().name("lat").value(cur_loc.latitude, 8);
         cloud_service.writer().name("lon").value(cur_loc.longitude, 8);
-        if(!_config_state.min_publish)
+        if(!_config_state_loop_safe.min_publish)
         {
             cloud_service.writer().name("alt").value(cur_loc.altitude, 3);
             cloud_service.writer().name("hd").value(cur_loc.heading, 2);
@@ -875,32 +1325,10 @@ void TrackerLocation::buildPublish(LocationPoint& cur_loc, bool error) {
     // Collect satellite information for debugging.  This is not dependent on lock state so as to
     // debug situations with poor constellation signal strength
     if (_config_state_loop_safe.diag) {
-        cloud_service.writer().name("satu").value(cur_loc.satsInUse);
-        cloud_service.writer().name("satv").value(cur_loc.satsInView);
-
-        // Collect local statistics for the most recent reported constellations
-        uint8_t min {UINT8_MAX};
-        uint8_t max {};
-        float mean {};
-        unsigned int i {};
-        for (; i < cur_loc.satsInView; i++) {
-            auto value = cur_loc.sats_in_view_desc[i].snr;
-            mean += (float)value;
-            min = std::min<uint8_t>(min, value);
-            max = std::max<uint8_t>(max, value);
-        }
-        // Don't divide by zero
-        if (i) {
-            mean /= i;
-            round(mean);
-        }
-
-        cloud_service.writer().name("satmin").value((unsigned)min);
-        cloud_service.writer().name("satmax").value((unsigned)max);
-        cloud_service.writer().name("satmean").value((unsigned)mean);
+        buildSatDiag(cloud_service.writer(), cur_loc);
     }
 
-    for(auto cb : locGenCallbacks) {
+    for(auto& cb : locGenCallbacks) {
         cb(cloud_service.writer(), cur_loc);
     }
 
@@ -914,7 +1342,7 @@ void TrackerLocation::buildPublish(LocationPoint& cur_loc, bool error) {
         if (error) {
             cloud_service.writer().value("err");
         }
-        for (auto trigger : _pending_triggers) {
+        for (auto& trigger : _pending_triggers) {
             cloud_service.writer().value(trigger);
         }
         _pending_triggers.clear();
@@ -937,8 +1365,14 @@ void TrackerLocation::buildPublish(LocationPoint& cur_loc, bool error) {
 }
 
 void TrackerLocation::loop() {
-    // The rest of this loop should only sample as fast as necessary
-    if (_pendingShutdown || (millis() - _loopSampleTick < LoopSampleRate)) {
+    if (_snapshotPending) {
+        saveSnapshot();
+    }
+
+    // The rest of this loop should only sample as fast as necessary unless a staged publish is
+    // waiting on a cloud connection that just came up
+    bool stagedReady = (_staging.valid && Particle.connected()) || _pendingPowerFail;
+    if (_pendingShutdown || (!stagedReady && (millis() - _loopSampleTick < LoopSampleRate))) {
         return;
     }
 
@@ -948,8 +1382,21 @@ void TrackerLocation::loop() {
     _loopSampleTick = millis();
 
     // Sync power state changes
-    // The rest of this loop will depend on a constant setting for GNSS and WiFi condif state
-    _config_state_loop_safe = _config_state;
+    // The rest of this loop will depend on a constant setting for GNSS and WiFi condif state.  It is only
+    // rebuilt when configuration or the operating profile changed since the last loop.
+    // Changes are held while a configuration transaction is open.
+    if (!TrackerConfigTransaction::instance().isOpen()) {
+        auto change = _configChanges.take();
+        if (change || firstLoop) {
+            _config_state_loop_safe = _config_state;
+            _config_state_loop_safe.gnss = _config_state_loop_safe.gnss && _profile.gnss;
+            _config_state_loop_safe.tower = _config_state_loop_safe.tower && _profile.tower;
+            _config_state_loop_safe.wps = _config_state_loop_safe.wps && _profile.wps;
+            if (change) {
+                Log.trace("%s applied configuration change %lu (0x%08lx)", __FUNCTION__, change.version, change.fields);
+            }
+        }
+    }
 
     if (firstLoop) {
         setGnssCycle();
@@ -958,6 +1405,7 @@ void TrackerLocation::loop() {
     if ((_geofenceConfig.interval && _pendingGeofence) ||
         (_config_state_loop_safe.gnss && _sleep.isFullWakeCycle() && (0 != getGnssCycle()))) {
         _pendingGeofence = false;
+        _snapshotPending = true;
         // This is safe to call repeatedly
         enableGnss();
     } else  if (!_config_state_loop_safe.gnss){
@@ -965,6 +1413,8 @@ void TrackerLocation::loop() {
         disableGnss();
     }
 
+    processEnhancedLocations();
+
     // Gather current location information and status
     LocationPoint cur_loc = {};
     auto locationStatus = loopLocation(cur_loc);
@@ -1008,7 +1458,10 @@ void TrackerLocation::loop() {
     switch (publishReason.reason) {
         case PublishReason::NONE: {
             // If there is nothing to do then get out
-            return;
+            if (!_staging.valid) {
+                return;
+            }
+            break;
         }
 
         case PublishReason::TIME: {
@@ -1018,7 +1471,7 @@ void TrackerLocation::loop() {
                 case GnssState::DISABLED:
                 // fall through
                 case GnssState::ON_LOCKED_STABLE: {
-                    Log.trace("publishing from max interval");
+                    TrackerBinLog::instance().log(TrackerBinLogId::LOC_PUBLISH_MAX);
                     triggerLocPub(Trigger::NORMAL,"time");
                     publishNow = true;
                     break;
@@ -1030,7 +1483,7 @@ void TrackerLocation::loop() {
                 // fall through
                 case GnssState::ON_LOCKED_UNSTABLE: {
                     if (!publishReason.lockWait) {
-                        Log.trace("publishing from max interval after waiting");
+                        TrackerBinLog::instance().log(TrackerBinLogId::LOC_PUBLISH_MAX_WAITED);
                         triggerLocPub(Trigger::NORMAL,"time");
                         publishNow = true;
                         break;
@@ -1049,7 +1502,7 @@ void TrackerLocation::loop() {
                 case GnssState::DISABLED:
                 // fall through
                 case GnssState::ON_LOCKED_STABLE: {
-                    Log.trace("publishing from triggers");
+                    TrackerBinLog::instance().log(TrackerBinLogId::LOC_PUBLISH_TRIGGERS);
                     publishNow = true;
                     _newMonotonic = true;
                     break;
@@ -1061,12 +1514,12 @@ void TrackerLocation::loop() {
                 // fall through
                 case GnssState::ON_LOCKED_UNSTABLE: {
                     if (!publishReason.lockWait) {
-                        Log.trace("publishing from triggers after waiting");
+                        TrackerBinLog::instance().log(TrackerBinLogId::LOC_PUBLISH_TRIGGERS_WAITED);
                         publishNow = true;
                         _newMonotonic = true;
                         break;
                     }
-                    Log.trace("waiting for stable GNSS lock for triggers");
+                    TrackerBinLog::instance().log(TrackerBinLogId::LOC_WAIT_TRIGGERS);
                     break;
                 }
             }
@@ -1074,7 +1527,7 @@ void TrackerLocation::loop() {
         }
 
         case PublishReason::IMMEDIATE: {
-            Log.trace("publishing from immediate");
+            TrackerBinLog::instance().log(TrackerBinLogId::LOC_PUBLISH_IMMEDIATE);
             _pending_immediate = false;
             publishNow = true;
             _newMonotonic = true;
@@ -1082,40 +1535,33 @@ void TrackerLocation::loop() {
         }
     }
 
+    // A staged publish was already committed to on an earlier pass
+    if (_staging.valid) {
+        publishNow = true;
+    }
+
     //
     // Perform publish of location data if requested
     //
 
-    // then of any new publish
-    if(publishNow && (Particle.connected() ||
-            LocationPublish::instance().isStoreEnabled()))
+    // Stage the publish while waiting for the cloud connection rather than sending to the
+    // store and forward queue or dropping it.  After loss of external power the store and forward
+    // queue is used right away since the connection may not outlast the battery.
+    bool connected = Particle.connected();
+    bool storeEnabled = LocationPublish::instance().isStoreEnabled();
+    if (publishNow && !connected &&
+            ((_sleep.isConnecting() && !_pendingPowerFail) || !storeEnabled))
     {
-        Log.info("publishing now...");
-        buildPublish(cur_loc, (0 == getGnssCycle()));
-        pendingLocPubCallbacks = locPubCallbacks;
-        locPubCallbacks.clear();
-        _last_location_publish_sec = System.uptime();
-        if ((_first_publish && !_pending_first_publish) || _newMonotonic)
-        {
-            _monotonic_publish_sec = _last_location_publish_sec;
-            _newMonotonic = false;
+        stagePublish(cur_loc);
+        if (_pendingPowerFail) {
+            finishPowerFail("publish staged in RAM");
         }
-        else
-        {
-            _monotonic_publish_sec += (uint32_t)_config_state.interval_max_seconds;
-        }
-
-        // Prevent flooding of first publishes when there are no acknowledges.
-        if (!_config_state.process_ack && _first_publish) {
-            _first_publish = false;
-        }
-
-        location_publish();
+        return;
+    }
 
-        // There may be a delay between the first event being published and an acknowledgement
-        // from the cloud.  This leads to multiple event publishes meant to be the first publish.
-        if (_first_publish && !_pending_first_publish) {
-            _pending_first_publish = true;
-        }
+    // then of any new publish
+    if(publishNow && (connected || storeEnabled))
+    {
+        publishLocation(cur_loc);
     }
 }
@@ -21,6 +21,8 @@
 #include "location_service.h"
 #include "motion_service.h"
 #include "tracker_sleep.h"
+#include "tracker_config_notify.h"
+#include "tracker_snapshot.h"
 #include "Geofence.h"
 
 #define TRACKER_LOCATION_INTERVAL_MIN_DEFAULT_SEC (900)
@@ -37,11 +39,20 @@
 // regardless
 #define TRACKER_LOCATION_INITIAL_LOCK_MAX (90)
 
+// Longest expected time from loss of external power to the location publish being queued or stored
+constexpr system_tick_t TrackerLocationPowerFailBudgetMs = 250;
+
 constexpr int TrackerLocationMaxWpsCollect = 20;
 constexpr int TrackerLocationMaxWpsSend = 5;
 constexpr int TrackerLocationMaxTowerSend = 3;
 constexpr int NUM_OF_GEOFENCE_ZONES = 4;
 
+// Satellite SNR histogram dimensions; each bucket spans 8 dB-Hz with the last bucket open ended
+constexpr size_t TrackerSatHistBuckets = 8;
+constexpr unsigned int TrackerSatHistBucketShift = 3;
+// Send absolute histogram counts at least once every this many diagnostic publishes
+constexpr unsigned int TrackerSatHistKeyframeInterval = 10;
+
 struct tracker_location_config_t {
     int32_t interval_min_seconds; // 0 = no min
     int32_t interval_max_seconds; // 0 = no max
@@ -56,6 +67,44 @@ struct tracker_location_config_t {
     bool diag;
 };
 
+// Location settings reported in configuration change notifications
+enum class TrackerLocationConfigField {
+    INTERVAL_MIN,
+    INTERVAL_MAX,
+    MIN_PUBLISH,
+    LOCK_TRIGGER,
+    PROCESS_ACK,
+    TOWER,
+    GNSS,
+    WPS,
+    ENHANCE_LOC,
+    LOC_CB,
+    DIAG,
+    PROFILE,                      // operating profile limits were replaced
+};
+
+using TrackerLocationConfigChange = TrackerConfigChange<TrackerLocationConfigField>;
+
+// Operating profile limits applied on top of the location configuration
+struct TrackerLocationProfile {
+    int32_t interval_min_seconds; // 0 = use configured value
+    int32_t interval_max_seconds; // 0 = use configured value
+    int32_t gnss_retries;         // -1 = use the platform default
+    bool gnss;                    // false disables GNSS regardless of configuration
+    bool tower;                   // false disables tower enrichment regardless of configuration
+    bool wps;                     // false disables WiFi enrichment regardless of configuration
+};
+
+// Publish and GNSS counters since boot
+struct TrackerLocationStats {
+    uint32_t publishSuccess;      // location publishes acknowledged, including store and forward resends
+    uint32_t publishFailure;      // location publishes rejected
+    uint32_t publishTimeout;      // location publishes without a response
+    uint32_t fixes;               // stable locks after GNSS was powered
+    uint32_t lastTtffMs;          // time from GNSS power on to the most recent of those locks
+    uint64_t gnssOnMs;            // total time GNSS was powered
+};
+
 enum class Trigger {
     NORMAL = 0,
     IMMEDIATE = 1,
@@ -87,6 +136,39 @@ struct TrackerGeofenceConfig {
     int32_t interval; // seconds
 };
 
+// Enhanced location returned from the cloud, flattened so that it can be queued without allocation
+struct TrackerEnhancedLocation {
+    double latitude;                // degrees
+    double longitude;               // degrees
+    float horizontalAccuracy;       // meters
+    uint8_t sources;                // bitmask of (1 << LocationSource)
+    uint32_t requestSec;            // uptime of the location publish that requested it
+    uint32_t receivedSec;           // uptime when the response arrived
+};
+
+enum class SatConstellation {
+    GPS,
+    GLONASS,
+    GALILEO,
+    BEIDOU,
+    COUNT,
+    OTHER = COUNT,
+};
+
+// Per-constellation satellite SNR histogram reported with location diagnostics
+struct TrackerSatHistogram {
+    uint8_t counts[(size_t)SatConstellation::COUNT][TrackerSatHistBuckets];
+};
+
+// Publish payload staged while the cloud connection is pending
+struct TrackerLocationStaging {
+    bool valid;                     // a publish is pending and the point below is populated
+    bool towers;                    // cellular tower scan already collected
+    bool wps;                       // WiFi access point scan already collected
+    system_tick_t stagedMs;         // millis() when staging started
+    LocationPoint point;            // best location seen while staging
+};
+
 class TrackerLocation
 {
     public:
@@ -160,14 +242,29 @@ class TrackerLocation
         void lock() {mutex.lock();}
         void unlock() {mutex.unlock();}
 
-        inline bool getMinPublish() { return _config_state.min_publish; }
+        inline bool getMinPublish() { return _config_state_loop_safe.min_publish; }
+
+        // Publish, or store when disconnected, on the next loop without waiting for sample or connection
+        // timing.  The time from the given loss of external power to the publish is logged and kept.
+        void powerFail(system_tick_t startMs);
+        system_tick_t getPowerFailLatency() const { return _powerFailLatencyMs; }
+
+        // Counters for device monitoring; GNSS on-time includes the current on period
+        void getStats(TrackerLocationStats& stats);
+
+        // Apply operating profile limits; they take effect from the next loop
+        void setProfile(const TrackerLocationProfile& profile) {
+            _profile = profile;
+            _configChanges.notify(TrackerLocationConfigField::PROFILE);
+        }
+        const TrackerLocationProfile& getProfile() const { return _profile; }
 
         int addWap(WiFiAccessPoint* wap);
 
         Geofence& getGeoFence() {
             return _geofence;
         }
-        bool isProcessAckEnabled() {return _config_state.process_ack;}
+        bool isProcessAckEnabled() {return _config_state_loop_safe.process_ack;}
         int location_publish_cb(CloudServiceStatus status, String&& req_event, std::uint32_t last_publish_time);
         void issue_location_publish_callbacks(CloudServiceStatus status, const String &req_event);
 
@@ -249,12 +346,37 @@ class TrackerLocation
         size_t buildTowerInfo(JSONBufferWriter& writer, size_t size);
         static void wifi_cb(WiFiAccessPoint* wap, TrackerLocation* context);
         size_t buildWpsInfo(JSONBufferWriter& writer, size_t size);
+        void scanWps();
+        static SatConstellation satConstellation(unsigned int num);
+        void buildSatDiag(JSONWriter& writer, const LocationPoint& cur_loc);
+        static bool isBetterFix(const LocationPoint& candidate, const LocationPoint& current);
+        void stagePublish(const LocationPoint& cur_loc);
+        void publishLocation(LocationPoint& cur_loc);
+        void clearStaging() {
+            _staging.valid = false;
+            _staging.towers = false;
+            _staging.wps = false;
+        }
 
-        int buildEnhLocation(JSONValue& node, LocationPoint& point);
+        static int parseEnhLocation(const JSONValue& node, TrackerEnhancedLocation& loc);
         int enhanced_cb(JSONValue* root);
+        void processEnhancedLocations();
+
+        void restoreSnapshot();
+        void snapshotFix(const LocationPoint& point, bool force = false);
+        void saveSnapshot();
 
         unsigned int setGnssCycle() {
-            return _gnssCycleCurrent = _gnssRetryDefault + 1; // Initial attempt plus retries
+            unsigned int retries = (_profile.gnss_retries >= 0) ? (unsigned int)_profile.gnss_retries : _gnssRetryDefault;
+            return _gnssCycleCurrent = retries + 1; // Initial attempt plus retries
+        }
+
+        int32_t getIntervalMin() const {
+            return (_profile.interval_min_seconds) ? _profile.interval_min_seconds : _config_state_loop_safe.interval_min_seconds;
+        }
+
+        int32_t getIntervalMax() const {
+            return (_profile.interval_max_seconds) ? _profile.interval_max_seconds : _config_state_loop_safe.interval_max_seconds;
         }
 
         unsigned int getGnssCycle() const {
@@ -280,6 +402,31 @@ class TrackerLocation
         unsigned int _gnssCycleCurrent;
 
         tracker_location_config_t _config_state, _config_state_shadow, _config_state_loop_safe;
+        TrackerConfigNotifier<TrackerLocationConfigField> _configChanges;
+        TrackerLocationProfile _profile {0, 0, -1, true, true, true};
+
+        TrackerLocationStats _stats {};
+        bool _gnssOn {false};
+        bool _ttffPending {false};
+        system_tick_t _gnssOnSinceMs {0};
+
+        bool _pendingPowerFail {false};
+        system_tick_t _powerFailMs {0};
+        system_tick_t _powerFailLatencyMs {0};
+        void finishPowerFail(const char* outcome);
+
+        TrackerLocationStaging _staging {};
+
+        // Runtime state kept for restoring after an unexpected reset, written from the loop when pending
+        TrackerSnapshotState _snapshotState {};
+        bool _snapshotPending {false};
+        bool _snapshotFixValid {false};
+        unsigned int _snapshotFixSec {0};
+
+        TrackerSatHistogram _satHistSent {};
+        uint16_t _satHistSeq {0};
+        unsigned int _satHistSinceKeyframe {0};
+        bool _satHistKeyframe {true};
 
         Vector<std::function<void(JSONWriter&, LocationPoint&)>> locGenCallbacks;
         // publish callback for the next publish (not in flight)
@@ -288,7 +435,9 @@ class TrackerLocation
         Vector<std::function<void(CloudServiceStatus status, const String&)>> pendingLocPubCallbacks;
         // publish callbacks for the enhanced location callback
         Vector<std::function<void(const LocationPoint&)>> enhancedLocCallbacks;
-        os_queue_t _enhancedLocQueue;
+        os_queue_t _enhancedLocQueue {nullptr};
+        // reused for enhanced location callbacks to avoid reallocating sources on every response
+        LocationPoint _enhancedPoint {};
 
         Vector<WiFiAccessPoint> wpsList;
 };
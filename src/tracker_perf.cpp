@@ -0,0 +1,301 @@
+/*
+ * Copyright (c) 2022 Particle Industries, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "tracker_perf.h"
+#include "tracker_diagnostics.h"
+#include "tracker_export.h"
+#include "tracker_trace.h"
+#include "cloud_service.h"
+#include "LocationPublish.h"
+
+// Bit width of the longest loop time held in the first histogram bucket
+constexpr uint32_t TrackerPerfFirstBucketBits = 7;
+
+TrackerPerf *TrackerPerf::_instance = nullptr;
+
+static size_t loopBucket(uint32_t loopUs) {
+    uint32_t width = 32 - __builtin_clz(loopUs | 1);
+    if (width <= TrackerPerfFirstBucketBits) {
+        return 0;
+    }
+    return std::min((size_t)(width - TrackerPerfFirstBucketBits), TrackerPerfLoopBuckets - 1);
+}
+
+// Report the upper bound of the bucket holding the given rank, or the longest loop for the last bucket
+static uint32_t loopPercentile(const uint32_t* buckets, uint32_t loops, uint32_t permille, uint32_t maxUs) {
+    auto rank = (uint32_t)((((uint64_t)loops * permille) + 999) / 1000);
+    uint32_t seen = 0;
+    for (size_t i = 0; i < TrackerPerfLoopBuckets - 1; i++) {
+        seen += buckets[i];
+        if (seen >= rank) {
+            return std::min((uint32_t)1 << (i + TrackerPerfFirstBucketBits), maxUs);
+        }
+    }
+    return maxUs;
+}
+
+// Copy the most recent entries of a history ring, oldest first
+static size_t copyHistory(uint32_t* out, const uint32_t* ring, size_t total) {
+    auto count = std::min(total, TrackerPerfHistory);
+    for (size_t i = 0; i < count; i++) {
+        out[i] = ring[(total - count + i) % TrackerPerfHistory];
+    }
+    return count;
+}
+
+static os_result_t threadInfo(os_thread_dump_info_t* info, void* data) {
+    auto thread = static_cast<TrackerPerfThread*>(data);
+    snprintf(thread->name, sizeof(thread->name), "%s", (info->name) ? info->name : "");
+    thread->stackSize = (uint32_t)(info->stack_end - info->stack_base);
+    thread->stackFree = (uint32_t)info->stack_high_watermark;
+    return 0;
+}
+
+TrackerPerf::TrackerPerf() :
+    _loopBuckets(),
+    _loopMaxUs(0),
+    _windowStartSec(0),
+    _threads(),
+    _threadCount(0),
+    _ttffMs(),
+    _ttffCount(0),
+    _attachMs(),
+    _attachCount(0),
+    _tracing(false),
+    _traceStartMs(0),
+    _traceSec(0),
+    _traceMinUs(TrackerPerfTraceDefaultMinUs),
+    _diagId(-1),
+    _pendingReport(false),
+    _pendingTrace(false),
+    _requestTraceSec(0),
+    _requestTraceMinUs(TrackerPerfTraceDefaultMinUs),
+    _snapshot(),
+    _exportSize(0) {
+
+}
+
+int TrackerPerf::init() {
+    _windowStartSec = System.uptime();
+    regThread(os_thread_current(nullptr));
+
+    CloudService::instance().registerCommand("perf", std::bind(&TrackerPerf::perf_cb, this, std::placeholders::_1));
+
+    // The block is written from the snapshot taken for the command so that its size is stable until it is sent
+    _diagId = TrackerDiagnostics::instance().regBlock("perf", [this](JSONWriter& writer){
+        writeSnapshot(writer, _snapshot);
+    });
+
+    return regExport();
+}
+
+// A slot is reserved before it is filled in, readers skip slots that are still empty
+int TrackerPerf::regThread(os_thread_t thread) {
+    auto index = _threadCount.fetch_add(1);
+    CHECK_TRUE(index < TrackerPerfMaxThreads, SYSTEM_ERROR_NO_MEMORY);
+    _threads[index] = thread;
+    return SYSTEM_ERROR_NONE;
+}
+
+void TrackerPerf::loop(uint32_t loopUs) {
+    auto bucket = loopBucket(loopUs);
+    _loopBuckets[bucket]++;
+    if (loopUs > _loopMaxUs) {
+        _loopMaxUs = loopUs;
+    }
+
+    if (_pendingTrace.exchange(false)) {
+        setTrace(_requestTraceSec, _requestTraceMinUs);
+    }
+
+    if (_tracing) {
+        if ((millis() - _traceStartMs) >= (_traceSec * 1000)) {
+            setTrace(0, _traceMinUs);
+        }
+        else if (loopUs >= _traceMinUs) {
+            TrackerTrace::instance().record(TrackerTraceEvent::LOOP, (uint8_t)bucket,
+                (uint16_t)std::min(loopUs / 100, (uint32_t)UINT16_MAX));
+        }
+    }
+
+    if (_pendingReport.exchange(false)) {
+        collect(_snapshot);
+        resetWindow();
+        TrackerDiagnostics::instance().submit(_diagId, true);
+    }
+}
+
+void TrackerPerf::setTrace(uint32_t seconds, uint32_t minUs) {
+    _tracing = (seconds > 0);
+    _traceStartMs = millis();
+    _traceSec = seconds;
+    _traceMinUs = minUs;
+    TrackerTrace::instance().record(TrackerTraceEvent::PERF_TRACE, (uint8_t)_tracing, (uint16_t)seconds);
+}
+
+void TrackerPerf::collect(TrackerPerfSnapshot& snapshot) {
+    memset(&snapshot, 0, sizeof(snapshot));
+
+    uint32_t loops = 0;
+    for (auto count : _loopBuckets) {
+        loops += count;
+    }
+    auto now = System.uptime();
+    snapshot.windowSec = now - _windowStartSec;
+    snapshot.loops = loops;
+    snapshot.loopP50Us = loopPercentile(_loopBuckets, loops, 500, _loopMaxUs);
+    snapshot.loopP90Us = loopPercentile(_loopBuckets, loops, 900, _loopMaxUs);
+    snapshot.loopP99Us = loopPercentile(_loopBuckets, loops, 990, _loopMaxUs);
+    snapshot.loopMaxUs = _loopMaxUs;
+
+    auto threads = std::min(_threadCount.load(), TrackerPerfMaxThreads);
+    for (size_t i = 0; i < threads; i++) {
+        if (_threads[i] && !os_thread_dump(_threads[i], threadInfo, &snapshot.threads[snapshot.threadCount])) {
+            snapshot.threadCount++;
+        }
+    }
+
+    runtime_info_t info = {};
+    info.size = sizeof(info);
+    HAL_Core_Runtime_Info(&info, nullptr);
+    snapshot.heapFree = info.freeheap;
+    snapshot.heapLargest = info.largest_free_block_heap;
+    snapshot.heapMaxUsed = info.max_used_heap;
+
+    LocationPublishStats storeStats;
+    LocationPublish::instance().getStats(storeStats);
+    snapshot.queued = storeStats.queued;
+    snapshot.queuedBytes = storeStats.queuedBytes;
+    snapshot.queueKnown = storeStats.depthKnown;
+
+    snapshot.ttffCount = copyHistory(snapshot.ttffMs, _ttffMs, _ttffCount);
+    snapshot.attachCount = copyHistory(snapshot.attachMs, _attachMs, _attachCount);
+
+    TrackerSleep::instance().getSchedule(snapshot.sleep);
+
+    if (_tracing) {
+        auto elapsedSec = (millis() - _traceStartMs) / 1000;
+        snapshot.traceRemainingSec = (elapsedSec < _traceSec) ? _traceSec - elapsedSec : 0;
+    }
+}
+
+// Only the command starts a new window so that reading the export does not shorten the next report
+void TrackerPerf::resetWindow() {
+    memset(_loopBuckets, 0, sizeof(_loopBuckets));
+    _loopMaxUs = 0;
+    _windowStartSec = System.uptime();
+}
+
+void TrackerPerf::writeSnapshot(JSONWriter& writer, const TrackerPerfSnapshot& snapshot) {
+    writer.name("win").value((unsigned int)snapshot.windowSec);
+    writer.name("loop").beginObject();
+    writer.name("n").value((unsigned int)snapshot.loops);
+    writer.name("p50").value((unsigned int)snapshot.loopP50Us);
+    writer.name("p90").value((unsigned int)snapshot.loopP90Us);
+    writer.name("p99").value((unsigned int)snapshot.loopP99Us);
+    writer.name("max").value((unsigned int)snapshot.loopMaxUs);
+    writer.endObject();
+
+    writer.name("stack").beginArray();
+    for (size_t i = 0; i < snapshot.threadCount; i++) {
+        const auto& thread = snapshot.threads[i];
+        writer.beginObject();
+        writer.name("n").value(thread.name);
+        writer.name("size").value((unsigned int)thread.stackSize);
+        writer.name("free").value((unsigned int)thread.stackFree);
+        writer.endObject();
+    }
+    writer.endArray();
+
+    writer.name("heap").beginObject();
+    writer.name("free").value((unsigned int)snapshot.heapFree);
+    writer.name("big").value((unsigned int)snapshot.heapLargest);
+    writer.name("max_used").value((unsigned int)snapshot.heapMaxUsed);
+    writer.endObject();
+
+    writer.name("queue").beginObject();
+    if (snapshot.queueKnown) {
+        writer.name("n").value((unsigned int)snapshot.queued);
+        writer.name("bytes").value((unsigned int)snapshot.queuedBytes);
+    }
+    writer.endObject();
+
+    writer.name("ttff").beginArray();
+    for (size_t i = 0; i < snapshot.ttffCount; i++) {
+        writer.value((unsigned int)snapshot.ttffMs[i]);
+    }
+    writer.endArray();
+
+    writer.name("attach").beginArray();
+    for (size_t i = 0; i < snapshot.attachCount; i++) {
+        writer.value((unsigned int)snapshot.attachMs[i]);
+    }
+    writer.endArray();
+
+    writer.name("sleep").beginObject();
+    writer.name("mode").value((int)snapshot.sleep.mode);
+    writer.name("state").value((int)snapshot.sleep.state);
+    writer.name("exe").value((unsigned int)snapshot.sleep.executeRemainingSec);
+    writer.name("wake").value((unsigned int)snapshot.sleep.nextWakeSec);
+    writer.endObject();
+
+    writer.name("trace").value((unsigned int)snapshot.traceRemainingSec);
+}
+
+// May be called from the system thread for commands received over USB
+int TrackerPerf::perf_cb(JSONValue* root) {
+    JSONObjectIterator item(*root);
+    while (item.next()) {
+        if (item.name() == "trace") {
+            _requestTraceSec = std::min((uint32_t)std::max(item.value().toInt(), 0), TrackerPerfTraceMaxSec);
+            _pendingTrace = true;
+        }
+        else if (item.name() == "min_us") {
+            _requestTraceMinUs = (uint32_t)std::max(item.value().toInt(), 0);
+        }
+    }
+    _pendingReport = true;
+
+    return SYSTEM_ERROR_NONE;
+}
+
+int TrackerPerf::regExport() {
+    TrackerExportSource source = {
+        .name = "perf",
+        .open = [this](size_t& size) -> int {
+            TrackerPerfSnapshot snapshot;
+            collect(snapshot);
+
+            JSONBufferWriter writer(_export, sizeof(_export));
+            writer.beginObject();
+            writeSnapshot(writer, snapshot);
+            writer.endObject();
+            CHECK_TRUE(writer.dataSize() <= sizeof(_export), SYSTEM_ERROR_TOO_LARGE);
+            _exportSize = writer.dataSize();
+            size = _exportSize;
+            return SYSTEM_ERROR_NONE;
+        },
+        .read = [this](size_t offset, uint8_t* data, size_t length) -> int {
+            length = std::min(length, _exportSize - std::min(offset, _exportSize));
+            memcpy(data, _export + offset, length);
+            return (int)length;
+        },
+        .consume = nullptr,
+        .close = nullptr,
+    };
+
+    return TrackerExport::instance().regSource(source);
+}
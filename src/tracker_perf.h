@@ -0,0 +1,186 @@
+/*
+ * Copyright (c) 2022 Particle Industries, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <atomic>
+
+#include "Particle.h"
+#include "tracker_sleep.h"
+
+// Number of loop time histogram buckets.  Bucket 0 holds loops under 128 microseconds and each following
+// bucket doubles the limit, the last one holds everything longer.
+constexpr size_t TrackerPerfLoopBuckets = 16;
+
+// Maximum number of threads whose stack usage is reported
+constexpr size_t TrackerPerfMaxThreads = 6;
+
+// Number of most recent GNSS time to first fix and cellular attach times kept
+constexpr size_t TrackerPerfHistory = 4;
+
+// Longest time, in seconds, that loop tracing can be enabled for by one command
+constexpr uint32_t TrackerPerfTraceMaxSec = 600;
+
+// Default shortest loop, in microseconds, that is recorded while loop tracing is enabled
+constexpr uint32_t TrackerPerfTraceDefaultMinUs = 10000;
+
+// Size of the JSON report read over the USB export interface, in bytes
+constexpr size_t TrackerPerfExportSize = 768;
+
+/**
+ * @brief Stack usage of a thread
+ *
+ */
+struct TrackerPerfThread {
+    char name[16];                  /**< Thread name, truncated */
+    uint32_t stackSize;             /**< Stack size in bytes */
+    uint32_t stackFree;             /**< Least free stack seen by the scheduler, in bytes */
+};
+
+/**
+ * @brief A performance report.  Loop times cover the window since the previous perf command.
+ *
+ */
+struct TrackerPerfSnapshot {
+    uint32_t windowSec;             /**< Seconds covered by the loop times */
+    uint32_t loops;                 /**< Loops completed in the window */
+    uint32_t loopP50Us;             /**< Median loop time, upper bound of its histogram bucket */
+    uint32_t loopP90Us;             /**< 90th percentile loop time, upper bound of its histogram bucket */
+    uint32_t loopP99Us;             /**< 99th percentile loop time, upper bound of its histogram bucket */
+    uint32_t loopMaxUs;             /**< Longest loop time */
+    TrackerPerfThread threads[TrackerPerfMaxThreads];
+    size_t threadCount;
+    uint32_t heapFree;              /**< Free heap in bytes */
+    uint32_t heapLargest;           /**< Largest free heap block in bytes */
+    uint32_t heapMaxUsed;           /**< Most heap ever in use, in bytes */
+    uint32_t queued;                /**< Messages waiting in the disk queue */
+    uint32_t queuedBytes;           /**< Bytes waiting in the disk queue */
+    bool queueKnown;                /**< Queue depth is known, see LocationPublishStats */
+    uint32_t ttffMs[TrackerPerfHistory];    /**< Most recent GNSS times to first fix, oldest first */
+    size_t ttffCount;
+    uint32_t attachMs[TrackerPerfHistory];  /**< Most recent modem power on to cloud connection times, oldest first */
+    size_t attachCount;
+    TrackerSleepSchedule sleep;     /**< Current sleep schedule */
+    uint32_t traceRemainingSec;     /**< Seconds until loop tracing expires, 0 when disabled */
+};
+
+/**
+ * @brief TrackerPerf class to report how a unit in the field is performing without debug firmware.
+ *
+ * @details The perf command collects loop time percentiles, thread stack and heap watermarks, disk queue
+ * depth, GNSS time to first fix and cellular attach history and the sleep schedule into a fixed size
+ * snapshot that is sent as the "perf" diagnostics block and can be read as the "perf" USB export source.
+ * The command can also enable loop tracing for a limited time, which records slow loops in the state trace
+ * and turns itself off when it expires.  Collection does not allocate and its cost is bounded by the fixed
+ * number of buckets, threads and history entries.
+ *
+ * Command arguments, all optional:
+ *   "trace": seconds of loop tracing, 0 to disable, limited to TrackerPerfTraceMaxSec
+ *   "min_us": shortest loop, in microseconds, recorded while tracing
+ */
+class TrackerPerf {
+public:
+    /**
+     * @brief Singleton class instance access for TrackerPerf.
+     *
+     * @return TrackerPerf&
+     */
+    static TrackerPerf& instance() {
+        if (!_instance) {
+            _instance = new TrackerPerf();
+        }
+        return *_instance;
+    }
+
+    /**
+     * @brief Register the calling thread, the command, the diagnostics block and the export source.
+     *
+     * @retval SYSTEM_ERROR_NONE
+     */
+    int init();
+
+    /**
+     * @brief Register a thread for stack reporting.
+     *
+     * @param thread Thread handle
+     * @retval SYSTEM_ERROR_NONE
+     * @retval SYSTEM_ERROR_NO_MEMORY
+     */
+    int regThread(os_thread_t thread);
+
+    /**
+     * @brief Record the time taken by one application loop and complete pending requests.  Called at the end of
+     * every loop.
+     *
+     * @param loopUs Loop time in microseconds
+     */
+    void loop(uint32_t loopUs);
+
+    /**
+     * @brief Record a GNSS time to first fix.
+     *
+     * @param ms Time from GNSS power on to a stable lock, in milliseconds
+     */
+    void recordTtff(uint32_t ms) {
+        _ttffMs[_ttffCount++ % TrackerPerfHistory] = ms;
+    }
+
+    /**
+     * @brief Record a cellular attach time.
+     *
+     * @param ms Time from modem power on to a cloud connection, in milliseconds
+     */
+    void recordAttach(uint32_t ms) {
+        _attachMs[_attachCount++ % TrackerPerfHistory] = ms;
+    }
+
+private:
+    TrackerPerf();
+
+    static TrackerPerf* _instance;
+
+    uint32_t _loopBuckets[TrackerPerfLoopBuckets];
+    uint32_t _loopMaxUs;
+    uint32_t _windowStartSec;
+    os_thread_t _threads[TrackerPerfMaxThreads];
+    std::atomic<size_t> _threadCount;
+    uint32_t _ttffMs[TrackerPerfHistory];
+    size_t _ttffCount;
+    uint32_t _attachMs[TrackerPerfHistory];
+    size_t _attachCount;
+    bool _tracing;
+    system_tick_t _traceStartMs;
+    uint32_t _traceSec;
+    uint32_t _traceMinUs;
+    int _diagId;
+
+    // Requests from the command, which may run on the system thread when sent over USB, are completed from loop()
+    std::atomic<bool> _pendingReport;
+    std::atomic<bool> _pendingTrace;
+    uint32_t _requestTraceSec;
+    uint32_t _requestTraceMinUs;
+
+    TrackerPerfSnapshot _snapshot;  // last report sent by the command
+    char _export[TrackerPerfExportSize];
+    size_t _exportSize;
+
+    void collect(TrackerPerfSnapshot& snapshot);
+    void resetWindow();
+    static void writeSnapshot(JSONWriter& writer, const TrackerPerfSnapshot& snapshot);
+    void setTrace(uint32_t seconds, uint32_t minUs);
+    int perf_cb(JSONValue* root);
+    int regExport();
+};
@@ -0,0 +1,184 @@
+/*
+ * Copyright (c) 2022 Particle Industries, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "tracker_power.h"
+#include "tracker_diagnostics.h"
+#include "tracker_location.h"
+
+TrackerPower *TrackerPower::_instance = nullptr;
+
+// Configuration service node setup
+// { "power" :
+//     { "debounce": 1000,
+//       "fast_fail": true
+//      }
+//  }
+
+int TrackerPower::init() {
+    static ConfigObject powerDesc
+    (
+        "power",
+        {
+            ConfigInt("debounce", &_config.debounce_ms, 0, 60000),
+            ConfigBool("fast_fail", &_config.fast_fail),
+        }
+    );
+
+    CHECK(ConfigService::instance().registerModule(powerDesc));
+
+    // Assume we boot up with power connected so that booting on battery is reported as soon as it is confirmed
+    _source.current = POWER_SOURCE_VIN;
+    setPending(_source, (uint8_t)System.powerSource());
+    _charge.current = (uint8_t)System.batteryState();
+
+    System.on(power_source, powerSourceHandler);
+    System.on(battery_state, batteryStateHandler);
+
+    _diagId = TrackerDiagnostics::instance().regBlock("pwr_hist", [this](JSONWriter& writer){ writeHistory(writer); });
+
+    return SYSTEM_ERROR_NONE;
+}
+
+int TrackerPower::regTransitionCallback(TrackerPowerCallback callback) {
+    CHECK_TRUE(callback, SYSTEM_ERROR_INVALID_ARGUMENT);
+    CHECK_TRUE(_callbacks.append(callback), SYSTEM_ERROR_NO_MEMORY);
+
+    return SYSTEM_ERROR_NONE;
+}
+
+bool TrackerPower::isExternal(power_source_t source) {
+    switch (source) {
+        case POWER_SOURCE_VIN:
+        // Fall through
+        case POWER_SOURCE_USB_HOST:
+        // Fall through
+        case POWER_SOURCE_USB_ADAPTER:
+        // Fall through
+        case POWER_SOURCE_USB_OTG: {
+            return true;
+        }
+
+        default: {
+            return false;
+        }
+    }
+}
+
+void TrackerPower::setPending(Tracked& tracked, uint8_t value) {
+    const std::lock_guard<Mutex> lock(_pendingLock);
+    tracked.pending = true;
+    tracked.pendingValue = value;
+    tracked.pendingMs = millis();
+}
+
+void TrackerPower::powerSourceHandler(system_event_t event, int data) {
+    auto& power = TrackerPower::instance();
+    power.setPending(power._source, (uint8_t)data);
+
+    // Loss of external power may be followed shortly by loss of the whole system, such as when a trailer
+    // is unhitched with a depleted battery, so it skips the debounce time
+    if (power._config.fast_fail && isExternal((power_source_t)power._source.current) && !isExternal((power_source_t)data)) {
+        power._powerFailMs = millis();
+        power._powerFail = true;
+    }
+}
+
+void TrackerPower::batteryStateHandler(system_event_t event, int data) {
+    TrackerPower::instance().setPending(TrackerPower::instance()._charge, (uint8_t)data);
+}
+
+// A value is accepted once no other value has arrived for the debounce time.  Bouncing back to the
+// current value before then cancels the change.
+void TrackerPower::evaluate(Tracked& tracked, TrackerPowerEvent type, bool force) {
+    uint8_t value;
+    {
+        const std::lock_guard<Mutex> lock(_pendingLock);
+        if (!tracked.pending || (!force && ((millis() - tracked.pendingMs) < (system_tick_t)_config.debounce_ms))) {
+            return;
+        }
+        tracked.pending = false;
+        value = tracked.pendingValue;
+    }
+
+    if (value == tracked.current) {
+        return;
+    }
+
+    auto from = tracked.current;
+    tracked.current = value;
+    record(type, from, value);
+}
+
+void TrackerPower::record(TrackerPowerEvent type, uint8_t from, uint8_t to) {
+    TrackerPowerTransition transition = {
+        .time = (Time.isValid()) ? (uint32_t)Time.now() : 0,
+        .uptime = System.uptime(),
+        .type = type,
+        .from = from,
+        .to = to,
+    };
+
+    if (_historyCount == TrackerPowerHistorySize) {
+        _historyHead = (_historyHead + 1) % TrackerPowerHistorySize;
+        _historyCount--;
+    }
+    _history[(_historyHead + _historyCount) % TrackerPowerHistorySize] = transition;
+    _historyCount++;
+
+    // Charge state can toggle often near full charge so its changes are only sent with the next source change
+    if (type == TrackerPowerEvent::SOURCE) {
+        Log.info("Power source changed from %u to %u", from, to);
+        TrackerLocation::instance().triggerLocPub(Trigger::IMMEDIATE, TrackerPowerTrigger);
+        (void)TrackerDiagnostics::instance().submit(_diagId);
+    }
+    else {
+        Log.info("Battery state changed from %u to %u", from, to);
+    }
+
+    for (auto& callback : _callbacks) {
+        callback(transition);
+    }
+}
+
+void TrackerPower::loop() {
+    if (_powerFail.exchange(false)) {
+        // Accepting the change switches operating profiles through the callbacks and the location
+        // publish is flushed or sent on this same loop
+        evaluate(_source, TrackerPowerEvent::SOURCE, true);
+        TrackerLocation::instance().powerFail(_powerFailMs);
+    }
+
+    evaluate(_source, TrackerPowerEvent::SOURCE);
+    evaluate(_charge, TrackerPowerEvent::CHARGE);
+}
+
+// Each transition is [epoch time, uptime, "s" for source or "c" for charge state, from, to]
+void TrackerPower::writeHistory(JSONWriter& writer) {
+    writer.name("src").value((unsigned int)_source.current);
+    writer.name("chg").value((unsigned int)_charge.current);
+    writer.name("hist").beginArray();
+    for (size_t i = 0; i < _historyCount; i++) {
+        const auto& transition = _history[(_historyHead + i) % TrackerPowerHistorySize];
+        writer.beginArray();
+        writer.value((unsigned int)transition.time);
+        writer.value((unsigned int)transition.uptime);
+        writer.value((transition.type == TrackerPowerEvent::SOURCE) ? "s" : "c");
+        writer.value((unsigned int)transition.from);
+        writer.value((unsigned int)transition.to);
+        writer.endArray();
+    }
+    writer.endArray();
+}
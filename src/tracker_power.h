@@ -0,0 +1,183 @@
+/*
+ * Copyright (c) 2022 Particle Industries, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <atomic>
+
+#include "Particle.h"
+#include "config_service.h"
+
+// Number of power transitions kept for diagnostics
+constexpr size_t TrackerPowerHistorySize = 8;
+
+// Default time, in milliseconds, a new power source or charge state must persist before it is accepted
+constexpr int32_t TrackerPowerDefaultDebounceMs = 1000;
+
+// Trigger name added to location publishes caused by power source changes
+constexpr const char* TrackerPowerTrigger = "pwr";
+
+/**
+ * @brief Kind of power transition
+ *
+ */
+enum class TrackerPowerEvent : uint8_t {
+    SOURCE,                         /**< Power source changed, values are power_source_t */
+    CHARGE,                         /**< Battery charge state changed, values are battery_state_t */
+};
+
+/**
+ * @brief Debounced change in power source or charge state
+ *
+ */
+struct TrackerPowerTransition {
+    uint32_t time;                  /**< Epoch time of the change, 0 if time was not yet valid */
+    uint32_t uptime;                /**< System uptime in seconds of the change */
+    TrackerPowerEvent type;         /**< Kind of change */
+    uint8_t from;                   /**< Previous value */
+    uint8_t to;                     /**< New value */
+};
+
+/**
+ * @brief Type definition of the callback for power transitions.
+ *
+ */
+using TrackerPowerCallback = std::function<void(const TrackerPowerTransition& transition)>;
+
+struct tracker_power_config_t {
+    int32_t debounce_ms;            // time a new value must persist before it is accepted
+    bool fast_fail;                 // act on loss of external power without waiting for debounce
+};
+
+/**
+ * @brief TrackerPower class to follow power source and charge state changes from system events.
+ *
+ */
+class TrackerPower {
+public:
+    /**
+     * @brief Singleton class instance access for TrackerPower.
+     *
+     * @return TrackerPower&
+     */
+    static TrackerPower& instance() {
+        if (!_instance) {
+            _instance = new TrackerPower();
+        }
+        return *_instance;
+    }
+
+    /**
+     * @brief Initialize TrackerPower.
+     *
+     * @retval SYSTEM_ERROR_NONE
+     */
+    int init();
+
+    /**
+     * @brief Register a callback for debounced power transitions.
+     *
+     * @param callback Function to call with each transition
+     * @retval SYSTEM_ERROR_NONE
+     * @retval SYSTEM_ERROR_NO_MEMORY
+     */
+    int regTransitionCallback(TrackerPowerCallback callback);
+
+    /**
+     * @brief Get the debounced power source.
+     *
+     * @return power_source_t
+     */
+    power_source_t getSource() const {
+        return (power_source_t)_source.current;
+    }
+
+    /**
+     * @brief Get the debounced battery charge state.
+     *
+     * @return battery_state_t
+     */
+    battery_state_t getChargeState() const {
+        return (battery_state_t)_charge.current;
+    }
+
+    /**
+     * @brief Indicate whether the device is powered from VIN or USB.
+     *
+     * @return true External power present
+     * @return false Running from battery
+     */
+    bool isExternalPower() const {
+        return isExternal(getSource());
+    }
+
+    /**
+     * @brief Indicate whether a power source is external to the battery.
+     *
+     * @param source Power source
+     * @return true Source is VIN or USB
+     * @return false Source is battery or unknown
+     */
+    static bool isExternal(power_source_t source);
+
+    /**
+     * @brief Process debounced power events.  This must be executed within every system loop.
+     *
+     */
+    void loop();
+
+private:
+    TrackerPower() :
+        _historyHead(0),
+        _historyCount(0),
+        _diagId(-1),
+        _powerFail(false),
+        _powerFailMs(0) {
+
+        _config = {
+            .debounce_ms = TrackerPowerDefaultDebounceMs,
+            .fast_fail = true,
+        };
+    }
+
+    struct Tracked {
+        uint8_t current;            // debounced value
+        bool pending;               // a new value arrived from a system event
+        uint8_t pendingValue;
+        system_tick_t pendingMs;    // when the pending value arrived
+    };
+
+    static TrackerPower* _instance;
+
+    tracker_power_config_t _config;
+    Mutex _pendingLock;
+    Tracked _source {};
+    Tracked _charge {};
+    TrackerPowerTransition _history[TrackerPowerHistorySize];
+    size_t _historyHead;
+    size_t _historyCount;
+    int _diagId;
+    Vector<TrackerPowerCallback> _callbacks;
+    std::atomic<bool> _powerFail;   // external power was lost and is waiting on the fast path
+    system_tick_t _powerFailMs;     // when the loss was signalled
+
+    void setPending(Tracked& tracked, uint8_t value);
+    void evaluate(Tracked& tracked, TrackerPowerEvent type, bool force = false);
+    void record(TrackerPowerEvent type, uint8_t from, uint8_t to);
+    void writeHistory(JSONWriter& writer);
+    static void powerSourceHandler(system_event_t event, int data);
+    static void batteryStateHandler(system_event_t event, int data);
+};
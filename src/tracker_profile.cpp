@@ -0,0 +1,210 @@
+/*
+ * Copyright (c) 2022 Particle Industries, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "tracker_profile.h"
+#include "tracker_diagnostics.h"
+#include "tracker_fuelgauge.h"
+#include "tracker_location.h"
+#include "tracker_power.h"
+#include "tracker_sleep.h"
+
+TrackerProfile *TrackerProfile::_instance = nullptr;
+
+static constexpr const char* szProfileNames[] = {
+    "ext",
+    "batt",
+    "low",
+};
+
+static ConfigObject profileDesc(const char* name, tracker_profile_settings_t& settings) {
+    return ConfigObject(name, {
+        ConfigInt("min_int", &settings.interval_min_seconds, 0, 86400),
+        ConfigInt("max_int", &settings.interval_max_seconds, 0, 86400),
+        ConfigBool("gnss", &settings.gnss),
+        ConfigInt("gnss_retry", &settings.gnss_retries, -1, 10),
+        ConfigBool("tower", &settings.tower),
+        ConfigBool("wps", &settings.wps),
+        ConfigInt("env_rate", &settings.sensor_seconds, 0, 3600),
+        ConfigStringEnum(
+            "sleep",
+            {
+                {"config", (int32_t) TrackerProfileSleep::CONFIG},
+                {"disable", (int32_t) TrackerProfileSleep::DISABLE},
+                {"enable", (int32_t) TrackerProfileSleep::ENABLE},
+            },
+            &settings.sleep
+        ),
+    });
+}
+
+// Configuration service node setup
+// { "profile" :
+//     { "enable": false,
+//       "low_soc": 20.0,
+//       "hyst": 5.0,
+//       "eval": 60,
+//       "ext": { "min_int": 0, "max_int": 0, "gnss": true, "gnss_retry": -1, "tower": true, "wps": true,
+//                "env_rate": 0, "sleep": "config" },
+//       "batt": { ... },
+//       "low": { ... }
+//      }
+//  }
+
+int TrackerProfile::init() {
+    static_assert((size_t)TrackerProfileId::COUNT == sizeof(szProfileNames) / sizeof(szProfileNames[0]), "profile names");
+
+    static ConfigObject profileConfigDesc
+    (
+        "profile",
+        {
+            ConfigBool("enable", &_config.enable),
+            ConfigFloat("low_soc", &_config.low_soc, 0.0, 100.0),
+            ConfigFloat("hyst", &_config.hysteresis, 0.0, 50.0),
+            ConfigInt("eval", &_config.eval_seconds, 10, 3600),
+            profileDesc("ext", _config.profiles[(size_t)TrackerProfileId::EXTERNAL]),
+            profileDesc("batt", _config.profiles[(size_t)TrackerProfileId::BATTERY]),
+            profileDesc("low", _config.profiles[(size_t)TrackerProfileId::LOW_BATTERY]),
+        },
+        [](bool write, const void* context){ return 0; },
+        std::bind(&TrackerProfile::exitConfigCb, this, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3)
+    );
+
+    CHECK(ConfigService::instance().registerModule(profileConfigDesc));
+
+    // Source changes are already debounced so they can be acted on right away
+    CHECK(TrackerPower::instance().regTransitionCallback([this](const TrackerPowerTransition& transition){ _reevaluate = true; }));
+
+    _diagId = TrackerDiagnostics::instance().regBlock("prof", [this](JSONWriter& writer){
+        writer.name("act").value(getName(_active));
+        if (_appliedSoc >= 0.0) {
+            writer.name("soc").value(_appliedSoc, 1);
+        }
+    });
+
+    return SYSTEM_ERROR_NONE;
+}
+
+int TrackerProfile::regChangeCallback(TrackerProfileCallback callback) {
+    CHECK_TRUE(callback, SYSTEM_ERROR_INVALID_ARGUMENT);
+    CHECK_TRUE(_callbacks.append(callback), SYSTEM_ERROR_NO_MEMORY);
+
+    return SYSTEM_ERROR_NONE;
+}
+
+const char* TrackerProfile::getName(TrackerProfileId id) {
+    if ((size_t)id >= (size_t)TrackerProfileId::COUNT) {
+        return "none";
+    }
+    return szProfileNames[(size_t)id];
+}
+
+int TrackerProfile::exitConfigCb(bool write, int status, const void* context) {
+    if (write && !status) {
+        // Settings of the active profile may have changed so always apply again
+        _applied = false;
+        _reevaluate = true;
+    }
+    return status;
+}
+
+// The low battery profile is entered at the threshold but only left once the charge has recovered
+// past the hysteresis band so that a charge hovering around the threshold does not flip profiles.
+TrackerProfileId TrackerProfile::select(float soc) const {
+    if (TrackerPower::instance().isExternalPower()) {
+        return TrackerProfileId::EXTERNAL;
+    }
+
+    // Hold the current battery profile when the charge cannot be read
+    if (soc < 0.0) {
+        return (_active == TrackerProfileId::LOW_BATTERY) ? TrackerProfileId::LOW_BATTERY : TrackerProfileId::BATTERY;
+    }
+
+    if (_active == TrackerProfileId::LOW_BATTERY) {
+        return (soc >= (float)(_config.low_soc + _config.hysteresis)) ? TrackerProfileId::BATTERY : TrackerProfileId::LOW_BATTERY;
+    }
+
+    return (soc <= (float)_config.low_soc) ? TrackerProfileId::LOW_BATTERY : TrackerProfileId::BATTERY;
+}
+
+void TrackerProfile::apply(TrackerProfileId id) {
+    static const tracker_profile_settings_t unchanged = {0, 0, -1, true, true, true, 0, (int32_t)TrackerProfileSleep::CONFIG};
+    const auto& settings = (id == TrackerProfileId::NONE) ? unchanged : _config.profiles[(size_t)id];
+
+    TrackerLocationProfile location = {
+        .interval_min_seconds = settings.interval_min_seconds,
+        .interval_max_seconds = settings.interval_max_seconds,
+        .gnss_retries = settings.gnss_retries,
+        .gnss = settings.gnss,
+        .tower = settings.tower,
+        .wps = settings.wps,
+    };
+    TrackerLocation::instance().setProfile(location);
+
+    switch ((TrackerProfileSleep)settings.sleep) {
+        case TrackerProfileSleep::DISABLE: {
+            TrackerSleep::instance().overrideMode(TrackerSleepMode::Disable);
+            break;
+        }
+
+        case TrackerProfileSleep::ENABLE: {
+            TrackerSleep::instance().overrideMode(TrackerSleepMode::Enable);
+            break;
+        }
+
+        default: {
+            TrackerSleep::instance().clearModeOverride();
+            break;
+        }
+    }
+
+    if (id != _active) {
+        Log.info("Operating profile changed from %s to %s", getName(_active), getName(id));
+    }
+    _active = id;
+    _applied = true;
+    _appliedSoc = _soc;
+
+    (void)TrackerDiagnostics::instance().submit(_diagId);
+
+    for (auto& callback : _callbacks) {
+        callback(id, settings);
+    }
+}
+
+void TrackerProfile::loop() {
+    auto now = System.uptime();
+    if (!_reevaluate && (now - _evalTick < (unsigned int)_config.eval_seconds)) {
+        return;
+    }
+    _reevaluate = false;
+    _evalTick = now;
+
+    if (!_config.enable) {
+        if (!_applied || (_active != TrackerProfileId::NONE)) {
+            apply(TrackerProfileId::NONE);
+        }
+        return;
+    }
+
+    _soc = TrackerFuelGauge::instance().getFusedSoC();
+    if (_soc < 0.0) {
+        _soc = System.batteryCharge();
+    }
+    auto id = select(_soc);
+    if (!_applied || (id != _active)) {
+        apply(id);
+    }
+}
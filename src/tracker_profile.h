@@ -0,0 +1,177 @@
+/*
+ * Copyright (c) 2022 Particle Industries, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "Particle.h"
+#include "config_service.h"
+
+// Default battery state of charge, in percent, at or below which the low battery profile is selected
+constexpr double TrackerProfileDefaultLowSoc = 20.0;
+
+// Default state of charge, in percent, above the low threshold needed to leave the low battery profile
+constexpr double TrackerProfileDefaultHysteresis = 5.0;
+
+// Default time, in seconds, between state of charge evaluations while on battery
+constexpr int32_t TrackerProfileDefaultEvalInterval = 60;
+
+/**
+ * @brief Operating profiles selected from the power source and battery state
+ *
+ */
+enum class TrackerProfileId : uint8_t {
+    EXTERNAL,                       /**< Powered from VIN or USB */
+    BATTERY,                        /**< Running from battery */
+    LOW_BATTERY,                    /**< Running from a nearly flat battery */
+    COUNT,
+    NONE = COUNT,                   /**< Profiles are disabled and configuration applies unchanged */
+};
+
+/**
+ * @brief Sleep policy of an operating profile
+ *
+ */
+enum class TrackerProfileSleep {
+    CONFIG,                         /**< Follow the sleep configuration */
+    DISABLE,                        /**< Stay awake */
+    ENABLE,                         /**< Sleep between execution cycles */
+};
+
+struct tracker_profile_settings_t {
+    int32_t interval_min_seconds;   // 0 = use location configuration
+    int32_t interval_max_seconds;   // 0 = use location configuration
+    int32_t gnss_retries;           // -1 = use platform default
+    bool gnss;                      // allow GNSS
+    bool tower;                     // allow cellular tower enrichment
+    bool wps;                       // allow WiFi access point enrichment
+    int32_t sensor_seconds;         // seconds between environment sensor readings, 0 = default
+    int32_t sleep;                  // TrackerProfileSleep
+};
+
+struct tracker_profile_config_t {
+    bool enable;
+    double low_soc;                 // percent
+    double hysteresis;              // percent
+    int32_t eval_seconds;
+    tracker_profile_settings_t profiles[(size_t)TrackerProfileId::COUNT];
+};
+
+/**
+ * @brief Type definition of the callback for operating profile changes.
+ *
+ */
+using TrackerProfileCallback = std::function<void(TrackerProfileId id, const tracker_profile_settings_t& settings)>;
+
+/**
+ * @brief TrackerProfile class to select operating profiles from the power source and battery state.
+ *
+ */
+class TrackerProfile {
+public:
+    /**
+     * @brief Singleton class instance access for TrackerProfile.
+     *
+     * @return TrackerProfile&
+     */
+    static TrackerProfile& instance() {
+        if (!_instance) {
+            _instance = new TrackerProfile();
+        }
+        return *_instance;
+    }
+
+    /**
+     * @brief Initialize TrackerProfile.
+     *
+     * @retval SYSTEM_ERROR_NONE
+     */
+    int init();
+
+    /**
+     * @brief Register a callback for operating profile changes.
+     *
+     * @param callback Function to call with each newly applied profile
+     * @retval SYSTEM_ERROR_NONE
+     * @retval SYSTEM_ERROR_NO_MEMORY
+     */
+    int regChangeCallback(TrackerProfileCallback callback);
+
+    /**
+     * @brief Get the operating profile in effect.
+     *
+     * @return TrackerProfileId
+     */
+    TrackerProfileId getActive() const {
+        return _active;
+    }
+
+    /**
+     * @brief Get the name of an operating profile as used in configuration.
+     *
+     * @param id Profile identifier
+     * @return const char* Profile name, "none" when profiles are disabled
+     */
+    static const char* getName(TrackerProfileId id);
+
+    /**
+     * @brief Select and apply the operating profile.  This must be executed within every system loop.
+     *
+     */
+    void loop();
+
+private:
+    TrackerProfile() :
+        _active(TrackerProfileId::NONE),
+        _applied(false),
+        _reevaluate(true),
+        _evalTick(0),
+        _soc(-1.0),
+        _appliedSoc(-1.0),
+        _diagId(-1) {
+
+        // Profiles are opt in so that existing deployments keep their configured behavior until enabled
+        _config = {
+            .enable = false,
+            .low_soc = TrackerProfileDefaultLowSoc,
+            .hysteresis = TrackerProfileDefaultHysteresis,
+            .eval_seconds = TrackerProfileDefaultEvalInterval,
+            .profiles = {
+                // External power keeps the configured behavior with every enrichment available
+                {0, 0, -1, true, true, true, 0, (int32_t)TrackerProfileSleep::CONFIG},
+                // Battery drops WiFi scans and slows sensor readings
+                {0, 0, -1, true, true, false, 30, (int32_t)TrackerProfileSleep::CONFIG},
+                // Low battery publishes rarely, tries GNSS once and always sleeps
+                {3600, 14400, 0, true, false, false, 300, (int32_t)TrackerProfileSleep::ENABLE},
+            },
+        };
+    }
+
+    static TrackerProfile* _instance;
+
+    tracker_profile_config_t _config;
+    TrackerProfileId _active;
+    bool _applied;
+    bool _reevaluate;
+    unsigned int _evalTick;
+    float _soc;                     // most recent state of charge reading
+    float _appliedSoc;              // state of charge when the active profile was applied
+    int _diagId;
+    Vector<TrackerProfileCallback> _callbacks;
+
+    int exitConfigCb(bool write, int status, const void* context);
+    TrackerProfileId select(float soc) const;
+    void apply(TrackerProfileId id);
+};
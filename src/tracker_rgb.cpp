@@ -18,6 +18,7 @@
 
 #include "tracker_rgb.h"
 #include "tracker_cellular.h"
+#include "tracker_config_notify.h"
 
 #define RGB_CONTROL_TIMER_PERIOD_MS (250)
 #define RGB_CONTROL_FAST_FADE_PERIOD_MS (500)
@@ -48,6 +49,13 @@ static struct {
     }
 };
 
+enum class RGBConfigField {
+    TYPE,
+    DIRECT,
+};
+
+static TrackerConfigNotifier<RGBConfigField> rgb_changes;
+
 // actual led control driven by a periodic timer
 static void rgb_control_timer_cb()
 {
@@ -55,10 +63,14 @@ static void rgb_control_timer_cb()
     {
         case RGBControlType::APP_DIRECT:
         {
-            RGB.brightness(rgb_config.direct.brightness);
-            RGB.color(rgb_config.direct.red,
-                rgb_config.direct.green,
-                rgb_config.direct.blue);
+            // only drive the LED when the type or direct settings were written
+            if(rgb_changes.take())
+            {
+                RGB.brightness(rgb_config.direct.brightness);
+                RGB.color(rgb_config.direct.red,
+                    rgb_config.direct.green,
+                    rgb_config.direct.blue);
+            }
             break;
         }
         case RGBControlType::APP_TRACKER: // fall-thru
@@ -132,6 +144,15 @@ void TrackerRGB::init()
             ConfigInt("green", &rgb_config.direct.green, 0, 255),
             ConfigInt("blue", &rgb_config.direct.blue, 0, 255),
         })
+    },
+    [](bool write, const void *context) { return 0; },
+    [](bool write, int status, const void *context)
+    {
+        if(write && !status)
+        {
+            rgb_changes.notify(RGBConfigField::DIRECT);
+        }
+        return status;
     });
     ConfigService::instance().registerModule(rgb_control_desc);
 
@@ -166,6 +187,7 @@ int TrackerRGB::setType(RGBControlType type)
             return -EINVAL;
     }
     rgb_config.type = type;
+    rgb_changes.notify(RGBConfigField::TYPE);
 
     return 0;
 }
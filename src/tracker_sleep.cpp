@@ -15,6 +15,9 @@
  */
 
 #include "tracker_sleep.h"
+#include "tracker_config_txn.h"
+#include "tracker_trace.h"
+#include "tracker_perf.h"
 #include "cloud_service.h"
 #include "tracker_location.h"
 #include "tracker.h"
@@ -64,12 +67,17 @@ int TrackerSleep::init(SleepWatchdogCallback watchdog) {
       ),
       ConfigInt("exe_min", &_config_state.execute_min_seconds, TrackerSleepDefaultExeMinTime, TrackerSleepDefaultMaxTime),
       ConfigInt("conn_max", &_config_state.connecting_max_seconds, TrackerSleepDefaultConnMaxTime, TrackerSleepDefaultMaxTime)
-    }
+    },
+    [](bool write, const void* context){ return 0; },
+    std::bind(&TrackerSleep::exitConfigCb, this, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3)
   );
 
   _watchdog = watchdog;
 
   ConfigService::instance().registerModule(sleepDesc);
+  TrackerConfigTransaction::instance().join("sleep", &_config_state, sizeof(_config_state));
+  _config_applied = _config_state;
+  (void)_configChanges.take();
 
   // Associate OTA handler to pause sleep
   System.on(firmware_update+firmware_update_pending, handleOta);
@@ -83,6 +91,44 @@ int TrackerSleep::init(SleepWatchdogCallback watchdog) {
   return SYSTEM_ERROR_NONE;
 }
 
+int TrackerSleep::exitConfigCb(bool write, int status, const void* context) {
+  if (write && !status) {
+    using Change = TrackerConfigChange<TrackerSleepConfigField>;
+    _configChanges.notify(
+      Change::diff(TrackerSleepConfigField::MODE, _config_applied.mode, _config_state.mode) |
+      Change::diff(TrackerSleepConfigField::EXECUTE_MIN, _config_applied.execute_min_seconds, _config_state.execute_min_seconds) |
+      Change::diff(TrackerSleepConfigField::CONNECTING_MAX, _config_applied.connecting_max_seconds, _config_state.connecting_max_seconds));
+    TrackerConfigTransaction::instance().touch();
+  }
+  return status;
+}
+
+// Configuration writes are applied here, once per burst of writes, from the top of the loop.  Writes are
+// held while a configuration transaction is open.
+void TrackerSleep::applyConfig() {
+  if (TrackerConfigTransaction::instance().isOpen()) {
+    return;
+  }
+
+  auto change = _configChanges.take();
+  if (!change) {
+    return;
+  }
+
+  if (change.has(TrackerSleepConfigField::MODE)) {
+    sleepLog.info("sleep mode changed to %s", (_config_state.mode == TrackerSleepMode::Enable) ? "enable" : "disable");
+  }
+
+  // A longer minimum execution time also covers the execution cycle already in progress
+  if (change.has(TrackerSleepConfigField::EXECUTE_MIN) &&
+      (_executionState == TrackerExecutionState::EXECUTION) &&
+      (_executeDurationSec < (uint32_t)_config_state.execute_min_seconds)) {
+    _executeDurationSec = (uint32_t)_config_state.execute_min_seconds;
+  }
+
+  _config_applied = _config_state;
+}
+
 TrackerSleepError TrackerSleep::updateNextWake(uint64_t milliseconds) {
   // A input value of 0 means that the requestor wants to cancel the current sleep cycle, pass through
   // the sleep state and re-enter the execution phase
@@ -231,7 +277,13 @@ int TrackerSleep::registerStateChange(SleepCallback callback) {
 
 void TrackerSleep::startModem() {
   sleepLog.info("Starting modem");
-  _lastModemOnMs = System.millis();
+  // The modem may still be on when sleeping with network wake
+  if (!_modemOn) {
+    _modemOn = true;
+    _lastModemOnMs = System.millis();
+    _connectPending = true;
+    TrackerTrace::instance().record(TrackerTraceEvent::MODEM, 1);
+  }
   Particle.connect();
   _inFullWakeup = true;
 }
@@ -244,6 +296,30 @@ void TrackerSleep::stopModem() {
   Cellular.disconnect();
   waitUntilNot(Cellular.ready);
   _inFullWakeup = false;
+  if (_modemOn) {
+    _modemOn = false;
+    _connectPending = false;
+    _stats.modemOnMs += System.millis() - _lastModemOnMs;
+    TrackerTrace::instance().record(TrackerTraceEvent::MODEM, 0);
+  }
+}
+
+void TrackerSleep::getStats(TrackerSleepStats& stats) {
+  auto now = System.millis();
+  stats = _stats;
+  stats.awakeMs += now - _lastWakeMs;
+  if (_modemOn) {
+    stats.modemOnMs += now - _lastModemOnMs;
+  }
+}
+
+void TrackerSleep::getSchedule(TrackerSleepSchedule& schedule) {
+  auto now = System.millis();
+  auto elapsedSec = System.uptime() - _lastExecuteSec;
+  schedule.mode = getMode();
+  schedule.state = _executionState;
+  schedule.executeRemainingSec = (elapsedSec < _executeDurationSec) ? _executeDurationSec - elapsedSec : 0;
+  schedule.nextWakeSec = (_nextWakeMs > now) ? (uint32_t)((_nextWakeMs - now) / 1000) : 0;
 }
 
 TrackerSleepResult TrackerSleep::sleep() {
@@ -350,6 +426,7 @@ TrackerSleepResult TrackerSleep::sleep() {
   // Perform the actual System sleep now
   // Capture time that sleep was entered
   _lastSleepMs = System.millis();
+  _stats.awakeMs += _lastSleepMs - _lastWakeMs;
 
   // Re-evaluate the duration because handlers and preparation may have taken away time
   duration = (system_tick_t)(_nextWakeMs - _lastSleepMs);
@@ -360,13 +437,16 @@ TrackerSleepResult TrackerSleep::sleep() {
 
   _lastRequestedWakeMs = _lastSleepMs + duration;
   sleepLog.info("sleeping until %lu milliseconds", (uint32_t)_lastRequestedWakeMs);
+  TrackerTrace::instance().record(TrackerTraceEvent::SLEEP, 0, (uint16_t)std::min(duration / 1000, (system_tick_t)UINT16_MAX));
 
   retval.result = System.sleep(config);
 
   // Capture the wake time to help calculate the next sleep cycle
   _lastWakeMs = System.millis();
+  TrackerTrace::instance().record(TrackerTraceEvent::WAKE, (uint8_t)retval.result.wakeupReason(),
+    (retval.result.wakeupReason() == SystemSleepWakeupReason::BY_GPIO) ? (uint16_t)retval.result.wakeupPin() : 0);
 
-  _executeDurationSec = (uint32_t)_config_state.execute_min_seconds;
+  _executeDurationSec = (uint32_t)_config_applied.execute_min_seconds;
 
   // Enable watchdog
   if (_watchdog) {
@@ -402,6 +482,7 @@ TrackerSleepResult TrackerSleep::sleep() {
 void TrackerSleep::stateToConnecting() {
   _fullWakeupOverride = false;
   _executionState = TrackerExecutionState::CONNECTING;
+  TrackerTrace::instance().record(TrackerTraceEvent::SLEEP_STATE, (uint8_t)_executionState);
   _lastConnectingSec = System.uptime();
   _publishFlag = false;
 
@@ -424,6 +505,7 @@ void TrackerSleep::stateToConnecting() {
 
 void TrackerSleep::stateToExecute() {
   _executionState = TrackerExecutionState::EXECUTION;
+  TrackerTrace::instance().record(TrackerTraceEvent::SLEEP_STATE, (uint8_t)_executionState);
   _lastExecuteSec = System.uptime();
 
   TrackerSleepContext stateContext = {
@@ -443,6 +525,7 @@ void TrackerSleep::stateToExecute() {
 
 void TrackerSleep::stateToSleep() {
   _executionState = TrackerExecutionState::SLEEP;
+  TrackerTrace::instance().record(TrackerTraceEvent::SLEEP_STATE, (uint8_t)_executionState);
 
   TrackerSleepContext stateContext = {
     .reason = TrackerSleepReason::STATE_TO_SLEEP,
@@ -461,6 +544,7 @@ void TrackerSleep::stateToSleep() {
 
 void TrackerSleep::stateToShutdown() {
   _executionState = TrackerExecutionState::SHUTDOWN;
+  TrackerTrace::instance().record(TrackerTraceEvent::SLEEP_STATE, (uint8_t)_executionState);
 
   TrackerSleepContext stateContext = {
     .reason = TrackerSleepReason::STATE_TO_SHUTDOWN,
@@ -481,6 +565,7 @@ void TrackerSleep::stateToShutdown() {
 
 void TrackerSleep::stateToReset() {
   _executionState = TrackerExecutionState::RESET;
+  TrackerTrace::instance().record(TrackerTraceEvent::SLEEP_STATE, (uint8_t)_executionState);
 
   TrackerSleepContext stateContext = {
     .reason = TrackerSleepReason::STATE_TO_RESET,
@@ -501,6 +586,17 @@ void TrackerSleep::stateToReset() {
 
 int TrackerSleep::loop() {
 
+  applyConfig();
+
+  // Time to connect is measured from when the modem was powered
+  if (_connectPending && Particle.connected()) {
+    _connectPending = false;
+    _lastCloudConnectMs = System.millis();
+    _stats.lastConnectMs = (uint32_t)(_lastCloudConnectMs - _lastModemOnMs);
+    _stats.connects++;
+    TrackerPerf::instance().recordAttach(_stats.lastConnectMs);
+  }
+
   // Perform state operations and transitions
   switch (_executionState) {
     /* ----------------------------------------------------------------------------------------------------------------
@@ -511,7 +607,7 @@ int TrackerSleep::loop() {
     case TrackerExecutionState::BOOT: {
       _lastWakeMs = System.millis();
       _loopCount = 0;
-      _executeDurationSec = (uint32_t)_config_state.execute_min_seconds;
+      _executeDurationSec = (uint32_t)_config_applied.execute_min_seconds;
       stateToConnecting();
       break;
     }
@@ -537,7 +633,7 @@ int TrackerSleep::loop() {
         sleepLog.trace("published and transitioning to EXECUTE");
         stateToExecute();
       }
-      else if (System.uptime() - _lastConnectingSec >= (uint32_t)_config_state.connecting_max_seconds) {
+      else if (System.uptime() - _lastConnectingSec >= (uint32_t)_config_applied.connecting_max_seconds) {
         TrackerLocation::instance().triggerLocPub(Trigger::IMMEDIATE, "imm");
         sleepLog.trace("publishing timed out and transitioning to EXECUTE");
         stateToExecute();
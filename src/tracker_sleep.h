@@ -19,6 +19,7 @@
 #include "Particle.h"
 #include "tracker_config.h"
 #include "config_service.h"
+#include "tracker_config_notify.h"
 
 
 /**
@@ -47,6 +48,12 @@ struct tracker_sleep_config_t {
     int32_t connecting_max_seconds;
 };
 
+enum class TrackerSleepConfigField {
+    MODE,
+    EXECUTE_MIN,
+    CONNECTING_MAX,
+};
+
 /**
  * @brief Return types for time related sleep function calls.
  *
@@ -97,6 +104,17 @@ struct TrackerSleepContext {
   uint64_t modemOnMs;             /**< The time, in milliseconds, when the modem was turned on */
 };
 
+/**
+ * @brief Awake and modem counters since boot
+ *
+ */
+struct TrackerSleepStats {
+  uint64_t awakeMs;               /**< Total time, in milliseconds, spent out of sleep */
+  uint64_t modemOnMs;             /**< Total time, in milliseconds, the modem was powered */
+  uint32_t connects;              /**< Number of cloud connections made after the modem was powered */
+  uint32_t lastConnectMs;         /**< Time, in milliseconds, from modem power on to the most recent cloud connection */
+};
+
 /**
  * @brief Type definition of sleep watchdog callbacks.
  *
@@ -122,6 +140,17 @@ enum class TrackerExecutionState {
   RESET,
 };
 
+/**
+ * @brief Current sleep schedule
+ *
+ */
+struct TrackerSleepSchedule {
+  TrackerSleepMode mode;          /**< Sleep mode in effect, including overrides */
+  TrackerExecutionState state;    /**< Current execution state */
+  uint32_t executeRemainingSec;   /**< Seconds of execution left before sleep may be entered */
+  uint32_t nextWakeSec;           /**< Seconds until the scheduled wake, 0 when none is scheduled */
+};
+
 /**
  * @brief TrackerSleep class to configure and manage sleep.
  *
@@ -153,7 +182,16 @@ public:
    * @return TrackerSleepMode Enumeration for sleep configuration mode
    */
   TrackerSleepMode getConfigMode() {
-    return _config_state.mode;
+    return _config_applied.mode;
+  }
+
+  /**
+   * @brief Get the configuration as last written, which may not be applied yet
+   *
+   * @return const tracker_sleep_config_t& Written configuration
+   */
+  const tracker_sleep_config_t& getStagedConfig() const {
+    return _config_state;
   }
 
   /**
@@ -163,7 +201,34 @@ public:
    * @return false Sleep is enabled (in some form)
    */
   bool isSleepDisabled() {
-    return (_config_state.mode == TrackerSleepMode::Disable);
+    return (getMode() == TrackerSleepMode::Disable);
+  }
+
+  /**
+   * @brief Get the sleep mode in effect, which is the config mode unless overridden
+   *
+   * @return TrackerSleepMode Enumeration for the effective sleep mode
+   */
+  TrackerSleepMode getMode() {
+    return (_modeOverridden) ? _modeOverride : _config_applied.mode;
+  }
+
+  /**
+   * @brief Override the configured sleep mode, for example from an operating profile
+   *
+   * @param mode Sleep mode to use instead of the config mode
+   */
+  void overrideMode(TrackerSleepMode mode) {
+    _modeOverride = mode;
+    _modeOverridden = true;
+  }
+
+  /**
+   * @brief Return to the configured sleep mode
+   *
+   */
+  void clearModeOverride() {
+    _modeOverridden = false;
   }
 
   /**
@@ -172,7 +237,7 @@ public:
    * @return int32_t Execution time limit in seconds
    */
   int32_t getConfigExecuteTime() {
-    return _config_state.execute_min_seconds;
+    return _config_applied.execute_min_seconds;
   }
 
   /**
@@ -181,7 +246,7 @@ public:
    * @return int32_t Connecting time limit in seconds
    */
   int32_t getConfigConnectingTime() {
-    return _config_state.connecting_max_seconds;
+    return _config_applied.connecting_max_seconds;
   }
 
   /**
@@ -390,6 +455,16 @@ public:
     );
   }
 
+  /**
+   * @brief Indicate that the execution phase is waiting on the cloud connection after wake or boot.
+   *
+   * @return true In the CONNECTING state
+   * @return false In any other state
+   */
+  bool isConnecting() {
+    return (_executionState == TrackerExecutionState::CONNECTING);
+  }
+
   /**
    * @brief Instruct the TrackerSleep class to power on the cellular modem and GNSS in short wake cycles.
    *
@@ -429,6 +504,20 @@ public:
     _pendingPublishVitals = true;
   }
 
+  /**
+   * @brief Get awake and modem counters.  Times include the current awake and modem on periods.
+   *
+   * @param[out] stats Current counters
+   */
+  void getStats(TrackerSleepStats& stats);
+
+  /**
+   * @brief Get the current sleep schedule.
+   *
+   * @param[out] schedule Current schedule
+   */
+  void getSchedule(TrackerSleepSchedule& schedule);
+
   /**
    * @brief Main execution loop for the TrackerSleep class.  This must be executed within every system loop.
    *
@@ -437,6 +526,9 @@ public:
   int loop();
 
 private:
+  int exitConfigCb(bool write, int status, const void* context);
+  void applyConfig();
+
   /**
    * @brief Construct a new TrackerSleep singleton object
    *
@@ -448,6 +540,8 @@ private:
     _fullWakeupOverride(false),
     _inFullWakeup(true),
     _holdSleep(false),
+    _modeOverridden(false),
+    _modeOverride(TrackerSleepMode::Disable),
     _pendingPublishVitals(false),
     _pendingShutdown(false),
     _pendingReset(false),
@@ -472,6 +566,7 @@ private:
           .execute_min_seconds      = TrackerSleepDefaultExeMinTime,
           .connecting_max_seconds   = TrackerSleepDefaultConnMaxTime,
       };
+      _config_applied = _config_state;
     }
 
   /**
@@ -480,7 +575,7 @@ private:
    */
   void annoucePublish() {
     _publishFlag = true;
-    extendExecutionFromNow(_config_state.execute_min_seconds);
+    extendExecutionFromNow(_config_applied.execute_min_seconds);
   }
 
   /**
@@ -589,6 +684,8 @@ private:
 
   // Cloud configuration for TrackerSleep
   tracker_sleep_config_t _config_state;
+  tracker_sleep_config_t _config_applied;
+  TrackerConfigNotifier<TrackerSleepConfigField> _configChanges;
 
   // Stored wakeup reason
   SystemSleepWakeupReason _wakeupReason;
@@ -596,6 +693,8 @@ private:
   bool _fullWakeupOverride;
   bool _inFullWakeup;
   bool _holdSleep;
+  bool _modeOverridden;
+  TrackerSleepMode _modeOverride;
   bool _pendingPublishVitals;
   bool _pendingShutdown;
   bool _pendingReset;
@@ -612,6 +711,9 @@ private:
   uint64_t _lastModemOnMs;
   uint64_t _lastNetworkConnectMs;
   uint64_t _lastCloudConnectMs;
+  bool _modemOn {false};
+  bool _connectPending {false};
+  TrackerSleepStats _stats {};
   size_t _loopCount;
   bool _publishFlag;
 };
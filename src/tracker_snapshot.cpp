@@ -0,0 +1,107 @@
+/*
+ * Copyright (c) 2022 Particle Industries, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "tracker_snapshot.h"
+#include "tracker_crc.h"
+#include "tracker_trace.h"
+
+constexpr uint32_t TrackerSnapshotMagic = 0x50414e53; // "SNAP"
+constexpr uint16_t TrackerSnapshotVersion = 1;
+
+retained static uint8_t snapshotCopies[2][16 + sizeof(TrackerSnapshotState)] __attribute__((aligned(8)));
+
+TrackerSnapshot *TrackerSnapshot::_instance = nullptr;
+
+TrackerSnapshot::TrackerSnapshot() :
+    _copies((Copy*)snapshotCopies),
+    _current(0),
+    _seq(0),
+    _state(),
+    _restored(),
+    _dirty(false),
+    _stats() {
+
+    static_assert(sizeof(snapshotCopies[0]) == sizeof(Copy), "snapshot copy must not be padded");
+}
+
+int TrackerSnapshot::init() {
+    // Continue the sequence from the newest valid copy, whether or not it is restored
+    bool found = false;
+    for (size_t i = 0; i < 2; i++) {
+        if (isValid(_copies[i]) && (!found || ((int32_t)(_copies[i].seq - _seq) > 0))) {
+            found = true;
+            _current = i;
+            _seq = _copies[i].seq;
+        }
+    }
+
+    auto reason = System.resetReason();
+    if (found && isUnexpectedReset(reason)) {
+        _restored = _copies[_current].state;
+        for (auto& trigger : _restored.triggers) {
+            trigger[TrackerSnapshotTriggerSize - 1] = '\0';
+        }
+        _restored.triggerCount = std::min(_restored.triggerCount, (uint8_t)TrackerSnapshotMaxTriggers);
+        _stats.restored = true;
+        Log.info("Restoring runtime state %lu after reset reason %d", _seq, reason);
+        TrackerTrace::instance().record(TrackerTraceEvent::SNAPSHOT_RESTORE, _restored.flags, _restored.triggerCount);
+    }
+
+    return SYSTEM_ERROR_NONE;
+}
+
+// The older copy is overwritten so that the newer one stays valid until the CRC completes the write
+void TrackerSnapshot::loop() {
+    if (!_dirty) {
+        return;
+    }
+    _dirty = false;
+
+    auto next = _current ^ 1;
+    auto& copy = _copies[next];
+    copy.magic = TrackerSnapshotMagic;
+    copy.version = TrackerSnapshotVersion;
+    copy.size = sizeof(TrackerSnapshotState);
+    copy.seq = ++_seq;
+    copy.state = _state;
+    copy.crc = crc(copy);
+    _current = next;
+    _stats.commits++;
+}
+
+uint32_t TrackerSnapshot::crc(const Copy& copy) {
+    auto value = tracker_crc32(&copy.seq, sizeof(copy.seq));
+    return tracker_crc32(&copy.state, sizeof(copy.state), value);
+}
+
+bool TrackerSnapshot::isValid(const Copy& copy) const {
+    return (copy.magic == TrackerSnapshotMagic) &&
+        (copy.version == TrackerSnapshotVersion) &&
+        (copy.size == sizeof(TrackerSnapshotState)) &&
+        (copy.crc == crc(copy));
+}
+
+// Resets that were requested are expected to start from a clean state.  The external RTC watchdog resets
+// through the reset pin.
+bool TrackerSnapshot::isUnexpectedReset(int reason) {
+    switch (reason) {
+        case RESET_REASON_WATCHDOG:
+        case RESET_REASON_PANIC:
+        case RESET_REASON_PIN_RESET:
+            return true;
+    }
+    return false;
+}
@@ -0,0 +1,154 @@
+/*
+ * Copyright (c) 2022 Particle Industries, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "Particle.h"
+
+// Maximum number of pending publish triggers kept
+constexpr size_t TrackerSnapshotMaxTriggers = 8;
+
+// Size of a kept trigger name including the terminator, longer names are truncated
+constexpr size_t TrackerSnapshotTriggerSize = 12;
+
+/**
+ * @brief Flags of the runtime state
+ *
+ */
+enum TrackerSnapshotFlags : uint8_t {
+    TRACKER_SNAPSHOT_IMMEDIATE      = 0x01,     /**< An immediate publish is pending */
+    TRACKER_SNAPSHOT_GEOFENCE       = 0x02,     /**< A geofence interval publish is pending */
+    TRACKER_SNAPSHOT_PUBLISHED      = 0x04,     /**< The first location publish since boot was acknowledged */
+};
+
+/**
+ * @brief Runtime state kept across unexpected resets.  Times are Unix times so that they can be carried over
+ * to the uptime of the next boot, 0 when unknown.
+ *
+ */
+struct TrackerSnapshotState {
+    double latitude;                /**< Last fix latitude in degrees */
+    double longitude;               /**< Last fix longitude in degrees */
+    float altitude;                 /**< Last fix altitude in meters */
+    float horizontalAccuracy;       /**< Last fix horizontal accuracy in meters */
+    uint32_t fixTime;               /**< Time of the last fix */
+    uint32_t lastPublishTime;       /**< Time of the last location publish, the start of the min interval */
+    uint32_t monotonicPublishTime;  /**< Start of the current max interval */
+    uint8_t flags;                  /**< TrackerSnapshotFlags */
+    uint8_t triggerCount;           /**< Number of pending triggers */
+    uint16_t reserved;
+    char triggers[TrackerSnapshotMaxTriggers][TrackerSnapshotTriggerSize];  /**< Pending trigger names */
+};
+
+/**
+ * @brief Snapshot counters since boot
+ *
+ */
+struct TrackerSnapshotStats {
+    uint32_t commits;               /**< Changes written to retained memory */
+    bool restored;                  /**< State from before the reset was restored */
+};
+
+/**
+ * @brief TrackerSnapshot class to keep critical runtime state in retained memory so that it can be restored
+ * after a watchdog reset or crash.
+ *
+ * @details Two copies are kept, each with a sequence number and a CRC-32.  Changes are collected with update()
+ * and written from the application loop to the older copy so that a reset in the middle of a write always
+ * leaves the previous state intact.  At boot the newest valid copy is offered for restoring when the reset was
+ * unexpected; planned resets, such as updates and reset commands, start from a clean state as before.
+ */
+class TrackerSnapshot {
+public:
+    /**
+     * @brief Singleton class instance access for TrackerSnapshot.
+     *
+     * @return TrackerSnapshot&
+     */
+    static TrackerSnapshot& instance() {
+        if (!_instance) {
+            _instance = new TrackerSnapshot();
+        }
+        return *_instance;
+    }
+
+    /**
+     * @brief Select the state to restore from retained memory.  Call before the modules that restore from it.
+     *
+     * @retval SYSTEM_ERROR_NONE
+     */
+    int init();
+
+    /**
+     * @brief Get the state from before the reset.
+     *
+     * @return const TrackerSnapshotState* State to restore, nullptr when there is none
+     */
+    const TrackerSnapshotState* restored() const {
+        return (_stats.restored) ? &_restored : nullptr;
+    }
+
+    /**
+     * @brief Replace the runtime state.  It is written to retained memory from the next loop.
+     *
+     * @param state Current runtime state
+     */
+    void update(const TrackerSnapshotState& state) {
+        _state = state;
+        _dirty = true;
+    }
+
+    /**
+     * @brief Write pending changes.  This must be executed within every system loop.
+     *
+     */
+    void loop();
+
+    /**
+     * @brief Get snapshot counters.
+     *
+     * @param[out] stats Current counters
+     */
+    void getStats(TrackerSnapshotStats& stats) const {
+        stats = _stats;
+    }
+
+private:
+    TrackerSnapshot();
+
+    struct Copy {
+        uint32_t magic;
+        uint16_t version;
+        uint16_t size;              // size of the state, to detect layout changes
+        uint32_t seq;
+        uint32_t crc;               // over seq and state
+        TrackerSnapshotState state;
+    };
+
+    static TrackerSnapshot* _instance;
+
+    Copy* _copies;
+    size_t _current;                // copy holding the newest state
+    uint32_t _seq;
+    TrackerSnapshotState _state;    // latest state, waiting to be written when dirty
+    TrackerSnapshotState _restored; // state from before the reset, trigger names are referenced for the whole boot
+    bool _dirty;
+    TrackerSnapshotStats _stats;
+
+    static uint32_t crc(const Copy& copy);
+    bool isValid(const Copy& copy) const;
+    static bool isUnexpectedReset(int reason);
+};
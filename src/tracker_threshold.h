@@ -0,0 +1,121 @@
+/*
+ * Copyright (c) 2022 Particle Industries, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+
+// Only the standard library is used here so that threshold evaluation can be compiled off-device.
+
+/**
+ * @brief Side of the threshold that raises an event
+ *
+ */
+enum class TrackerThresholdSide {
+    ABOVE,                          /**< Values at or above the threshold */
+    BELOW,                          /**< Values at or below the threshold */
+};
+
+/**
+ * @brief TrackerThreshold class to count threshold crossings of a measurement with hysteresis.
+ *
+ * @details An event is counted when the value reaches the threshold.  Another is only counted once the value
+ * has moved back past the threshold by the hysteresis amount, so noise around the threshold does not raise
+ * repeated events.  Evaluation and event collection may run on different threads.
+ */
+class TrackerThreshold {
+public:
+    explicit TrackerThreshold(TrackerThresholdSide side) :
+        _side(side),
+        _state(State::NORMAL),
+        _events(0),
+        _eventsLast(0),
+        _latch(false) {
+    }
+
+    /**
+     * @brief Evaluate a new measurement.
+     *
+     * @param value Measurement
+     * @param threshold Threshold that raises an event
+     * @param hysteresis Distance back past the threshold that rearms the event
+     */
+    void evaluate(double value, double threshold, double hysteresis) {
+        bool above = (_side == TrackerThresholdSide::ABOVE);
+        bool beyond = (above) ? (value >= threshold) : (value <= threshold);
+        double rearm = (above) ? threshold - hysteresis : threshold + hysteresis;
+
+        switch (_state) {
+            case State::UNKNOWN:
+                _state = State::NORMAL;
+                // Fall through
+            case State::NORMAL: {
+                if (beyond) {
+                    _events++;
+                    _latch = true;
+                    _state = State::OUTSIDE_LIMIT;
+                }
+                break;
+            }
+
+            case State::OUTSIDE_LIMIT: {
+                if (!beyond) {
+                    _state = State::INSIDE_LIMIT;
+                }
+                break;
+            }
+
+            case State::INSIDE_LIMIT: {
+                if ((above) ? (value <= rearm) : (value >= rearm)) {
+                    _latch = false;
+                    _state = State::NORMAL;
+                }
+                else if (beyond) {
+                    _state = State::OUTSIDE_LIMIT;
+                }
+                break;
+            }
+        }
+    }
+
+    /**
+     * @brief Collect events.
+     *
+     * @param latch Report whether the value is still past the threshold instead of counting new events
+     * @return size_t Events since the last call, or 1 while latched
+     */
+    size_t events(bool latch) {
+        auto eventsCapture = _events.load();
+        auto eventsCount = eventsCapture - _eventsLast;
+        _eventsLast = eventsCapture;
+        return (latch) ? _latch : eventsCount;
+    }
+
+private:
+    enum class State {
+        UNKNOWN,                    // Initial state
+        NORMAL,                     // Value is not outside limit and isn't pending a pass through the hysteresis limit
+        OUTSIDE_LIMIT,              // Value is outside of the given limit
+        INSIDE_LIMIT,               // Value is inside of the give limit and is pending a pass through the hysteresis limit
+    };
+
+    TrackerThresholdSide _side;
+    State _state;
+    std::atomic<size_t> _events;
+    size_t _eventsLast;
+    bool _latch;
+};
@@ -0,0 +1,139 @@
+/*
+ * Copyright (c) 2022 Particle Industries, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "tracker_trace.h"
+#include "tracker_diagnostics.h"
+#include "tracker_export.h"
+#include "cloud_service.h"
+
+constexpr uint32_t TrackerTraceMagic = 0x43525454; // "TTRC"
+constexpr uint16_t TrackerTraceVersion = 1;
+
+// Size of a dump of the records sent in response to the cloud command
+constexpr size_t TrackerTraceCloudDumpSize = sizeof(TrackerTraceDump) + (TrackerTraceCloudRecords * sizeof(TrackerTraceRecord));
+
+retained static uint8_t traceRing[sizeof(uint32_t) * 4 + sizeof(TrackerTraceRecord) * TrackerTraceSlots] __attribute__((aligned(4)));
+
+TrackerTrace *TrackerTrace::_instance = nullptr;
+
+TrackerTrace::TrackerTrace() :
+    _ring((Ring*)traceRing),
+    _diagId(-1),
+    _cloudDump(nullptr),
+    _cloudDumpSize(0),
+    _export(nullptr) {
+
+    static_assert(sizeof(traceRing) == sizeof(Ring), "trace ring size mismatch");
+
+    // Keep the trace from before the reset unless it was never initialized or its layout changed
+    if ((_ring->magic != TrackerTraceMagic) || (_ring->size != sizeof(Ring))) {
+        memset(_ring, 0, sizeof(Ring));
+        _ring->magic = TrackerTraceMagic;
+        _ring->size = sizeof(Ring);
+    }
+}
+
+int TrackerTrace::init() {
+    _ring->boots++;
+    record(TrackerTraceEvent::BOOT, (uint8_t)System.resetReason(), (uint16_t)System.resetReasonData());
+
+    System.on(network_status + cloud_status, systemEvent);
+
+    CloudService::instance().registerCommand("get_trace", std::bind(&TrackerTrace::get_trace_cb, this, std::placeholders::_1));
+
+    // The block is written from the snapshot taken by the command so that its size is stable until it is sent
+    _diagId = TrackerDiagnostics::instance().regBlock("trace", [this](JSONWriter& writer){
+        if (!_cloudDump) {
+            return;
+        }
+        static char hex[(TrackerTraceCloudDumpSize * 2) + 1];
+        for (size_t i = 0; i < _cloudDumpSize; i++) {
+            snprintf(&hex[i * 2], 3, "%02x", _cloudDump[i]);
+        }
+        hex[_cloudDumpSize * 2] = '\0';
+        writer.name("dump").value(hex);
+    });
+
+    return regExport();
+}
+
+// Write the header and the most recent records, oldest first
+size_t TrackerTrace::dump(uint8_t* data, size_t size, size_t records) {
+    auto head = __atomic_load_n(&_ring->head, __ATOMIC_ACQUIRE);
+    size_t count = std::min({(size_t)head, records, TrackerTraceSlots});
+    count = std::min(count, (size - sizeof(TrackerTraceDump)) / sizeof(TrackerTraceRecord));
+
+    TrackerTraceDump header = {
+        .magic = TrackerTraceMagic,
+        .version = TrackerTraceVersion,
+        .count = (uint16_t)count,
+        .boots = _ring->boots,
+        .nowMs = millis(),
+        .unixTime = (Time.isValid()) ? (uint32_t)Time.now() : 0,
+    };
+    memcpy(data, &header, sizeof(header));
+
+    auto out = data + sizeof(header);
+    for (uint32_t seq = head - count; seq != head; seq++) {
+        memcpy(out, &_ring->records[seq & (TrackerTraceSlots - 1)], sizeof(TrackerTraceRecord));
+        out += sizeof(TrackerTraceRecord);
+    }
+
+    return out - data;
+}
+
+int TrackerTrace::get_trace_cb(JSONValue* root) {
+    if (!_cloudDump) {
+        _cloudDump = new uint8_t[TrackerTraceCloudDumpSize];
+        CHECK_TRUE(_cloudDump, SYSTEM_ERROR_NO_MEMORY);
+    }
+    _cloudDumpSize = dump(_cloudDump, TrackerTraceCloudDumpSize, TrackerTraceCloudRecords);
+
+    return TrackerDiagnostics::instance().submit(_diagId, true);
+}
+
+int TrackerTrace::regExport() {
+    constexpr size_t exportSize = sizeof(TrackerTraceDump) + (TrackerTraceSlots * sizeof(TrackerTraceRecord));
+
+    TrackerExportSource source = {
+        .name = "trace",
+        .open = [this](size_t& size) -> int {
+            delete[] _export;
+            _export = new uint8_t[exportSize];
+            CHECK_TRUE(_export, SYSTEM_ERROR_NO_MEMORY);
+            size = dump(_export, exportSize, TrackerTraceSlots);
+            return SYSTEM_ERROR_NONE;
+        },
+        .read = [this](size_t offset, uint8_t* data, size_t length) -> int {
+            CHECK_TRUE(_export, SYSTEM_ERROR_INVALID_STATE);
+            length = std::min(length, exportSize - std::min(offset, exportSize));
+            memcpy(data, _export + offset, length);
+            return (int)length;
+        },
+        .consume = nullptr,
+        .close = [this]() {
+            delete[] _export;
+            _export = nullptr;
+        },
+    };
+
+    return TrackerExport::instance().regSource(source);
+}
+
+void TrackerTrace::systemEvent(system_event_t event, int param) {
+    auto traced = (event == network_status) ? TrackerTraceEvent::NETWORK : TrackerTraceEvent::CLOUD;
+    instance().record(traced, (uint8_t)param);
+}
@@ -0,0 +1,149 @@
+/*
+ * Copyright (c) 2022 Particle Industries, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "Particle.h"
+
+// Number of records held in the trace, must be a power of two
+constexpr size_t TrackerTraceSlots = 128;
+
+// Number of most recent records sent in response to the cloud command
+constexpr size_t TrackerTraceCloudRecords = 48;
+
+static_assert((TrackerTraceSlots & (TrackerTraceSlots - 1)) == 0, "trace size must be a power of two");
+
+/**
+ * @brief Traced events and the meaning of their payload.  Append new events to the end so that traces
+ * from older firmware keep decoding.
+ *
+ */
+enum class TrackerTraceEvent : uint8_t {
+    NONE,                           /**< Unused record */
+    BOOT,                           /**< a: System.resetReason(), b: low bits of System.resetReasonData() */
+    SLEEP_STATE,                    /**< a: TrackerExecutionState entered */
+    SLEEP,                          /**< b: requested sleep duration in seconds */
+    WAKE,                           /**< a: SystemSleepWakeupReason, b: wake pin */
+    MODEM,                          /**< a: 1 when powered on, 0 when powered off */
+    NETWORK,                        /**< a: network_status event parameter */
+    CLOUD,                          /**< a: cloud_status event parameter */
+    GNSS_STATE,                     /**< a: GnssState entered, b: satellites in use */
+    PUBLISH_SEND,                   /**< a: 1 when resent from the disk queue, b: payload length */
+    PUBLISH_RESULT,                 /**< a: CloudServiceStatus, b: low bits of the publish time in seconds */
+    QUEUE_PUSH,                     /**< b: messages in the disk queue */
+    QUEUE_POP,                      /**< a: 1 when removed by an export, b: messages in the disk queue */
+    LOOP,                           /**< a: loop time histogram bucket, b: loop time in units of 100 microseconds */
+    PERF_TRACE,                     /**< a: 1 when loop tracing is enabled, 0 when disabled, b: duration in seconds */
+    SNAPSHOT_RESTORE,               /**< a: TrackerSnapshotFlags restored, b: pending triggers restored */
+};
+
+/**
+ * @brief A trace record, little endian
+ *
+ */
+struct TrackerTraceRecord {
+    uint32_t timeMs;                /**< millis() since the boot recorded by the last preceding BOOT record */
+    uint8_t event;                  /**< TrackerTraceEvent */
+    uint8_t a;                      /**< Event specific */
+    uint16_t b;                     /**< Event specific */
+};
+
+/**
+ * @brief Header of an exported trace, little endian, followed by count records from oldest to newest.
+ * The host anchors the current boot with nowMs and unixTime and walks back through BOOT records.
+ *
+ */
+struct TrackerTraceDump {
+    uint32_t magic;                 /**< TrackerTraceMagic */
+    uint16_t version;               /**< Layout of this header and the records */
+    uint16_t count;                 /**< Number of records that follow */
+    uint32_t boots;                 /**< Boots recorded since the trace was initialized */
+    uint32_t nowMs;                 /**< millis() when exported */
+    uint32_t unixTime;              /**< Time.now() when exported, 0 when the time is not valid */
+};
+
+static_assert(sizeof(TrackerTraceRecord) == 8, "trace record must not be padded");
+
+/**
+ * @brief TrackerTrace class to keep an always on record of state transitions in retained memory.
+ *
+ * @details Each record is eight bytes written with one atomic increment and a single store so tracing
+ * can be left on in the field.  The trace survives resets and can be read over the USB export interface
+ * or requested with the get_trace cloud command, which sends the most recent records in a diagnostics
+ * block.
+ */
+class TrackerTrace {
+public:
+    /**
+     * @brief Singleton class instance access for TrackerTrace.
+     *
+     * @return TrackerTrace&
+     */
+    static TrackerTrace& instance() {
+        if (!_instance) {
+            _instance = new TrackerTrace();
+        }
+        return *_instance;
+    }
+
+    /**
+     * @brief Record the boot and register for system events, the cloud command and export.
+     *
+     * @retval SYSTEM_ERROR_NONE
+     */
+    int init();
+
+    /**
+     * @brief Record an event.  Safe to call from any thread.
+     *
+     * @param event Event type
+     * @param a Event specific payload
+     * @param b Event specific payload
+     */
+    void record(TrackerTraceEvent event, uint8_t a = 0, uint16_t b = 0) {
+        auto seq = __atomic_fetch_add(&_ring->head, 1, __ATOMIC_RELAXED);
+        _ring->records[seq & (TrackerTraceSlots - 1)] = {
+            .timeMs = millis(),
+            .event = (uint8_t)event,
+            .a = a,
+            .b = b,
+        };
+    }
+
+private:
+    TrackerTrace();
+
+    struct Ring {
+        uint32_t magic;
+        uint32_t size;
+        uint32_t head;              // sequence number of the next record
+        uint32_t boots;
+        TrackerTraceRecord records[TrackerTraceSlots];
+    };
+
+    static TrackerTrace* _instance;
+
+    Ring* _ring;
+    int _diagId;
+    uint8_t* _cloudDump;            // records to send in response to the cloud command
+    size_t _cloudDumpSize;
+    uint8_t* _export;               // trace dump while it is being exported
+
+    size_t dump(uint8_t* data, size_t size, size_t records);
+    int get_trace_cb(JSONValue* root);
+    int regExport();
+    static void systemEvent(system_event_t event, int param);
+};
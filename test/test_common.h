@@ -0,0 +1,41 @@
+/*
+ * Copyright (c) 2022 Particle Industries, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cstdio>
+
+// Failed expectations are counted so that each test reports every failure before returning non-zero
+static int testFailures = 0;
+
+#define EXPECT(cond) \
+    do { \
+        if (!(cond)) { \
+            std::fprintf(stderr, "%s:%d: expected %s\n", __FILE__, __LINE__, #cond); \
+            testFailures++; \
+        } \
+    } while (0)
+
+#define EXPECT_EQ(actual, expected) \
+    do { \
+        auto actualValue = (actual); \
+        auto expectedValue = (expected); \
+        if (!(actualValue == expectedValue)) { \
+            std::fprintf(stderr, "%s:%d: expected %s == %s, got %lld and %lld\n", __FILE__, __LINE__, \
+                #actual, #expected, (long long)actualValue, (long long)expectedValue); \
+            testFailures++; \
+        } \
+    } while (0)
@@ -0,0 +1,78 @@
+/*
+ * Copyright (c) 2022 Particle Industries, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "tracker_config_notify.h"
+#include "test_common.h"
+
+enum class TestField {
+    FIRST,
+    SECOND,
+    LAST = 31,
+};
+
+using Change = TrackerConfigChange<TestField>;
+
+static void testChange() {
+    EXPECT_EQ(Change::mask(TestField::FIRST), 0x1u);
+    EXPECT_EQ(Change::mask(TestField::LAST), 0x80000000u);
+
+    EXPECT_EQ(Change::diff(TestField::SECOND, 1, 1), 0u);
+    EXPECT_EQ(Change::diff(TestField::SECOND, 1, 2), 0x2u);
+    EXPECT_EQ(Change::diff(TestField::FIRST, 0.5, 0.5), 0u);
+
+    Change change = {.version = 1, .fields = Change::mask(TestField::SECOND)};
+    EXPECT(change);
+    EXPECT(change.has(TestField::SECOND));
+    EXPECT(!change.has(TestField::FIRST));
+
+    change.fields = 0;
+    EXPECT(!change);
+}
+
+static void testNotifier() {
+    TrackerConfigNotifier<TestField> notifier;
+
+    auto change = notifier.take();
+    EXPECT(!change);
+    EXPECT_EQ(change.version, 0u);
+
+    // A write that changed nothing is not counted
+    notifier.notify(0);
+    EXPECT_EQ(notifier.version(), 0u);
+    EXPECT(!notifier.take());
+
+    // Writes between takes are merged
+    notifier.notify(TestField::FIRST);
+    notifier.notify(Change::diff(TestField::LAST, 1, 2) | Change::diff(TestField::SECOND, 3, 3));
+    change = notifier.take();
+    EXPECT(change.has(TestField::FIRST));
+    EXPECT(!change.has(TestField::SECOND));
+    EXPECT(change.has(TestField::LAST));
+    EXPECT_EQ(change.version, 2u);
+
+    // Taking clears the fields but keeps the version
+    change = notifier.take();
+    EXPECT(!change);
+    EXPECT_EQ(change.version, 2u);
+    EXPECT_EQ(notifier.version(), 2u);
+}
+
+int main() {
+    testChange();
+    testNotifier();
+
+    return (testFailures) ? 1 : 0;
+}
@@ -0,0 +1,53 @@
+/*
+ * Copyright (c) 2022 Particle Industries, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <cstring>
+
+#include "tracker_crc.h"
+#include "test_common.h"
+
+int main() {
+    // Standard check value for CRC-32/ISO-HDLC, the zlib variant
+    const char check[] = "123456789";
+    EXPECT_EQ(tracker_crc32(check, strlen(check)), 0xcbf43926u);
+
+    EXPECT_EQ(tracker_crc32(nullptr, 0), 0u);
+    const uint8_t zero = 0;
+    EXPECT_EQ(tracker_crc32(&zero, 1), 0xd202ef8du);
+
+    // Continuing over several buffers gives the same result as one pass
+    const char text[] = "The quick brown fox jumps over the lazy dog";
+    auto whole = tracker_crc32(text, strlen(text));
+    EXPECT_EQ(whole, 0x414fa339u);
+    for (size_t split = 0; split <= strlen(text); split++) {
+        auto first = tracker_crc32(text, split);
+        EXPECT_EQ(tracker_crc32(text + split, strlen(text) - split, first), whole);
+    }
+
+    // A single flipped bit is always detected
+    uint8_t buffer[64];
+    for (size_t i = 0; i < sizeof(buffer); i++) {
+        buffer[i] = (uint8_t)(i * 37);
+    }
+    auto reference = tracker_crc32(buffer, sizeof(buffer));
+    for (size_t bit = 0; bit < sizeof(buffer) * 8; bit++) {
+        buffer[bit / 8] ^= (uint8_t)(1 << (bit % 8));
+        EXPECT(tracker_crc32(buffer, sizeof(buffer)) != reference);
+        buffer[bit / 8] ^= (uint8_t)(1 << (bit % 8));
+    }
+
+    return (testFailures) ? 1 : 0;
+}
@@ -0,0 +1,86 @@
+/*
+ * Copyright (c) 2022 Particle Industries, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "tracker_threshold.h"
+#include "test_common.h"
+
+// Each evaluation is checked through one instance that counts events and one that reports the latch since
+// collecting from either mode consumes the event count
+struct Pair {
+    TrackerThreshold counted;
+    TrackerThreshold latched;
+
+    explicit Pair(TrackerThresholdSide side) : counted(side), latched(side) {}
+
+    void evaluate(double value, double threshold, double hysteresis, size_t events, size_t latch) {
+        counted.evaluate(value, threshold, hysteresis);
+        latched.evaluate(value, threshold, hysteresis);
+        EXPECT_EQ(counted.events(false), events);
+        EXPECT_EQ(latched.events(true), latch);
+    }
+};
+
+static void testAbove() {
+    Pair high(TrackerThresholdSide::ABOVE);
+
+    high.evaluate(25.0, 30.0, 2.0, 0, 0);
+
+    // Reaching the threshold counts one event and latches
+    high.evaluate(30.0, 30.0, 2.0, 1, 1);
+
+    // Noise within the hysteresis band does not count again
+    high.evaluate(29.0, 30.0, 2.0, 0, 1);
+    high.evaluate(31.0, 30.0, 2.0, 0, 1);
+    high.evaluate(28.5, 30.0, 2.0, 0, 1);
+    high.evaluate(30.5, 30.0, 2.0, 0, 1);
+
+    // Leaving the threshold and then passing the hysteresis limit rearms and clears the latch
+    high.evaluate(28.0, 30.0, 2.0, 0, 1);
+    high.evaluate(27.0, 30.0, 2.0, 0, 0);
+    high.evaluate(30.0, 30.0, 2.0, 1, 1);
+}
+
+static void testBelow() {
+    Pair low(TrackerThresholdSide::BELOW);
+
+    low.evaluate(10.0, 5.0, 1.0, 0, 0);
+    low.evaluate(5.0, 5.0, 1.0, 1, 1);
+    low.evaluate(5.5, 5.0, 1.0, 0, 1);
+    low.evaluate(4.0, 5.0, 1.0, 0, 1);
+    low.evaluate(6.0, 5.0, 1.0, 0, 1);
+    low.evaluate(6.0, 5.0, 1.0, 0, 0);
+    low.evaluate(3.0, 5.0, 1.0, 1, 1);
+}
+
+static void testCollectLater() {
+    TrackerThreshold high(TrackerThresholdSide::ABOVE);
+
+    // Events between two collections add up
+    high.evaluate(1.0, 1.0, 0.0);
+    high.evaluate(0.5, 1.0, 0.0);
+    high.evaluate(0.5, 1.0, 0.0);
+    high.evaluate(1.5, 1.0, 0.0);
+    EXPECT_EQ(high.events(false), 2u);
+    EXPECT_EQ(high.events(false), 0u);
+}
+
+int main() {
+    testAbove();
+    testBelow();
+    testCollectLater();
+
+    return (testFailures) ? 1 : 0;
+}